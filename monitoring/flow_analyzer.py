@@ -20,7 +20,7 @@ class FlowTuple(Structure):
         ("src_port", c_ushort),
         ("dst_port", c_ushort),
         ("protocol", c_ubyte),
-        ("padding", c_ubyte * 3),
+        ("tenant", c_ubyte * 3),
     ]
 
 class FlowState(Structure):
@@ -29,12 +29,9 @@ class FlowState(Structure):
         ("byte_count", c_ulonglong),
         ("last_seen", c_ulonglong),
         ("class_id", c_uint),
-        ("queue_id", c_uint),
-        ("tokens", c_uint),
-        ("last_token_update", c_uint),
-        ("priority", c_ushort),
-        ("weight", c_ushort),
-        ("deficit", c_uint),
+        ("behav_state", c_ubyte),
+        ("behav_class", c_ubyte),
+        ("pad", c_ushort),
     ]
 
 CLASS_NAMES = {
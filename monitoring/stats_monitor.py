@@ -24,6 +24,16 @@ class CPUStats(Structure):
         ("xdp_drop", c_ulonglong),
         ("xdp_tx", c_ulonglong),
         ("xdp_redirect", c_ulonglong),
+        ("hh_demoted", c_ulonglong),
+        ("sub_dropped", c_ulonglong),
+        ("hw_hash_packets", c_ulonglong),
+        ("hw_ts_packets", c_ulonglong),
+        ("hw_ts_delay_ns", c_ulonglong),
+        ("rules_checked", c_ulonglong),
+        ("frag_hits", c_ulonglong),
+        ("frag_misses", c_ulonglong),
+        ("tunnel_packets", c_ulonglong),
+        ("flow_records_lost", c_ulonglong),
     ]
 
 class QueueStats(Structure):
@@ -37,6 +47,13 @@ class QueueStats(Structure):
         ("current_qlen", c_uint),
         ("max_qlen", c_uint),
         ("total_latency_ns", c_ulonglong),
+        ("ecn_marked", c_ulonglong),
+        ("aqm_dropped", c_ulonglong),
+        ("l4s_packets", c_ulonglong),
+        ("l4s_marked", c_ulonglong),
+        ("borrowed_bytes", c_ulonglong),
+        ("meter_yellow", c_ulonglong),
+        ("meter_red", c_ulonglong),
     ]
 
 class FlowState(Structure):
@@ -45,12 +62,9 @@ class FlowState(Structure):
         ("byte_count", c_ulonglong),
         ("last_seen", c_ulonglong),
         ("class_id", c_uint),
-        ("queue_id", c_uint),
-        ("tokens", c_uint),
-        ("last_token_update", c_uint),
-        ("priority", c_ushort),
-        ("weight", c_ushort),
-        ("deficit", c_uint),
+        ("behav_state", c_ubyte),
+        ("behav_class", c_ubyte),
+        ("pad", c_ushort),
     ]
 
 class FlowTuple(Structure):
@@ -60,7 +74,7 @@ class FlowTuple(Structure):
         ("src_port", c_ushort),
         ("dst_port", c_ushort),
         ("protocol", c_ubyte),
-        ("padding", c_ubyte * 3),
+        ("tenant", c_ubyte * 3),
     ]
 
 CLASS_NAMES = {
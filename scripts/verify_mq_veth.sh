@@ -0,0 +1,147 @@
+#!/bin/bash
+#
+# Qdisc Hierarchy Verification on Multi-Queue veth
+# Builds the mq/HTB hierarchy on a 4-queue veth pair, sends marked UDP
+# flows through it and checks that each class's leaf carries its traffic
+# on more than one TX queue
+#
+
+export PATH=$PATH:/sbin:/usr/sbin
+
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m'
+
+NS="qos_mq"
+DEV="veth-qos0"
+PEER="veth-qos1"
+QUEUES=4
+FLOWS=64
+CONFIG="/tmp/qos_mq_veth.json"
+LOG="/tmp/qos_mq_veth.log"
+
+if [ "$EUID" -ne 0 ]; then
+    echo -e "${RED}Error: This script must be run as root${NC}"
+    exit 1
+fi
+
+if [ ! -f "./build/xdp_scheduler.o" ] || [ ! -f "./build/tc_scheduler.o" ]; then
+    echo -e "${RED}XDP programs not built. Run: make${NC}"
+    exit 1
+fi
+
+cleanup() {
+    pkill -f "control_plane -i $DEV" 2>/dev/null
+    sleep 1
+    iptables -t mangle -D OUTPUT -o $DEV -p udp --dport 9001 -j MARK --set-mark 1 2>/dev/null
+    iptables -t mangle -D OUTPUT -o $DEV -p udp --dport 9002 -j MARK --set-mark 2 2>/dev/null
+    ip link del $DEV 2>/dev/null
+    ip netns del $NS 2>/dev/null
+    rm -f $CONFIG
+}
+trap cleanup EXIT
+
+echo ""
+echo "================================================================"
+echo "       XDP QoS - mq/HTB Hierarchy on Multi-Queue veth"
+echo "================================================================"
+echo ""
+
+# Topology: host veth with $QUEUES TX queues, peer in a namespace
+cleanup
+ip netns add $NS
+ip link add $DEV numtxqueues $QUEUES numrxqueues $QUEUES type veth \
+    peer name $PEER numtxqueues $QUEUES numrxqueues $QUEUES
+ip link set $PEER netns $NS
+ip addr add 10.200.0.1/24 dev $DEV
+ip link set $DEV up
+ip netns exec $NS ip addr add 10.200.0.2/24 dev $PEER
+ip netns exec $NS ip link set $PEER up
+
+# Classes 1 and 2 by socket mark, set per destination port
+iptables -t mangle -A OUTPUT -o $DEV -p udp --dport 9001 -j MARK --set-mark 1
+iptables -t mangle -A OUTPUT -o $DEV -p udp --dport 9002 -j MARK --set-mark 2
+
+cat > $CONFIG <<EOF
+{
+  "global": { "scheduler": "strict_priority", "default_class": 0 },
+  "qdisc": { "link_rate": 125000000 },
+  "egress": {
+    "marks": [
+      { "mark": 1, "class_id": 1 },
+      { "mark": 2, "class_id": 2 }
+    ]
+  },
+  "classes": [
+    { "id": 0, "priority": 2, "weight": 1, "min_bandwidth": 1250000 },
+    { "id": 1, "priority": 0, "weight": 4, "min_bandwidth": 12500000 },
+    { "id": 2, "priority": 1, "weight": 2, "min_bandwidth": 6250000 }
+  ]
+}
+EOF
+
+echo -n "Starting control plane... "
+./bin/control_plane -i $DEV -x ./build/xdp_scheduler.o -t ./build/tc_scheduler.o \
+    -c $CONFIG > $LOG 2>&1 &
+sleep 3
+if ! tc qdisc show dev $DEV | grep -q "qdisc mq 1: root"; then
+    echo -e "${RED}✗ FAILED${NC}"
+    echo "  mq root not installed, see $LOG"
+    exit 1
+fi
+echo -e "${GREEN}✓ OK${NC}"
+
+# One socket (so one source port and hash) per send
+echo -n "Sending $FLOWS flows per class... "
+for i in $(seq 1 $FLOWS); do
+    echo "x" > /dev/udp/10.200.0.2/9001
+    echo "x" > /dev/udp/10.200.0.2/9002
+done
+sleep 1
+echo -e "${GREEN}✓ done${NC}"
+
+# Packets sent by leaf :<class + 1> of each per-queue HTB
+leaf_counts() {
+    tc -s class show dev $DEV | awk -v minor="$1" '
+        $1 == "class" { cur = ""; if ($2 == "htb") { split($3, id, ":"); cur = id[2] } }
+        $1 == "Sent" && cur == minor { print $4; cur = "" }'
+}
+
+rc=0
+for class in 1 2; do
+    minor=$((class + 1))
+    counts=$(leaf_counts $minor)
+    total=0
+    queues=0
+    for c in $counts; do
+        total=$((total + c))
+        [ "$c" -gt 0 ] && queues=$((queues + 1))
+    done
+
+    echo -n "Class $class leaf: $total packets on $queues queue(s)... "
+    if [ "$total" -ge "$FLOWS" ] && [ "$queues" -ge 2 ]; then
+        echo -e "${GREEN}✓ OK${NC}"
+    elif [ "$total" -ge "$FLOWS" ]; then
+        echo -e "${YELLOW}⚠ all on one queue${NC}"
+    else
+        echo -e "${RED}✗ FAILED${NC} (expected at least $FLOWS)"
+        rc=1
+    fi
+done
+
+# Nothing marked should have fallen through to the default leaf
+default_total=0
+for c in $(leaf_counts 1); do
+    default_total=$((default_total + c))
+done
+echo -n "Default leaf: $default_total packets... "
+if [ "$default_total" -lt "$FLOWS" ]; then
+    echo -e "${GREEN}✓ OK${NC}"
+else
+    echo -e "${RED}✗ FAILED${NC} (marked traffic reached the default class)"
+    rc=1
+fi
+
+echo ""
+exit $rc
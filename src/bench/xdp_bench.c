@@ -0,0 +1,625 @@
+/*
+ * XDP Flow Table Benchmark
+ *
+ * Loads the XDP classifier privately (no pinning, nothing attached), fills
+ * its flow table with N established flows and times the program over
+ * BPF_PROG_TEST_RUN with packets of randomly chosen flows. Also reports the
+ * kernel memory charged for a flow table of N entries with the legacy
+ * 64-byte and the current 32-byte flow record.
+ *
+ * With -T the same flows are also sent encapsulated (VXLAN, GENEVE, GRE or
+ * IP-in-IP) with tunnel decapsulation enabled, and the extra cost per
+ * packet can be held to a budget (-B) for use in scripts.
+ *
+ * With -p the classification rules of a policy are installed, packets are
+ * spread over its rules, and the generic classifier is compared against
+ * the same policy compiled into the program.
+ *
+ * Usage: xdp_bench -x build/xdp_scheduler.o [-b baseline.o] [-n flows]
+ *                  [-T vxlan|geneve|gre|ipip [-B ns]] [-p policy.json]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "../control/bpf_rodata.h"
+#include "../control/policy_compiler.h"
+
+#define DEFAULT_FLOWS (1 << 20)
+#define DEFAULT_RUNS 100000
+#define FILL_BATCH 4096
+
+/* Record fields the benchmark seeds; same in both flow_state layouts */
+#define FLOW_CLASS_ID_OFFSET 24   /* after packet_count, byte_count, last_seen */
+#define FLOW_CLASS_DEFAULT 7
+
+#define LEGACY_FLOW_STATE_SIZE 64
+#define COMPACT_FLOW_STATE_SIZE 32
+
+enum encap_type {
+    ENCAP_NONE,
+    ENCAP_VXLAN,
+    ENCAP_GENEVE,
+    ENCAP_GRE,
+    ENCAP_IPIP,
+    ENCAP_MAX,
+};
+
+static const char *encap_names[ENCAP_MAX] = {
+    "plain", "vxlan", "geneve", "gre", "ipip",
+};
+
+/* Program timed in each object; -F picks the multi-buffer variant */
+static const char *prog_name = "xdp_packet_classifier";
+
+/* Rules installed and targeted with -p */
+static struct class_rule policy_rules[RULE_BANK_SIZE];
+static int n_policy_rules;
+
+#define BENCH_POLICY_OBJ "build/xdp_bench_policy.o"
+
+#define PKT_BUF_SIZE 256
+#define PAYLOAD_SIZE 22
+#define VXLAN_PORT 4789
+#define GENEVE_PORT 6081
+#define ETH_P_TEB_ 0x6558       /* Transparent Ethernet bridging */
+#define GRE_KEY 0x2000
+#define OUTER_SRC 0x0afe0001    /* Tunnel endpoints, 10.254.0.1 -> .2 */
+#define OUTER_DST 0x0afe0002
+
+struct bench_result {
+    __u32 value_size;
+    __u64 memlock;
+    double avg_ns;
+    __u32 p50_ns;
+    __u32 p99_ns;
+};
+
+/*
+ * Flow i, spread over 10.0.0.0/8, the source ports and (tunnelled) 4096
+ * VNIs. With a policy, flows go round its rules and one unmatched flow
+ * per round, each within its rule's destination ports.
+ */
+static void make_flow(struct flow_tuple *flow, __u32 i, int encap)
+{
+    __u32 vni = 1 + (i & 0xfff);
+    __u32 r = i % (n_policy_rules + 1);
+    
+    memset(flow, 0, sizeof(*flow));
+    flow->src_ip = htonl(0x0a000000 | (i >> 4));
+    flow->dst_ip = htonl(0xc0a80101);
+    flow->src_port = 1024 + (i & 0xf);
+    flow->dst_port = 9000;
+    flow->protocol = IPPROTO_UDP;
+    
+    if (r < n_policy_rules) {
+        const struct class_rule *rule = &policy_rules[r];
+        __u32 span = rule->dst_port_max >= rule->dst_port_min ?
+                     rule->dst_port_max - rule->dst_port_min + 1 : 1;
+        
+        if (rule->protocol)
+            flow->protocol = rule->protocol;
+        if (rule->dst_port_min || rule->dst_port_max)
+            flow->dst_port = rule->dst_port_min +
+                             (i / (n_policy_rules + 1)) % span;
+        if (flow->protocol == IPPROTO_ICMP) {
+            flow->src_port = 0;
+            flow->dst_port = 0;
+        }
+    }
+    
+    /* IP-in-IP has no VNI or key */
+    if (encap != ENCAP_NONE && encap != ENCAP_IPIP) {
+        flow->tenant[0] = vni >> 16;
+        flow->tenant[1] = vni >> 8;
+        flow->tenant[2] = vni;
+    }
+}
+
+static void *put_eth(void *p)
+{
+    struct ethhdr *eth = p;
+    
+    memset(eth->h_dest, 0x02, ETH_ALEN);
+    memset(eth->h_source, 0x04, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+    return eth + 1;
+}
+
+static void *put_ipv4(void *p, __u32 saddr, __u32 daddr, __u8 protocol,
+                      __u16 payload_len)
+{
+    struct iphdr *ip = p;
+    
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = protocol;
+    ip->tot_len = htons(sizeof(*ip) + payload_len);
+    ip->saddr = saddr;
+    ip->daddr = daddr;
+    return ip + 1;
+}
+
+static void *put_udp(void *p, __u16 sport, __u16 dport, __u16 payload_len)
+{
+    struct udphdr *udp = p;
+    
+    memset(udp, 0, sizeof(*udp));
+    udp->source = sport;
+    udp->dest = dport;
+    udp->len = htons(sizeof(*udp) + payload_len);
+    return udp + 1;
+}
+
+/* A UDP packet of the flow, wrapped in the given encapsulation */
+static __u32 build_packet(__u8 *buf, const struct flow_tuple *flow, int encap)
+{
+    __u8 inner[sizeof(struct iphdr) + sizeof(struct udphdr) + PAYLOAD_SIZE];
+    __u16 inner_len = sizeof(inner);
+    __u8 *p;
+    
+    memset(buf, 0, PKT_BUF_SIZE);
+    memset(inner, 0, sizeof(inner));
+    p = put_ipv4(inner, flow->src_ip, flow->dst_ip, flow->protocol,
+                 sizeof(struct udphdr) + PAYLOAD_SIZE);
+    put_udp(p, htons(flow->src_port), htons(flow->dst_port), PAYLOAD_SIZE);
+    
+    p = put_eth(buf);
+    switch (encap) {
+    case ENCAP_VXLAN:
+    case ENCAP_GENEVE: {
+        __u16 hdr_len = 8 + sizeof(struct ethhdr) + inner_len;
+        
+        p = put_ipv4(p, htonl(OUTER_SRC), htonl(OUTER_DST), IPPROTO_UDP,
+                     sizeof(struct udphdr) + hdr_len);
+        p = put_udp(p, htons(49152), htons(encap == ENCAP_VXLAN ? VXLAN_PORT
+                                                               : GENEVE_PORT),
+                    hdr_len);
+        if (encap == ENCAP_VXLAN) {
+            p[0] = 0x08;                        /* VNI present */
+        } else {
+            p[2] = ETH_P_TEB_ >> 8;             /* Protocol type */
+            p[3] = ETH_P_TEB_ & 0xff;
+        }
+        memcpy(p + 4, flow->tenant, 3);
+        p = put_eth(p + 8);
+        break;
+    }
+    case ENCAP_GRE:
+        p = put_ipv4(p, htonl(OUTER_SRC), htonl(OUTER_DST), IPPROTO_GRE,
+                     8 + inner_len);
+        p[0] = GRE_KEY >> 8;
+        p[2] = ETH_P_IP >> 8;
+        p[3] = ETH_P_IP & 0xff;
+        memcpy(p + 5, flow->tenant, 3);         /* Key, low 24 bits */
+        p += 8;
+        break;
+    case ENCAP_IPIP:
+        p = put_ipv4(p, htonl(OUTER_SRC), htonl(OUTER_DST), IPPROTO_IPIP,
+                     inner_len);
+        break;
+    }
+    
+    memcpy(p, inner, inner_len);
+    return p - buf + inner_len;
+}
+
+/* Kernel memory charged to a BPF object, from its fdinfo */
+static __u64 fd_memlock(int fd)
+{
+    char path[64], line[128];
+    __u64 memlock = 0;
+    FILE *f;
+    
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "memlock: %llu", (unsigned long long *)&memlock) == 1)
+            break;
+    }
+    
+    fclose(f);
+    return memlock;
+}
+
+/* Memory of an empty, preallocated hash table with the given record size */
+static __u64 table_memlock(__u32 value_size, __u32 flows)
+{
+    __u64 memlock;
+    int fd;
+    
+    fd = bpf_map_create(BPF_MAP_TYPE_HASH, "bench_flows",
+                        sizeof(struct flow_tuple), value_size, flows, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "Error: creating %u-entry table: %s\n",
+                flows, strerror(errno));
+        return 0;
+    }
+    
+    memlock = fd_memlock(fd);
+    close(fd);
+    return memlock;
+}
+
+/* Insert flows 0..N-1 as established default-class flows */
+static int fill_flow_table(int fd, __u32 value_size, __u32 flows, int encap)
+{
+    struct flow_tuple *keys;
+    __u8 *values;
+    __u32 i, n, count;
+    int err = 0;
+    
+    keys = calloc(FILL_BATCH, sizeof(*keys));
+    values = calloc(FILL_BATCH, value_size);
+    if (!keys || !values) {
+        err = -ENOMEM;
+        goto out;
+    }
+    
+    for (n = 0; n < FILL_BATCH; n++) {
+        __u32 class_id = FLOW_CLASS_DEFAULT;
+    
+        memcpy(values + n * value_size + FLOW_CLASS_ID_OFFSET,
+               &class_id, sizeof(class_id));
+    }
+    
+    for (i = 0; i < flows && !err; i += count) {
+        count = flows - i < FILL_BATCH ? flows - i : FILL_BATCH;
+        for (n = 0; n < count; n++)
+            make_flow(&keys[n], i + n, encap);
+    
+        if (bpf_map_update_batch(fd, keys, values, &count, NULL) == 0)
+            continue;
+    
+        /* Kernels without batch support for hash maps */
+        if (errno != EINVAL && errno != EOPNOTSUPP) {
+            err = -errno;
+            break;
+        }
+        count = flows - i < FILL_BATCH ? flows - i : FILL_BATCH;
+        for (n = 0; n < count && !err; n++) {
+            if (bpf_map_update_elem(fd, &keys[n], values, BPF_ANY))
+                err = -errno;
+        }
+    }
+    
+out:
+    free(keys);
+    free(values);
+    return err;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    __u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/* The policy's rules as the control plane installs them: bank 0, in order */
+static int install_rules(struct bpf_object *obj)
+{
+    struct rule_set rs = { .base = 0, .count = n_policy_rules };
+    struct bpf_map *rules_map, *set_map;
+    __u32 key;
+    int i;
+    
+    rules_map = bpf_object__find_map_by_name(obj, "class_rules");
+    set_map = bpf_object__find_map_by_name(obj, "rule_set");
+    if (!rules_map || !set_map)
+        return -1;
+    
+    for (i = 0; i < n_policy_rules; i++) {
+        key = i;
+        if (bpf_map_update_elem(bpf_map__fd(rules_map), &key,
+                                &policy_rules[i], BPF_ANY))
+            return -errno;
+    }
+    
+    key = 0;
+    if (bpf_map_update_elem(bpf_map__fd(set_map), &key, &rs, BPF_ANY))
+        return -errno;
+    return 0;
+}
+
+/*
+ * Load an XDP object privately, fill its flow table and time it with
+ * packets of the given encapsulation (decapsulated if decap is set)
+ */
+static int bench_object(const char *path, __u32 flows, __u32 runs,
+                        int encap, int decap, struct bench_result *res)
+{
+    struct bpf_map_info info = {};
+    __u32 info_len = sizeof(info);
+    struct bpf_object *obj;
+    struct bpf_program *prog;
+    struct bpf_map *map;
+    struct flow_tuple flow;
+    __u8 pkt[PKT_BUF_SIZE];
+    __u32 pkt_len;
+    __u32 *samples = NULL;
+    __u64 total = 0;
+    __u32 i;
+    int prog_fd, flow_fd;
+    int err;
+    
+    obj = bpf_object__open_file(path, NULL);
+    if (libbpf_get_error(obj)) {
+        fprintf(stderr, "Error: opening %s\n", path);
+        return -1;
+    }
+    
+    /* Private copies of every map, so a running scheduler is untouched */
+    bpf_object__for_each_map(map, obj)
+        bpf_map__set_pin_path(map, NULL);
+    
+    map = bpf_object__find_map_by_name(obj, "flow_table");
+    if (!map) {
+        fprintf(stderr, "Error: %s has no flow_table\n", path);
+        err = -1;
+        goto out;
+    }
+    bpf_map__set_max_entries(map, flows);
+    
+    if (decap && set_rodata_u32(obj, "tunnel_decap", 1)) {
+        err = -1;
+        goto out;
+    }
+    
+    if (!bpf_object__find_program_by_name(obj, prog_name)) {
+        fprintf(stderr, "Error: %s has no %s\n", path, prog_name);
+        err = -1;
+        goto out;
+    }
+    bpf_object__for_each_program(prog, obj) {
+        if (strcmp(bpf_program__name(prog), prog_name) != 0)
+            bpf_program__set_autoload(prog, false);
+    }
+    
+    err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "Error: loading %s: %d\n", path, err);
+        goto out;
+    }
+    
+    prog = bpf_object__find_program_by_name(obj, prog_name);
+    prog_fd = bpf_program__fd(prog);
+    flow_fd = bpf_map__fd(map);
+    
+    err = bpf_obj_get_info_by_fd(flow_fd, &info, &info_len);
+    if (err) {
+        fprintf(stderr, "Error: flow_table info: %s\n", strerror(errno));
+        goto out;
+    }
+    res->value_size = info.value_size;
+    res->memlock = fd_memlock(flow_fd);
+    
+    if (n_policy_rules) {
+        err = install_rules(obj);
+        if (err) {
+            fprintf(stderr, "Error: installing rules: %s\n", strerror(-err));
+            goto out;
+        }
+    }
+    
+    printf("  %s: filling %u %s flows (%u-byte records)...\n",
+           path, flows, encap_names[encap], info.value_size);
+    err = fill_flow_table(flow_fd, info.value_size, flows, encap);
+    if (err) {
+        fprintf(stderr, "Error: filling flow_table: %s\n", strerror(-err));
+        goto out;
+    }
+    
+    samples = calloc(runs, sizeof(*samples));
+    if (!samples) {
+        err = -1;
+        goto out;
+    }
+    
+    /* One run per packet, so each sample is a single lookup and update */
+    srand(1);
+    for (i = 0; i < runs; i++) {
+        make_flow(&flow, (__u32)rand() % flows, encap);
+        pkt_len = build_packet(pkt, &flow, encap);
+        
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+            .data_in = pkt,
+            .data_size_in = pkt_len,
+            .repeat = 1,
+        );
+    
+        err = bpf_prog_test_run_opts(prog_fd, &opts);
+        if (err) {
+            fprintf(stderr, "Error: test run: %s\n", strerror(errno));
+            goto out;
+        }
+        samples[i] = opts.duration;
+        total += opts.duration;
+    }
+    
+    qsort(samples, runs, sizeof(*samples), cmp_u32);
+    res->avg_ns = (double)total / runs;
+    res->p50_ns = samples[runs / 2];
+    res->p99_ns = samples[(__u64)runs * 99 / 100];
+    
+out:
+    free(samples);
+    bpf_object__close(obj);
+    return err;
+}
+
+static void print_result(const char *name, const struct bench_result *res)
+{
+    printf("  %-10s %4u B  %9.1f MiB  %8.1f  %6u  %6u\n",
+           name, res->value_size, res->memlock / (1024.0 * 1024.0),
+           res->avg_ns, res->p50_ns, res->p99_ns);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s -x <xdp_obj> [options]\n", prog);
+    printf("Options:\n");
+    printf("  -x, --xdp-obj FILE    XDP object to benchmark\n");
+    printf("  -b, --baseline FILE   XDP object to compare against\n");
+    printf("  -n, --flows N         Flows in the table (default: %u)\n",
+           DEFAULT_FLOWS);
+    printf("  -r, --runs N          Packets timed (default: %u)\n",
+           DEFAULT_RUNS);
+    printf("  -T, --tunnel TYPE     Also time vxlan|geneve|gre|ipip packets, decapsulated\n");
+    printf("  -B, --budget NS       Fail if decapsulation adds more than NS per packet\n");
+    printf("  -F, --frags           Time the multi-buffer (xdp.frags) program\n");
+    printf("  -p, --policy FILE     Install FILE's rules and compare with them compiled in\n");
+    printf("  -s, --src FILE        XDP source to compile the policy into (default: %s)\n",
+           POLICY_XDP_SRC);
+    printf("  -h, --help            Show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_result cur = {}, base = {}, tun = {}, comp = {};
+    const char *xdp_obj = NULL, *baseline = NULL;
+    const char *policy = NULL, *policy_src = POLICY_XDP_SRC;
+    __u32 flows = DEFAULT_FLOWS, runs = DEFAULT_RUNS;
+    int encap = ENCAP_NONE;
+    double budget = 0, extra;
+    int opt;
+    
+    static struct option long_options[] = {
+        {"xdp-obj", required_argument, 0, 'x'},
+        {"baseline", required_argument, 0, 'b'},
+        {"flows", required_argument, 0, 'n'},
+        {"runs", required_argument, 0, 'r'},
+        {"tunnel", required_argument, 0, 'T'},
+        {"budget", required_argument, 0, 'B'},
+        {"frags", no_argument, 0, 'F'},
+        {"policy", required_argument, 0, 'p'},
+        {"src", required_argument, 0, 's'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    while ((opt = getopt_long(argc, argv, "x:b:n:r:T:B:Fp:s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'x':
+            xdp_obj = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'n':
+            flows = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            runs = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            for (encap = ENCAP_VXLAN; encap < ENCAP_MAX; encap++) {
+                if (!strcmp(optarg, encap_names[encap]))
+                    break;
+            }
+            if (encap == ENCAP_MAX) {
+                fprintf(stderr, "Error: unknown tunnel type %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            budget = strtod(optarg, NULL);
+            break;
+        case 'F':
+            prog_name = "xdp_packet_classifier_frags";
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 's':
+            policy_src = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (!xdp_obj || !flows || !runs) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (policy) {
+        n_policy_rules = policy_read_rules(policy, policy_rules);
+        if (n_policy_rules < 0 ||
+            policy_compile(policy, policy_src, BENCH_POLICY_OBJ))
+            return 1;
+        printf("\n");
+    }
+    
+    printf("Flow table memory at %u flows (preallocated hash):\n", flows);
+    printf("  legacy  (%u-byte record): %8.1f MiB\n", LEGACY_FLOW_STATE_SIZE,
+           table_memlock(LEGACY_FLOW_STATE_SIZE, flows) / (1024.0 * 1024.0));
+    printf("  compact (%u-byte record): %8.1f MiB\n", COMPACT_FLOW_STATE_SIZE,
+           table_memlock(COMPACT_FLOW_STATE_SIZE, flows) / (1024.0 * 1024.0));
+    printf("\n");
+    
+    printf("Classifier latency over %u packets:\n", runs);
+    if (bench_object(xdp_obj, flows, runs, ENCAP_NONE, encap != ENCAP_NONE, &cur))
+        return 1;
+    if (encap != ENCAP_NONE &&
+        bench_object(xdp_obj, flows, runs, encap, 1, &tun))
+        return 1;
+    if (baseline &&
+        bench_object(baseline, flows, runs, ENCAP_NONE, 0, &base))
+        return 1;
+    if (policy &&
+        bench_object(BENCH_POLICY_OBJ, flows, runs, ENCAP_NONE, 0, &comp))
+        return 1;
+    
+    printf("\n  %-10s %6s  %13s  %8s  %6s  %6s\n",
+           "object", "record", "flow_table", "avg ns", "p50", "p99");
+    print_result("current", &cur);
+    if (encap != ENCAP_NONE)
+        print_result(encap_names[encap], &tun);
+    if (baseline)
+        print_result("baseline", &base);
+    if (policy)
+        print_result("compiled", &comp);
+    
+    if (policy)
+        printf("\n  %s, %d rules: compiled %+.1f ns per packet (%.1f vs %.1f)\n",
+               policy, n_policy_rules, comp.avg_ns - cur.avg_ns,
+               comp.avg_ns, cur.avg_ns);
+    
+    if (encap != ENCAP_NONE) {
+        extra = tun.avg_ns - cur.avg_ns;
+        printf("\n  %s decapsulation: %+.1f ns per packet", encap_names[encap],
+               extra);
+        if (budget > 0) {
+            printf(" (budget %.1f ns: %s)", budget,
+                   extra <= budget ? "OK" : "EXCEEDED");
+            if (extra > budget) {
+                printf("\n");
+                return 2;
+            }
+        }
+        printf("\n");
+    }
+    
+    return 0;
+}
@@ -1,6 +1,12 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+/*
+ * Shared by the BPF programs and, through the UAPI headers, by the control
+ * plane, simulator and benchmark. Only the BPF build needs the definitions
+ * below; userspace takes them from <linux/types.h> and <linux/bpf.h>.
+ */
+#ifdef __BPF__
 /* Basic type definitions for BPF */
 typedef unsigned char __u8;
 typedef unsigned short __u16;
@@ -18,13 +24,27 @@ typedef __u64 __be64;
 typedef __u16 __sum16;
 typedef __u32 __wsum;
 
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
 /* BPF map types */
 #define BPF_MAP_TYPE_HASH 1
 #define BPF_MAP_TYPE_ARRAY 2
 #define BPF_MAP_TYPE_PERCPU_ARRAY 6
+#define BPF_MAP_TYPE_LRU_HASH 9
+#define BPF_MAP_TYPE_LPM_TRIE 11
+#define BPF_MAP_TYPE_SK_STORAGE 24
+#define BPF_MAP_TYPE_RINGBUF 27
 
 /* BPF map flags */
 #define BPF_ANY 0
+#define BPF_NOEXIST 1
+#define BPF_F_NO_PREALLOC 1
+#define BPF_SK_STORAGE_GET_F_CREATE 1
+
+/* bpf_ringbuf_submit flags */
+#define BPF_RB_NO_WAKEUP 1
 
 /* XDP metadata structure */
 struct xdp_md {
@@ -35,6 +55,21 @@ struct xdp_md {
     __u32 rx_queue_index;
     __u32 egress_ifindex;
 };
+#else
+#include <linux/types.h>
+#include <linux/bpf.h>
+#endif /* __BPF__ */
+
+/* RSS hash type bits reported by bpf_xdp_metadata_rx_hash() */
+enum xdp_rss_hash_type {
+    XDP_RSS_L3_IPV4 = 1 << 0,
+    XDP_RSS_L3_IPV6 = 1 << 1,
+    XDP_RSS_L3_DYNHDR = 1 << 2,
+    XDP_RSS_L4 = 1 << 3,        /* Hash covers the L4 ports */
+};
+
+/* NIC RX timestamps further back than this are from an unsynced clock */
+#define HW_TS_MAX_DELAY_NS 1000000000ULL
 
 /* Maximum number of flows to track */
 #define MAX_FLOWS 65536
@@ -69,28 +104,232 @@ enum sched_algorithm {
     SCHED_PIFO = 4,
 };
 
-/* Flow tuple for identification */
+/* Active queue management algorithms (per class) */
+enum aqm_algorithm {
+    AQM_NONE = 0,
+    AQM_CODEL = 1,
+    AQM_PIE = 2,
+    AQM_DUALPI2 = 3,        /* L4S DualQ coupled AQM (RFC 9332) */
+};
+
+/* Three-color meter per class (RFC 2697 / RFC 2698, color-blind) */
+enum meter_mode {
+    METER_NONE = 0,         /* Plain token bucket at rate_limit */
+    METER_SRTCM = 1,        /* CIR = rate_limit, CBS = burst_size, EBS */
+    METER_TRTCM = 2,        /* CIR/CBS as above, PIR = peak_rate, PBS */
+};
+
+enum meter_color {
+    METER_GREEN = 0,
+    METER_YELLOW = 1,
+    METER_RED = 2,
+};
+
+/* Class flags */
+#define CLASS_FLAG_ECN (1 << 0)     /* ECN-mark ECT packets instead of dropping */
+#define CLASS_FLAG_YELLOW_DSCP (1 << 1) /* Remark yellow packets to yellow_dscp */
+#define CLASS_FLAG_RED_ECN (1 << 2) /* CE-mark red ECT packets instead of dropping */
+#define CLASS_FLAG_REWRITE_DSCP (1 << 3) /* TC rewrites DSCP to egress_dscp */
+
+/* Global flags */
+#define GLOBAL_FLAG_SUBSCRIBERS (1 << 0) /* Per-subscriber policing configured */
+#define GLOBAL_FLAG_DSCP (1 << 1)        /* dscp_class table configured */
+#define GLOBAL_FLAG_DSCP_FIRST (1 << 2)  /* A mapped DSCP skips the tuple rules */
+#define GLOBAL_FLAG_EGRESS_MARK (1 << 3)   /* egress_class has skb->mark keys */
+#define GLOBAL_FLAG_EGRESS_CGROUP (1 << 4) /* ... cgroup id keys */
+#define GLOBAL_FLAG_EGRESS_PRIO (1 << 5)   /* ... skb->priority keys */
+#define GLOBAL_FLAG_LINK_SHARING (1 << 6)  /* HTB policing in XDP */
+#define GLOBAL_FLAG_EGRESS_ANY (GLOBAL_FLAG_EGRESS_MARK | \
+                                GLOBAL_FLAG_EGRESS_CGROUP | \
+                                GLOBAL_FLAG_EGRESS_PRIO)
+
+/*
+ * Qdisc hierarchy built by the control plane: mq at the root of a
+ * multi-queue device, below it one HTB per TX queue with handle
+ * TXQ_HTB_MAJOR + queue, and in each HTB one leaf per class at minor
+ * class_id + 1. A single-queue device gets the queue 0 HTB as its root.
+ */
+#define TXQ_HTB_MAJOR 0x100
+#define MAX_TX_QUEUES 64
+
+/*
+ * Egress classification of locally generated traffic (TC only). Sockets
+ * are classified by what the host already knows about them, checked in
+ * order: skb->mark, then the cgroup, then SO_PRIORITY.
+ */
+#define MAX_EGRESS_KEYS 1024
+
+enum egress_key_kind {
+    EGRESS_KEY_MARK = 0,
+    EGRESS_KEY_CGROUP = 1,
+    EGRESS_KEY_PRIORITY = 2,
+};
+
+struct egress_key {
+    __u32 kind;             /* enum egress_key_kind */
+    __u32 pad;
+    __u64 value;            /* Mark, cgroup v2 id or priority */
+};
+
+/*
+ * Scheduling state of a local socket, kept in sk_storage by the TC program
+ * and freed with the socket. The class is cached and re-resolved every
+ * SOCK_CLASS_TTL_NS, so marks, cgroup moves and behavioral promotions are
+ * picked up without a flow-table lookup per packet.
+ */
+#define SOCK_CLASS_TTL_NS 100000000ULL  /* 100 ms */
+
+struct sock_state {
+    __u64 classified_at;    /* When class_id was last resolved (0 = never) */
+    __u64 finish_tag;       /* WFQ virtual finish time of the last packet */
+    __u64 pacing_ts;        /* EDT departure time for the next packet */
+    __u32 class_id;
+    __u32 deficit;          /* DRR */
+};
+
+/* DSCP -> class table: indexed by DSCP (tos >> 2) */
+#define DSCP_MAX 64
+
+struct dscp_class_entry {
+    __u32 class_id;
+    __u32 enabled;
+};
+
+/*
+ * Flow tuple for identification. The hash map rounds keys up to 8 bytes,
+ * so the 3 bytes after the protocol cost nothing; they hold the tenant of
+ * decapsulated tunnel traffic (zero otherwise) and must be zeroed.
+ */
 struct flow_tuple {
     __u32 src_ip;
     __u32 dst_ip;
     __u16 src_port;
     __u16 dst_port;
     __u8 protocol;
-    __u8 padding[3];
+    __u8 tenant[3];         /* VXLAN/GENEVE VNI or low 24 bits of the GRE key */
 };
 
-/* Flow state information */
+/*
+ * Tunnel decapsulation (load-time option): VXLAN, GENEVE, GRE/NVGRE and
+ * IP-in-IP packets are classified and tracked on their inner IPv4 header,
+ * peeling at most TUNNEL_MAX_DEPTH layers of encapsulation.
+ */
+#define TUNNEL_MAX_DEPTH 2
+#define VXLAN_PORT 4789
+#define GENEVE_PORT 6081
+
+/*
+ * Flow state, kept to the fields every packet touches so two records share
+ * a cache line. Scheduling inputs (weight, priority) come from the class,
+ * and per-algorithm state lives in its own tables (drr_deficit in TC,
+ * flow_behav while a flow is being judged).
+ */
 struct flow_state {
     __u64 packet_count;
     __u64 byte_count;
     __u64 last_seen;
     __u32 class_id;
-    __u32 queue_id;
-    __u32 tokens;           /* For token bucket rate limiting */
-    __u32 last_token_update;
-    __u16 priority;
-    __u16 weight;           /* For WFQ */
-    __u32 deficit;          /* For DRR */
+    __u8 behav_state;       /* enum behav_state */
+    __u8 behav_class;       /* Class promoted to (0 = none) */
+    __u16 pad;
+};
+
+/*
+ * Flow export (load-time option). Flows get a flow_acct entry beside
+ * their flow_state, so flow_state stays compact when export is off. The
+ * XDP program sends a flow_record through the flow_records ring buffer
+ * each time a flow has been active for the active timeout; the control
+ * plane removes flows idle for the idle timeout and reports them itself.
+ * Records carry running totals, so a lost active record costs no counts.
+ */
+#define FLOW_RECORD_RING_SIZE (1 << 20)
+
+/* IPFIX flowEndReason values */
+enum flow_end_reason {
+    FLOW_END_IDLE = 1,
+    FLOW_END_ACTIVE = 2,
+    FLOW_END_FORCED = 4,    /* Exporter shut down */
+};
+
+struct flow_acct {
+    __u64 first_seen;
+    __u64 last_export;      /* Last active-timeout record (or first_seen) */
+    __u64 dropped_packets;  /* Dropped by the XDP policers */
+};
+
+struct flow_record {
+    struct flow_tuple flow;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u64 packets;
+    __u64 bytes;
+    __u64 dropped;
+    __u32 class_id;
+    __u8 end_reason;        /* enum flow_end_reason */
+    __u8 pad[3];
+};
+
+/* Behavioral features of a flow until it has been judged */
+struct flow_behav {
+    __u32 size_ewma;        /* Packet size EWMA, bytes Q4 */
+    __u32 iat_ewma;         /* Inter-arrival EWMA, us Q4 */
+    __u32 iat_dev;          /* Inter-arrival mean deviation, us Q4 */
+    __u16 bursts;           /* Packet trains separated by BEHAV_BURST_GAP_US */
+    __u16 pad;
+};
+
+/*
+ * IPv4 fragments after the first carry no L4 header. The first fragment
+ * records its ports and rule class under (src, dst, protocol, IP ID) and
+ * later fragments of the datagram take them from there, without any
+ * reassembly. A fragment that overtakes the first one finds nothing and
+ * passes unclassified, as all non-first fragments used to.
+ */
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1FFF
+#define FRAG_CACHE_SIZE 8192
+
+struct frag_key {
+    __u32 src_ip;
+    __u32 dst_ip;
+    __u16 id;               /* IP ID, network byte order */
+    __u8 protocol;
+    __u8 pad;
+};
+
+struct frag_entry {
+    __u16 src_port;
+    __u16 dst_port;
+    __u32 class_id;
+};
+
+/*
+ * Behavioral classification: after global_config.behav_min_packets packets,
+ * a web/default flow's features are matched against behavior_rules (first
+ * match wins) and the flow may be promoted to a real-time class.
+ */
+#define MAX_BEHAVIOR_RULES 8
+#define BEHAV_BURST_GAP_US 1000
+
+enum behav_state {
+    BEHAV_LEARNING = 0,
+    BEHAV_DECIDED = 1,
+};
+
+/* Decision table entry; zero bounds are unbounded */
+struct behavior_rule {
+    __u32 iat_min_us;       /* Mean inter-arrival time bounds */
+    __u32 iat_max_us;
+    __u32 jitter_max_us;    /* Max inter-arrival mean deviation */
+    __u16 size_min;         /* Mean packet size bounds, bytes */
+    __u16 size_max;
+    __u16 burst_max;        /* Max mean packets per burst */
+    __u8 dir_min_pct;       /* Reverse-direction share of packets, % */
+    __u8 dir_max_pct;
+    __u8 protocol;          /* 0 = any */
+    __u8 class_id;          /* Class to promote to */
+    __u8 enabled;
+    __u8 pad;
 };
 
 /* Traffic class configuration */
@@ -100,9 +339,22 @@ struct class_config {
     __u32 burst_size;       /* bytes */
     __u16 priority;
     __u16 weight;
-    __u32 min_bandwidth;    /* guaranteed bandwidth in bps */
-    __u32 max_bandwidth;    /* maximum bandwidth in bps */
-    __u32 flags;
+    __u32 min_bandwidth;    /* Guaranteed rate in bytes/s (link sharing) */
+    __u32 max_bandwidth;    /* Ceiling incl. borrowing in bytes/s (0 = rate_limit) */
+    __u32 flags;            /* CLASS_FLAG_* */
+    __u32 aqm;              /* enum aqm_algorithm */
+    __u32 aqm_target_us;    /* Target queueing delay */
+    __u32 aqm_interval_us;  /* CoDel interval / PIE, PI2 update period */
+    __u32 aqm_step_us;      /* DualPI2: L4S queue step marking threshold */
+    __u32 parent;           /* Parent class id + 1 (0 = root) */
+    __u32 meter;            /* enum meter_mode */
+    __u32 peak_rate;        /* trTCM PIR in bytes/s */
+    __u32 excess_burst;     /* srTCM EBS / trTCM PBS in bytes */
+    __u8 yellow_dscp;       /* DSCP for yellow packets (CLASS_FLAG_YELLOW_DSCP) */
+    __u8 yellow_class;      /* Class for yellow packets (0 = keep) */
+    __u8 egress_dscp;       /* DSCP set on egress (CLASS_FLAG_REWRITE_DSCP) */
+    __u8 pad;
+    __u32 pacing_rate;      /* Per-socket EDT pacing in bytes/s (0 = off) */
 };
 
 /* Queue statistics */
@@ -116,8 +368,23 @@ struct queue_stats {
     __u32 current_qlen;
     __u32 max_qlen;
     __u64 total_latency_ns;  /* For average latency calculation */
+    __u64 ecn_marked;        /* AQM congestion signals sent as CE marks */
+    __u64 aqm_dropped;       /* AQM congestion signals sent as drops */
+    __u64 l4s_packets;       /* Packets through the L4S (ECT(1)) queue */
+    __u64 l4s_marked;        /* CE marks on L4S packets */
+    __u64 borrowed_bytes;    /* Bytes sent above min_bandwidth */
+    __u64 meter_yellow;      /* Packets the meter colored yellow */
+    __u64 meter_red;         /* Packets the meter colored red */
 };
 
+/*
+ * Sojourn time histogram per class, kept by the TC program in a per-CPU
+ * array of LAT_HIST_BUCKETS counters per class. Bucket b counts packets
+ * that waited less than 2^b microseconds (and longer than bucket b - 1);
+ * the last bucket counts everything longer.
+ */
+#define LAT_HIST_BUCKETS 20
+
 /* Per-CPU statistics */
 struct cpu_stats {
     __u64 total_packets;
@@ -128,6 +395,46 @@ struct cpu_stats {
     __u64 xdp_drop;
     __u64 xdp_tx;
     __u64 xdp_redirect;
+    __u64 hh_demoted;       /* Packets moved to TC_BULK as heavy hitters */
+    __u64 sub_dropped;      /* Packets over their subscriber's rate */
+    __u64 hw_hash_packets;  /* Flows bucketed by the NIC's RX hash */
+    __u64 hw_ts_packets;    /* Packets with a usable NIC RX timestamp */
+    __u64 hw_ts_delay_ns;   /* Sum of their NIC-to-XDP delays */
+    __u64 rules_checked;    /* Classification rules compared, all packets */
+    __u64 frag_hits;        /* Non-first fragments classified from the cache */
+    __u64 frag_misses;      /* Non-first fragments seen before their first */
+    __u64 tunnel_packets;   /* Packets classified on their inner headers */
+    __u64 flow_records_lost; /* Active-timeout records the ring had no room for */
+};
+
+/*
+ * Per-RX-queue counters, kept per CPU so the CPUs servicing a queue show
+ * up as well. rxq_cpu holds CPU + 1 for each queue whose IRQ the NUMA
+ * deployment mode pinned (0 = not pinned); packets handled on another CPU
+ * count as misplaced.
+ */
+#define MAX_RX_QUEUES 64
+
+struct rxq_stats {
+    __u64 packets;
+    __u64 bytes;
+    __u64 dropped;
+    __u64 misplaced;        /* Handled away from the queue's pinned CPU */
+};
+
+/* XDP hot-path stages timed by the sampled profiler */
+enum prof_stage {
+    PROF_STAGE_PARSE = 0,    /* Ethernet/IPv4/L4 header parsing */
+    PROF_STAGE_CLASSIFY = 1, /* Rule walk + heavy-hitter sketch */
+    PROF_STAGE_FLOW = 2,     /* flow_table lookup/update */
+    PROF_STAGE_POLICE = 3,   /* Class config + token bucket / link sharing */
+    PROF_STAGE_MAX = 4,
+};
+
+/* Per-CPU profiling counters (one entry per stage) */
+struct prof_stats {
+    __u64 samples[PROF_STAGE_MAX];
+    __u64 total_ns[PROF_STAGE_MAX];
 };
 
 /* Global configuration */
@@ -136,9 +443,45 @@ struct global_config {
     __u32 default_class;
     __u32 num_classes;
     __u32 total_rate_limit;
-    __u32 flags;
+    __u32 flags;            /* GLOBAL_FLAG_* */
     __u32 quantum;          /* For DRR */
     __u32 starvation_threshold; /* Max time in ms before serving lower priority */
+    __u32 hh_threshold;     /* Heavy-hitter rate in bytes/s (0 = no demotion) */
+    __u32 behav_min_packets; /* Packets before behavioral judgement (0 = off) */
+    __u32 tx_queues;        /* TX queues with a per-queue HTB (0 = no hierarchy) */
+    __u32 wire_overhead;    /* Per-frame bytes beyond the frame (preamble, FCS, IFG) */
+};
+
+/*
+ * Heavy-hitter detection: per-CPU count-min sketch of bytes per flow over
+ * HH_WINDOW_NS windows. RSS keeps a flow on one CPU, so a per-CPU sketch
+ * sees all of it without atomics. Each counter packs the low 8 bits of the
+ * window number above a 24-bit count of 64-byte units, so a new window
+ * resets counters lazily on first touch.
+ */
+#define HH_DEPTH 4
+#define HH_WIDTH 1024               /* Power of two */
+#define HH_TOPK 16
+#define HH_WINDOW_NS 100000000ULL   /* 100 ms */
+#define HH_HOLD_NS 1000000000ULL    /* Demotion outlives the burst by 1 s */
+#define HH_UNIT_SHIFT 6             /* Counts are in 64-byte units */
+#define HH_COUNT_BITS 24
+#define HH_COUNT_MASK ((1U << HH_COUNT_BITS) - 1)
+#define HH_MAX_DEMOTED 4096
+
+struct hh_sketch {
+    __u32 counts[HH_DEPTH][HH_WIDTH];
+};
+
+/* Top-k candidate: sketch estimate of a flow in the given window */
+struct hh_entry {
+    struct flow_tuple flow;
+    __u32 window;           /* Window number (now / HH_WINDOW_NS), low 32 bits */
+    __u64 bytes;
+};
+
+struct hh_topk {
+    struct hh_entry entries[HH_TOPK];
 };
 
 /* PIFO queue entry */
@@ -150,6 +493,97 @@ struct pifo_entry {
     struct flow_tuple flow;
 };
 
+#ifdef __BPF__
+/* BPF spin lock (embedded in map values shared across CPUs) */
+struct bpf_spin_lock {
+    __u32 val;
+};
+#endif
+
+/* Per-class AQM state: virtual queue(s) plus CoDel/PIE/PI2 variables */
+struct aqm_state {
+    struct bpf_spin_lock lock;
+    __u32 count;            /* CoDel: signals in current dropping episode */
+    __u64 vq_bytes;         /* Virtual queue backlog */
+    __u64 vq_last;          /* Last virtual queue drain (ns) */
+    __u64 first_above_time; /* CoDel: when sojourn first stayed above target */
+    __u64 drop_next;        /* CoDel: next scheduled signal */
+    __u32 lastcount;        /* CoDel: count at start of last episode */
+    __u32 dropping;         /* CoDel: in dropping state */
+    __u32 rec_inv_sqrt;     /* CoDel: 1/sqrt(count), Q0.32 */
+    __u32 pad;
+    __u64 pie_prob;         /* PIE: drop probability / PI2: base p', Q32 */
+    __u64 pie_qdelay_old;   /* PIE/PI2: delay at last update */
+    __u64 pie_last_update;  /* PIE/PI2: time of last probability update */
+    __u64 vq_l_bytes;       /* DualPI2: L4S share of vq_bytes */
+    __u64 qdelay_c;         /* DualPI2: current classic queue delay */
+};
+
+/*
+ * Hierarchical link sharing (HTB-style), active with GLOBAL_FLAG_LINK_SHARING
+ * and a total_rate_limit. Every class node has a shared bucket for its guaranteed rate
+ * (min_bandwidth) and one for its ceiling (max_bandwidth, else rate_limit);
+ * node HTB_ROOT carries total_rate_limit. CPUs take credit from the shared
+ * buckets in chunks and spend it from a per-CPU cache, so the spin lock is
+ * taken once per chunk instead of once per packet.
+ */
+#define HTB_ROOT MAX_CLASSES
+#define HTB_NODES (MAX_CLASSES + 1)
+#define HTB_MAX_DEPTH 3             /* Class levels below the root */
+#define HTB_CHUNK_NS 1000000ULL     /* A chunk is 1 ms worth of rate... */
+#define HTB_CHUNK_MAX 16384         /* ...capped, bounding per-CPU overshoot */
+#define HTB_DEFAULT_BURST 65536
+#define HTB_ROOT_BURST_NS 10000000ULL /* Root bucket depth: 10 ms of link */
+
+/* Shared bucket of one node; ceil may go negative (guarantees overdraw) */
+struct htb_bucket {
+    struct bpf_spin_lock lock;
+    __u32 pad;
+    __s64 assured;          /* Guaranteed-rate tokens (bytes) */
+    __s64 ceil;             /* Ceiling-rate tokens (bytes) */
+    __u64 last_update;
+};
+
+/* Per-CPU unspent credit of one class */
+struct htb_credit {
+    __s64 assured;          /* Within min_bandwidth */
+    __s64 borrowed;         /* Above min_bandwidth, charged up the tree */
+};
+
+/* Three-color meter state: committed and excess (srTCM) or peak (trTCM) */
+struct meter_state {
+    struct bpf_spin_lock lock;
+    __u32 pad;
+    __u64 tc;               /* Committed bucket (bytes) */
+    __u64 te;               /* Excess / peak bucket (bytes) */
+    __u64 last_update;
+};
+
+/*
+ * Per-subscriber policing. A longest-prefix match on the source address
+ * yields the subscriber's id and contract; the id indexes a preallocated
+ * array of buckets, whose lookup the verifier inlines, so a subscriber
+ * costs one trie walk per packet and a fixed 16 bytes of state.
+ */
+#define MAX_SUBSCRIBERS (1 << 20)
+
+struct subscriber_key {
+    __u32 prefixlen;
+    __u32 addr;             /* Network byte order */
+};
+
+struct subscriber_info {
+    __u32 id;               /* Index into subscriber_buckets */
+    __u32 rate;             /* bytes per second (0 = unlimited) */
+    __u32 burst;            /* bytes */
+};
+
+struct subscriber_bucket {
+    struct bpf_spin_lock lock;
+    __u32 tokens;
+    __u64 last_update;
+};
+
 /* Token bucket state */
 struct token_bucket {
     __u32 tokens;
@@ -171,6 +605,22 @@ struct class_rule {
     __u8 protocol;
     __u8 priority;          /* Rule priority (higher = checked first) */
     __u16 class_id;
+    __u16 id;               /* Position in the configuration; rule_hits index */
+    __u16 pad;
+    __u32 tenant;           /* Tunnel VNI/key to match (0 = any) */
+};
+
+/*
+ * The XDP program checks at most RULE_BANK_SIZE rules. class_rules holds
+ * two banks of that size: the control plane writes a reordered rule list
+ * into the idle bank and then switches rule_set over to it, so packets
+ * never see a half-written order.
+ */
+#define RULE_BANK_SIZE 16
+
+struct rule_set {
+    __u32 base;             /* First class_rules slot of the active bank */
+    __u32 count;            /* Rules in it */
 };
 
 /* Packet metadata passed between XDP and TC */
@@ -192,5 +642,12 @@ struct pkt_metadata {
 #define CPU_STATS_PATH "/sys/fs/bpf/xdp_qos/cpu_stats"
 #define GLOBAL_CONFIG_PATH "/sys/fs/bpf/xdp_qos/global_config"
 #define RULES_PATH "/sys/fs/bpf/xdp_qos/rules"
+#define PROF_STATS_PATH "/sys/fs/bpf/xdp_qos/prof_stats"
+#define AQM_STATE_PATH "/sys/fs/bpf/xdp_qos/aqm_state"
+#define HH_TOPK_PATH "/sys/fs/bpf/xdp_qos/hh_topk"
+#define BEHAVIOR_RULES_PATH "/sys/fs/bpf/xdp_qos/behavior_rules"
+#define DSCP_CLASS_PATH "/sys/fs/bpf/xdp_qos/dscp_class"
+#define SUBSCRIBER_PREFIXES_PATH "/sys/fs/bpf/xdp_qos/subscriber_prefixes"
+#define SUBSCRIBER_BUCKETS_PATH "/sys/fs/bpf/xdp_qos/subscriber_buckets"
 
 #endif /* __COMMON_H__ */
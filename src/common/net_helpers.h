@@ -0,0 +1,62 @@
+/*
+ * Packet Rewrite Helpers - IPv4 TOS/ECN changes with checksum fixup
+ *
+ * Shared by the XDP and TC programs. The helpers work on pointers into a
+ * bounds-checked IPv4 header, so each program keeps its own header parsing.
+ */
+
+#ifndef __NET_HELPERS_H__
+#define __NET_HELPERS_H__
+
+#include "common.h"
+#include <bpf/bpf_endian.h>
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+/* ECN codepoints (low two bits of the TOS byte, RFC 3168) */
+#define INET_ECN_NOT_ECT 0
+#define INET_ECN_ECT_1 1
+#define INET_ECN_ECT_0 2
+#define INET_ECN_CE 3
+#define INET_ECN_MASK 3
+
+/* Incrementally update a one's complement checksum: HC' = ~(~HC + ~m + m') */
+static __always_inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
+{
+    __u32 csum = (__u16)~*sum + (__u16)~old + (__u16)new;
+
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+    *sum = (__sum16)~csum;
+}
+
+/*
+ * Rewrite the TOS byte of an IPv4 header. Only TOS changes within its
+ * 16-bit word (version/IHL is untouched), so the checksum update can use
+ * the TOS byte alone in network byte order.
+ */
+static __always_inline void ipv4_change_tos(__u8 *tos, __sum16 *check,
+                                            __u8 new_tos)
+{
+    __u8 old_tos = *tos;
+
+    if (old_tos == new_tos)
+        return;
+
+    *tos = new_tos;
+    csum_replace2(check, bpf_htons(old_tos), bpf_htons(new_tos));
+}
+
+/* Set ECN CE on an ECT packet; returns -1 if the packet is not ECN-capable */
+static __always_inline int ipv4_set_ce(__u8 *tos, __sum16 *check)
+{
+    if ((*tos & INET_ECN_MASK) == INET_ECN_NOT_ECT)
+        return -1;
+
+    ipv4_change_tos(tos, check, *tos | INET_ECN_CE);
+    return 0;
+}
+
+#endif /* __NET_HELPERS_H__ */
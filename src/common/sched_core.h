@@ -0,0 +1,499 @@
+/*
+ * Scheduling Core - Algorithm arithmetic shared by datapath and simulator
+ *
+ * The per-packet decisions of the TC scheduler (queue selection, virtual
+ * finish times, deficit accounting, PIFO ranks) live here as pure functions:
+ * no map lookups, no helpers, no packet access. tc_scheduler.c wraps them
+ * with map state, and the userspace simulator (src/sim) drives the very same
+ * code natively, so both always agree on what a scheduler does.
+ */
+
+#ifndef __SCHED_CORE_H__
+#define __SCHED_CORE_H__
+
+#include "common.h"
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+/*
+ * Default DRR quantum when none is configured: one full-size Ethernet
+ * frame in wire bytes (1500 MTU + 14 header + SCHED_ETH_OVERHEAD)
+ */
+#define SCHED_DEFAULT_QUANTUM 1538
+
+/*
+ * Size on the wire. A GSO/GRO super-packet leaves as segs frames, each
+ * repeating the headers and each paying the per-frame cost of Ethernet:
+ * preamble and SFD (8), FCS (4) and the inter-frame gap (12). Single
+ * frames are padded to the 60-byte minimum (before FCS).
+ */
+#define SCHED_ETH_OVERHEAD 24
+#define SCHED_ETH_MIN_FRAME 60
+
+/* Frame bytes after segmentation: headers repeat in every segment */
+static __always_inline __u32 sched_frame_bytes(__u32 len, __u32 segs,
+                                               __u32 hdr_len)
+{
+    return len + (segs > 1 ? segs - 1 : 0) * hdr_len;
+}
+
+/* Link time in bytes: frames, minimum-size padding and per-frame overhead */
+static __always_inline __u32 sched_wire_bytes(__u32 len, __u32 segs,
+                                              __u32 hdr_len, __u32 overhead)
+{
+    __u32 bytes = sched_frame_bytes(len, segs, hdr_len);
+
+    if (segs <= 1) {
+        segs = 1;
+        if (bytes < SCHED_ETH_MIN_FRAME)
+            bytes = SCHED_ETH_MIN_FRAME;
+    }
+    return bytes + segs * overhead;
+}
+
+/* Round Robin: return the current queue and advance the cursor */
+static __always_inline __u32 sched_rr_next(__u32 *cursor)
+{
+    __u32 queue_id = *cursor;
+
+    *cursor = (*cursor + 1) % MAX_QUEUES_PER_CLASS;
+    return queue_id;
+}
+
+/* WFQ: virtual finish time VFT = VT + (packet_len / weight) */
+static __always_inline __u64 sched_wfq_finish(__u64 vtime, __u32 pkt_len,
+                                              __u16 weight)
+{
+    return vtime + (pkt_len / (weight ? weight : 1));
+}
+
+/* WFQ: map a virtual finish time to a queue (simplified) */
+static __always_inline __u32 sched_wfq_queue(__u64 vft)
+{
+    return vft % MAX_QUEUES_PER_CLASS;
+}
+
+/* Strict Priority: basic priority to queue mapping */
+static __always_inline __u32 sched_sp_queue(__u16 priority)
+{
+    return (priority < MAX_QUEUES_PER_CLASS) ? priority : 0;
+}
+
+/*
+ * Strict Priority: starvation check for lower priority traffic
+ * (priority > 2). Returns 1 and refreshes last_service when the class has
+ * waited longer than threshold_ms and should be boosted.
+ */
+static __always_inline int sched_sp_starved(__u16 priority, __u64 now,
+                                            __u64 *last_service,
+                                            __u32 threshold_ms)
+{
+    __u64 threshold_ns = (__u64)threshold_ms * 1000000;
+
+    if (!threshold_ms || priority <= 2)
+        return 0;
+
+    if (now - *last_service <= threshold_ns)
+        return 0;
+
+    *last_service = now;
+    return 1;
+}
+
+/* DRR: charge a packet against a deficit counter if it is large enough */
+static __always_inline int sched_drr_charge(__u32 *deficit, __u32 pkt_len)
+{
+    if (*deficit < pkt_len)
+        return 0;
+
+    *deficit -= pkt_len;
+    return 1;
+}
+
+/* DRR: deficit a flow's drr_deficit entry is created with, on its first packet */
+static __always_inline __u32 sched_drr_initial(__u32 quantum)
+{
+    return quantum ? quantum : SCHED_DEFAULT_QUANTUM;
+}
+
+/* DRR: add one quantum, then try to charge the packet */
+static __always_inline int sched_drr_admit(__u32 *deficit, __u32 quantum,
+                                           __u32 pkt_len)
+{
+    *deficit += quantum ? quantum : SCHED_DEFAULT_QUANTUM;
+    return sched_drr_charge(deficit, pkt_len);
+}
+
+/* PIFO: rank from priority and arrival time (lower = served first) */
+static __always_inline __u64 sched_pifo_rank(__u16 priority, __u64 now)
+{
+    return ((__u64)priority << 48) | (now & 0xFFFFFFFFFFFFULL);
+}
+
+/*
+ * Active Queue Management
+ *
+ * CoDel (RFC 8289), PIE (RFC 8033) and DualPI2 (RFC 9332) control laws,
+ * driven by the sojourn time of a per-class queue. All arithmetic is
+ * integer/fixed point.
+ */
+
+/* AQM verdicts */
+#define AQM_PASS 0          /* Enqueue unchanged */
+#define AQM_SIGNAL 1        /* Congestion signal: CE mark if ECT, else drop */
+#define AQM_DROP 2          /* Drop even if ECT (PIE above its ECN limit) */
+
+#define AQM_MTU 1500
+#define AQM_VQ_MAX_BYTES (64ULL << 20)
+
+/* Defaults (RFC 8289 / RFC 8033) */
+#define CODEL_DEFAULT_TARGET_US 5000
+#define CODEL_DEFAULT_INTERVAL_US 100000
+#define PIE_DEFAULT_TARGET_US 15000
+#define PIE_DEFAULT_TUPDATE_US 15000
+
+#define PIE_PROB_ONE (1ULL << 32)
+#define PIE_MAX_ECN_PROB (PIE_PROB_ONE / 10)    /* Mark up to 10%, then drop */
+#define PIE_QDELAY_MAX_NS (250ULL * 1000000)
+
+/* DualPI2 defaults (RFC 9332) */
+#define PI2_DEFAULT_TARGET_US 15000
+#define PI2_DEFAULT_TUPDATE_US 16000
+#define PI2_ALPHA_MHZ 160               /* 0.16 Hz */
+#define PI2_BETA_MHZ 3200               /* 3.2 Hz */
+#define DUALQ_DEFAULT_STEP_US 1000
+#define DUALQ_COUPLING 2                /* k: p_CL = k * p' */
+
+/*
+ * Virtual queue: drain the backlog at rate bytes/s up to now and return the
+ * sojourn time a packet arriving now would see.
+ */
+static __always_inline __u64 aqm_vq_sojourn(struct aqm_state *st, __u64 now,
+                                            __u64 rate)
+{
+    __u64 elapsed = now - st->vq_last;
+
+    if (now > st->vq_last) {
+        if (elapsed >= NSEC_PER_SEC) {
+            st->vq_bytes = 0;
+        } else {
+            __u64 drained = elapsed * rate / NSEC_PER_SEC;
+            st->vq_bytes = drained >= st->vq_bytes ? 0 : st->vq_bytes - drained;
+        }
+        st->vq_last = now;
+    }
+
+    return st->vq_bytes * NSEC_PER_SEC / rate;
+}
+
+/*
+ * DualQ virtual queue: the L4S queue is served first, so draining takes
+ * from it before the classic backlog. Returns the sojourn time of the
+ * packet's own queue (L packets wait behind L only, classic behind both)
+ * and records the classic delay for the PI2 controller.
+ */
+static __always_inline __u64 aqm_dualq_sojourn(struct aqm_state *st,
+                                               __u64 now, __u64 rate,
+                                               int l4s)
+{
+    __u64 before = st->vq_bytes;
+    __u64 drained;
+
+    st->qdelay_c = aqm_vq_sojourn(st, now, rate);
+    drained = before - st->vq_bytes;
+    st->vq_l_bytes = drained >= st->vq_l_bytes ? 0 :
+                     st->vq_l_bytes - drained;
+
+    return l4s ? st->vq_l_bytes * NSEC_PER_SEC / rate : st->qdelay_c;
+}
+
+/* Virtual queue: account an enqueued packet */
+static __always_inline void aqm_vq_enqueue(struct aqm_state *st, __u32 len,
+                                           int l4s)
+{
+    if (st->vq_bytes >= AQM_VQ_MAX_BYTES)
+        return;
+
+    st->vq_bytes += len;
+    if (l4s)
+        st->vq_l_bytes += len;
+}
+
+/* CoDel: one Newton iteration of rec_inv_sqrt = 1/sqrt(count) */
+static __always_inline void codel_newton_step(struct aqm_state *st)
+{
+    __u64 invsqrt = st->rec_inv_sqrt;
+    __u64 invsqrt2 = (invsqrt * invsqrt) >> 32;
+    __u64 val = (3ULL << 32) - ((__u64)st->count * invsqrt2);
+
+    val >>= 2; /* avoid overflow in following multiply */
+    val = (val * invsqrt) >> (32 - 2 + 1);
+    st->rec_inv_sqrt = (__u32)val;
+}
+
+/* CoDel: next signal time t + interval / sqrt(count) */
+static __always_inline __u64 codel_control_law(__u64 t, __u64 interval,
+                                               __u32 rec_inv_sqrt)
+{
+    return t + ((interval * rec_inv_sqrt) >> 32);
+}
+
+static __always_inline int codel_should_signal(struct aqm_state *st,
+                                               __u64 now, __u64 sojourn,
+                                               __u64 target, __u64 interval)
+{
+    if (sojourn < target || st->vq_bytes <= AQM_MTU) {
+        st->first_above_time = 0;
+        return 0;
+    }
+
+    if (!st->first_above_time) {
+        st->first_above_time = now + interval;
+        return 0;
+    }
+
+    return now >= st->first_above_time;
+}
+
+/* CoDel: decide on one packet given its sojourn time */
+static __always_inline int aqm_codel(struct aqm_state *st, __u64 now,
+                                     __u64 sojourn, __u64 target,
+                                     __u64 interval)
+{
+    int signal = codel_should_signal(st, now, sojourn, target, interval);
+
+    if (st->dropping) {
+        if (!signal) {
+            st->dropping = 0;
+            return AQM_PASS;
+        }
+        if (now < st->drop_next)
+            return AQM_PASS;
+
+        st->count++;
+        codel_newton_step(st);
+        st->drop_next = codel_control_law(st->drop_next, interval,
+                                          st->rec_inv_sqrt);
+        return AQM_SIGNAL;
+    }
+
+    if (!signal)
+        return AQM_PASS;
+
+    /* Enter dropping state, resuming the previous rate if it was recent */
+    st->dropping = 1;
+    if (st->count - st->lastcount > 1 && now - st->drop_next < 16 * interval) {
+        st->count = st->count - st->lastcount;
+        codel_newton_step(st);
+    } else {
+        st->count = 1;
+        st->rec_inv_sqrt = ~0U;
+    }
+    st->lastcount = st->count;
+    st->drop_next = codel_control_law(now, interval, st->rec_inv_sqrt);
+    return AQM_SIGNAL;
+}
+
+/* PIE: scale a delay difference (ns) by gain/8 per second into Q32 */
+static __always_inline __u64 pie_scale(__u64 diff_ns, __u32 gain_eighths)
+{
+    if (diff_ns > NSEC_PER_SEC)
+        diff_ns = NSEC_PER_SEC;
+    return diff_ns * gain_eighths * (PIE_PROB_ONE / 8) / NSEC_PER_SEC;
+}
+
+/* PIE: periodic drop probability update (alpha = 0.125, beta = 1.25) */
+static __always_inline void aqm_pie_update(struct aqm_state *st, __u64 now,
+                                           __u64 qdelay, __u64 target,
+                                           __u64 tupdate)
+{
+    __u64 up = 0, down = 0;
+    __u32 shift = 0;
+
+    if (now - st->pie_last_update < tupdate)
+        return;
+    st->pie_last_update = now;
+
+    if (qdelay > target)
+        up += pie_scale(qdelay - target, 1);
+    else
+        down += pie_scale(target - qdelay, 1);
+
+    if (qdelay > st->pie_qdelay_old)
+        up += pie_scale(qdelay - st->pie_qdelay_old, 10);
+    else
+        down += pie_scale(st->pie_qdelay_old - qdelay, 10);
+
+    /* Auto-tune the gains while the probability is still small */
+    if (st->pie_prob < PIE_PROB_ONE / 1000000)
+        shift = 11;
+    else if (st->pie_prob < PIE_PROB_ONE / 100000)
+        shift = 9;
+    else if (st->pie_prob < PIE_PROB_ONE / 10000)
+        shift = 7;
+    else if (st->pie_prob < PIE_PROB_ONE / 1000)
+        shift = 5;
+    else if (st->pie_prob < PIE_PROB_ONE / 100)
+        shift = 3;
+    else if (st->pie_prob < PIE_PROB_ONE / 10)
+        shift = 1;
+    up >>= shift;
+    down >>= shift;
+
+    /* Cap a single increase at 2% once the probability is high */
+    if (st->pie_prob >= PIE_PROB_ONE / 10 && up > down + PIE_PROB_ONE / 50)
+        up = down + PIE_PROB_ONE / 50;
+
+    /* Respond quickly to a queue that is far above target */
+    if (qdelay > PIE_QDELAY_MAX_NS)
+        up += PIE_PROB_ONE / 50;
+
+    if (up >= down) {
+        st->pie_prob += up - down;
+        if (st->pie_prob > PIE_PROB_ONE)
+            st->pie_prob = PIE_PROB_ONE;
+    } else {
+        st->pie_prob = (down - up) >= st->pie_prob ? 0 :
+                       st->pie_prob - (down - up);
+    }
+
+    /* Decay when the queue has been idle for two updates */
+    if (!qdelay && !st->pie_qdelay_old)
+        st->pie_prob = st->pie_prob * 98 / 100;
+
+    st->pie_qdelay_old = qdelay;
+}
+
+/* PIE: random early decision for one packet (rnd uniform in [0, 2^32)) */
+static __always_inline int aqm_pie(struct aqm_state *st, __u64 now,
+                                   __u64 qdelay, __u64 target,
+                                   __u64 tupdate, __u32 rnd)
+{
+    aqm_pie_update(st, now, qdelay, target, tupdate);
+
+    /* Safeguards: light load or a nearly empty queue */
+    if ((st->pie_qdelay_old < target / 2 && st->pie_prob < PIE_PROB_ONE / 5) ||
+        st->vq_bytes <= 2 * AQM_MTU)
+        return AQM_PASS;
+
+    if (rnd >= st->pie_prob)
+        return AQM_PASS;
+
+    return st->pie_prob > PIE_MAX_ECN_PROB ? AQM_DROP : AQM_SIGNAL;
+}
+
+/* PI2: gain (mHz, scaled by the update period) times a delay, in Q32 */
+static __always_inline __u64 pi2_scale(__u64 diff_ns, __u32 gain_mhz,
+                                       __u64 tupdate_ns)
+{
+    /* diff_ns * gain * tupdate is in units of 1e-18; 2^32 / 1e18 */
+    if (diff_ns > NSEC_PER_SEC)
+        diff_ns = NSEC_PER_SEC;
+    return diff_ns * gain_mhz * (tupdate_ns / 1000) / 232830644ULL;
+}
+
+/* PI2: periodic update of the base probability p' from the classic delay */
+static __always_inline void aqm_pi2_update(struct aqm_state *st, __u64 now,
+                                           __u64 target, __u64 tupdate)
+{
+    __u64 qdelay = st->qdelay_c;
+    __u64 up = 0, down = 0;
+
+    if (now - st->pie_last_update < tupdate)
+        return;
+    st->pie_last_update = now;
+
+    if (qdelay > target)
+        up += pi2_scale(qdelay - target, PI2_ALPHA_MHZ, tupdate);
+    else
+        down += pi2_scale(target - qdelay, PI2_ALPHA_MHZ, tupdate);
+
+    if (qdelay > st->pie_qdelay_old)
+        up += pi2_scale(qdelay - st->pie_qdelay_old, PI2_BETA_MHZ, tupdate);
+    else
+        down += pi2_scale(st->pie_qdelay_old - qdelay, PI2_BETA_MHZ, tupdate);
+
+    if (up >= down) {
+        st->pie_prob += up - down;
+        if (st->pie_prob > PIE_PROB_ONE)
+            st->pie_prob = PIE_PROB_ONE;
+    } else {
+        st->pie_prob = (down - up) >= st->pie_prob ? 0 :
+                       st->pie_prob - (down - up);
+    }
+
+    st->pie_qdelay_old = qdelay;
+}
+
+/*
+ * DualPI2: L4S packets are marked on a shallow step threshold or with the
+ * coupled probability k * p'; classic packets get p'^2, applied as two
+ * independent 16-bit draws both below p'. Above p_C = 25% the queue is
+ * overloaded and both queues drop classically.
+ */
+static __always_inline int aqm_dualpi2(struct aqm_state *st, __u64 now,
+                                       __u64 sojourn, __u64 target,
+                                       __u64 tupdate, __u64 step, int l4s,
+                                       __u32 rnd)
+{
+    __u32 pq;
+
+    aqm_pi2_update(st, now, target, tupdate);
+    pq = st->pie_prob >> 16;
+
+    if (st->pie_prob > PIE_PROB_ONE / 2)
+        return ((rnd & 0xffff) < pq && (rnd >> 16) < pq) ? AQM_DROP : AQM_PASS;
+
+    if (l4s) {
+        if (sojourn >= step && st->vq_l_bytes > AQM_MTU)
+            return AQM_SIGNAL;
+
+        return rnd < st->pie_prob * DUALQ_COUPLING ? AQM_SIGNAL : AQM_PASS;
+    }
+
+    return ((rnd & 0xffff) < pq && (rnd >> 16) < pq) ? AQM_SIGNAL : AQM_PASS;
+}
+
+/*
+ * AQM entry point: apply the class's algorithm to one packet. l4s selects
+ * the low-latency queue of a DualPI2 class and is ignored otherwise.
+ */
+static __always_inline int aqm_decide(struct aqm_state *st,
+                                      const struct class_config *cfg,
+                                      __u64 now, __u64 sojourn, __u32 rnd,
+                                      int l4s)
+{
+    __u64 target, interval, step;
+
+    switch (cfg->aqm) {
+    case AQM_CODEL:
+        target = cfg->aqm_target_us ? cfg->aqm_target_us :
+                 CODEL_DEFAULT_TARGET_US;
+        interval = cfg->aqm_interval_us ? cfg->aqm_interval_us :
+                   CODEL_DEFAULT_INTERVAL_US;
+        return aqm_codel(st, now, sojourn, target * 1000, interval * 1000);
+
+    case AQM_PIE:
+        target = cfg->aqm_target_us ? cfg->aqm_target_us :
+                 PIE_DEFAULT_TARGET_US;
+        interval = cfg->aqm_interval_us ? cfg->aqm_interval_us :
+                   PIE_DEFAULT_TUPDATE_US;
+        return aqm_pie(st, now, sojourn, target * 1000, interval * 1000, rnd);
+
+    case AQM_DUALPI2:
+        target = cfg->aqm_target_us ? cfg->aqm_target_us :
+                 PI2_DEFAULT_TARGET_US;
+        interval = cfg->aqm_interval_us ? cfg->aqm_interval_us :
+                   PI2_DEFAULT_TUPDATE_US;
+        step = cfg->aqm_step_us ? cfg->aqm_step_us : DUALQ_DEFAULT_STEP_US;
+        return aqm_dualpi2(st, now, sojourn, target * 1000, interval * 1000,
+                           step * 1000, l4s, rnd);
+
+    default:
+        return AQM_PASS;
+    }
+}
+
+#endif /* __SCHED_CORE_H__ */
@@ -0,0 +1,74 @@
+/*
+ * BPF .rodata Helper - load-time constants for BPF objects
+ *
+ * Shared by the control plane and the benchmark, which both open the XDP
+ * object and set its `const volatile` knobs before loading it.
+ */
+
+#ifndef __BPF_RODATA_H__
+#define __BPF_RODATA_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <bpf/libbpf.h>
+#include <bpf/btf.h>
+
+/*
+ * Set a `const volatile` global of a BPF object before it is loaded.
+ * The value ends up in the frozen .rodata map, so the verifier treats it
+ * as a constant and prunes branches that depend on it.
+ */
+static int set_rodata_u32(struct bpf_object *obj, const char *name, __u32 value)
+{
+    struct btf *btf = bpf_object__btf(obj);
+    const struct btf_type *sec;
+    struct btf_var_secinfo *vsi;
+    struct bpf_map *map;
+    size_t size = 0;
+    char *data = NULL;
+    int sec_id;
+    
+    bpf_object__for_each_map(map, obj) {
+        const char *map_name = bpf_map__name(map);
+        size_t len = strlen(map_name);
+        
+        if (bpf_map__is_internal(map) && len >= 7 &&
+            strcmp(map_name + len - 7, ".rodata") == 0) {
+            data = bpf_map__initial_value(map, &size);
+            break;
+        }
+    }
+    
+    if (!btf || !data) {
+        fprintf(stderr, "Error: object has no .rodata section for %s\n", name);
+        return -1;
+    }
+    
+    sec_id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+    if (sec_id < 0) {
+        fprintf(stderr, "Error: no BTF for .rodata (%s)\n", name);
+        return -1;
+    }
+    
+    sec = btf__type_by_id(btf, sec_id);
+    vsi = btf_var_secinfos(sec);
+    for (int i = 0; i < btf_vlen(sec); i++, vsi++) {
+        const struct btf_type *var = btf__type_by_id(btf, vsi->type);
+        
+        if (strcmp(btf__name_by_offset(btf, var->name_off), name) != 0)
+            continue;
+        
+        if (vsi->size != sizeof(value) || vsi->offset + vsi->size > size) {
+            fprintf(stderr, "Error: unexpected layout for %s\n", name);
+            return -1;
+        }
+        
+        memcpy(data + vsi->offset, &value, sizeof(value));
+        return 0;
+    }
+    
+    fprintf(stderr, "Error: %s not found in .rodata\n", name);
+    return -1;
+}
+
+#endif /* __BPF_RODATA_H__ */
@@ -11,121 +11,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <getopt.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
 #include <linux/if_link.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <bpf/btf.h>
 #include <json-c/json.h>
 
-/* We need the struct definitions but not xdp_md from common.h */
-#define MAX_FLOWS 65536
-#define MAX_CLASSES 8
-#define MAX_RULES 256
-
-/* Copy necessary structures without conflicts */
-struct flow_tuple {
-    __u32 src_ip;
-    __u32 dst_ip;
-    __u16 src_port;
-    __u16 dst_port;
-    __u8 protocol;
-    __u8 padding[3];
-};
-
-struct flow_state {
-    __u64 packet_count;
-    __u64 byte_count;
-    __u64 last_seen;
-    __u32 class_id;
-    __u32 queue_id;
-    __u32 tokens;
-    __u32 last_token_update;
-    __u16 priority;
-    __u16 weight;
-    __u32 deficit;
-};
-
-struct class_config {
-    __u32 id;
-    __u32 rate_limit;
-    __u32 burst_size;
-    __u16 priority;
-    __u16 weight;
-    __u32 min_bandwidth;
-    __u32 max_bandwidth;
-    __u32 flags;
-};
-
-struct queue_stats {
-    __u64 enqueued_packets;
-    __u64 enqueued_bytes;
-    __u64 dequeued_packets;
-    __u64 dequeued_bytes;
-    __u64 dropped_packets;
-    __u64 dropped_bytes;
-    __u32 current_qlen;
-    __u32 max_qlen;
-    __u64 total_latency_ns;
-};
-
-struct cpu_stats {
-    __u64 total_packets;
-    __u64 total_bytes;
-    __u64 classified_packets;
-    __u64 dropped_packets;
-    __u64 xdp_pass;
-    __u64 xdp_drop;
-    __u64 xdp_tx;
-    __u64 xdp_redirect;
-};
-
-struct global_config {
-    __u32 sched_algorithm;
-    __u32 default_class;
-    __u32 num_classes;
-    __u32 total_rate_limit;
-    __u32 flags;
-    __u32 quantum;
-    __u32 starvation_threshold;
-};
-
-struct token_bucket {
-    __u32 tokens;
-    __u32 rate;
-    __u32 capacity;
-    __u64 last_update;
-};
+#include "bpf_rodata.h"
+#include "policy_compiler.h"
 
-struct class_rule {
-    __u32 src_ip;
-    __u32 src_ip_mask;
-    __u32 dst_ip;
-    __u32 dst_ip_mask;
-    __u16 src_port_min;
-    __u16 src_port_max;
-    __u16 dst_port_min;
-    __u16 dst_port_max;
-    __u8 protocol;
-    __u8 priority;
-    __u16 class_id;
-};
+#define MAX_CPUS 1024
 
-enum sched_algorithm {
-    SCHED_ROUND_ROBIN = 0,
-    SCHED_WEIGHTED_FAIR_QUEUING = 1,
-    SCHED_STRICT_PRIORITY = 2,
-    SCHED_DEFICIT_ROUND_ROBIN = 3,
-    SCHED_PIFO = 4,
-};
+/* Preamble and SFD, FCS and inter-frame gap of an Ethernet frame */
+#define ETH_WIRE_OVERHEAD 24
 
 #define DEFAULT_IFACE "eth0"
 #define DEFAULT_CONFIG_PATH "configs/default.json"
 #define BPF_PIN_DIR "/sys/fs/bpf/xdp_qos"
+#define TC_PIN_DIR "/sys/fs/bpf/tc/globals"
+#define DEFAULT_POLICY_OBJ "build/xdp_policy.o"
+
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
 
 struct prog_context {
     struct bpf_object *xdp_obj;
@@ -145,11 +70,83 @@ struct prog_context {
     int global_config_fd;
     int queue_stats_fd;
     int token_buckets_fd;
+    int prof_stats_fd;
+    int hh_topk_fd;
+    int behavior_rules_fd;
+    int subscriber_prefixes_fd;
+    int dscp_class_fd;
+    int subscriber_buckets_fd;
+    int rxq_stats_fd;
+    int rxq_cpu_fd;
+    int rule_set_fd;
+    int rule_hits_fd;
+    int flow_acct_fd;
+    int flow_records_fd;
+    
+    /* TC program's pinned copies (-1 when TC is not loaded) */
+    int tc_class_config_fd;
+    int tc_global_config_fd;
+    int tc_queue_stats_fd;
+    int tc_egress_class_fd;
+    int tc_latency_hist_fd;
+    
+    /* Root qdisc hierarchy built from the configuration */
+    int qdisc_installed;
+    
+    /* Load-time settings, written to .rodata before the XDP object loads */
+    __u32 prof_sample_rate;
+    __u32 hw_metadata_ifindex;  /* Device to bind to for RX metadata (0 = off) */
+    int tunnel_decap;           /* Classify overlay traffic on inner headers */
+    int xdp_frags;              /* Load the multi-buffer (xdp.frags) variant */
+    
+    /* Map sizes, read from the configuration before the XDP object loads */
+    __u32 max_flows;            /* flow_table entries (0 = MAX_FLOWS) */
+    int behavior_enabled;       /* flow_behav is sized to one entry otherwise */
+    __u32 max_subscribers;      /* subscriber_buckets entries (0 = one) */
+    
+    /* Warm restart snapshot (NULL = start cold) */
+    const char *state_file;
+    
+    /* Classification rules in their current order, for adaptive reordering */
+    struct class_rule rules[RULE_BANK_SIZE];
+    __u32 n_rules;
+    __u32 rule_base;            /* Active bank */
+    __u64 rule_score[RULE_BANK_SIZE];
+    __u64 rule_hits_prev[RULE_BANK_SIZE];
+    int reorder_interval;       /* Seconds between passes (0 = off) */
+    int compiled_policy;        /* Rules compiled into the XDP program */
+    
+    /* Flow record export (NULL = off) */
+    const char *flow_export_target;
+    __u32 flow_active_timeout;  /* Seconds between records of a live flow (0 = at end only) */
+    __u32 flow_idle_timeout;    /* Seconds without packets before a flow ends */
+    
+    /* OpenMetrics exporter (-1 = off); scrapes get the latest snapshot */
+    int metrics_fd;
+    pthread_t metrics_collector;
+    pthread_t metrics_server;
+    pthread_mutex_t metrics_lock;
+    char *metrics_text;
+    size_t metrics_len;
 };
 
-static struct prog_context ctx = {0};
+static struct prog_context ctx = {
+    .tc_class_config_fd = -1,
+    .tc_global_config_fd = -1,
+    .tc_queue_stats_fd = -1,
+    .tc_egress_class_fd = -1,
+    .tc_latency_hist_fd = -1,
+    .flow_active_timeout = 60,
+    .flow_idle_timeout = 15,
+    .metrics_fd = -1,
+    .metrics_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 static volatile sig_atomic_t keep_running = 1;
 
+static const char *prof_stage_names[PROF_STAGE_MAX] = {
+    "parse", "classify", "flow_table", "policer",
+};
+
 /* Signal handler for cleanup */
 void sig_handler(int signo)
 {
@@ -172,6 +169,14 @@ int cleanup_pinned_maps(void)
     printf("Cleaning up potentially incompatible pinned maps...\n");
     snprintf(cmd, sizeof(cmd), "rm -rf %s", BPF_PIN_DIR);
     int ret = system(cmd);
+    
+    /* Shared TC maps whose layout follows common.h */
+    snprintf(cmd, sizeof(cmd),
+             "rm -f %s/class_config %s/global_config %s/queue_stats %s/aqm_state "
+             "%s/egress_class %s/latency_hist",
+             TC_PIN_DIR, TC_PIN_DIR, TC_PIN_DIR, TC_PIN_DIR, TC_PIN_DIR,
+             TC_PIN_DIR);
+    system(cmd);
     if (ret == 0) {
         printf("Pinned maps cleaned up successfully\n");
         /* Recreate the directory */
@@ -180,9 +185,142 @@ int cleanup_pinned_maps(void)
     return ret;
 }
 
+/* Parse "a.b.c.d/len" into a network-order address and prefix length */
+static int parse_prefix(const char *str, __u32 *addr, __u32 *len)
+{
+    char buf[INET_ADDRSTRLEN + 4];
+    char *slash;
+    struct in_addr in;
+    
+    snprintf(buf, sizeof(buf), "%s", str);
+    slash = strchr(buf, '/');
+    *len = 32;
+    if (slash) {
+        *slash = '\0';
+        *len = atoi(slash + 1);
+    }
+    
+    if (inet_pton(AF_INET, buf, &in) != 1 || *len > 32)
+        return -1;
+    
+    /* Clear host bits so the trie key is canonical */
+    *addr = *len ? in.s_addr & htonl(~0U << (32 - *len)) : 0;
+    return 0;
+}
+
+/*
+ * Subscriber ids the "subscribers" section takes, by the rules of
+ * load_subscribers(): subscriber_buckets is sized to this at load. Entries
+ * that load_subscribers() skips may be counted, which only adds slack.
+ */
+static __u32 subscriber_ids_needed(struct json_object *subs)
+{
+    int n_entries = json_object_array_length(subs);
+    __u64 next_id = 0;
+    
+    for (int i = 0; i < n_entries && next_id < MAX_SUBSCRIBERS; i++) {
+        struct json_object *ent = json_object_array_get_idx(subs, i);
+        struct json_object *tmp, *prefix;
+        __u32 addr, plen, split = 0;
+        __u64 count = 1;
+        
+        if (json_object_object_get_ex(ent, "per_subnet_len", &tmp))
+            split = json_object_get_int(tmp);
+        
+        if (split) {
+            if (!json_object_object_get_ex(ent, "prefixes", &prefix) &&
+                !json_object_object_get_ex(ent, "prefix", &prefix))
+                continue;
+            if (!json_object_is_type(prefix, json_type_string) ||
+                parse_prefix(json_object_get_string(prefix), &addr, &plen) ||
+                split < plen || split > 32)
+                continue;
+            count = 1ULL << (split - plen);
+        } else if (json_object_object_get_ex(ent, "id", &tmp) &&
+                   json_object_get_int(tmp) >= 0 &&
+                   (__u64)json_object_get_int(tmp) > next_id) {
+            next_id = json_object_get_int(tmp);
+        }
+        next_id += count;
+    }
+    
+    return next_id < MAX_SUBSCRIBERS ? next_id : MAX_SUBSCRIBERS;
+}
+
+/*
+ * Settings that must be known before the XDP object loads: map sizes
+ * (global.max_flows, whether behavioral classification runs, the number
+ * of subscribers) and
+ * features compiled in through .rodata (global.decap_tunnels,
+ * global.flow_active_timeout). global.flow_idle_timeout is read here too,
+ * beside its active counterpart.
+ */
+void read_load_time_config(const char *config_file)
+{
+    struct json_object *root, *obj, *tmp;
+    
+    root = json_object_from_file(config_file);
+    if (!root)
+        return;  /* Reported when the configuration is loaded */
+    
+    if (json_object_object_get_ex(root, "global", &obj) &&
+        json_object_object_get_ex(obj, "max_flows", &tmp) &&
+        json_object_get_int(tmp) > 0)
+        ctx.max_flows = json_object_get_int(tmp);
+    
+    if (json_object_object_get_ex(root, "global", &obj) &&
+        json_object_object_get_ex(obj, "decap_tunnels", &tmp))
+        ctx.tunnel_decap = json_object_get_boolean(tmp);
+    
+    if (json_object_object_get_ex(root, "global", &obj) &&
+        json_object_object_get_ex(obj, "flow_active_timeout", &tmp) &&
+        json_object_get_int(tmp) >= 0)
+        ctx.flow_active_timeout = json_object_get_int(tmp);
+    
+    if (json_object_object_get_ex(root, "global", &obj) &&
+        json_object_object_get_ex(obj, "flow_idle_timeout", &tmp) &&
+        json_object_get_int(tmp) > 0)
+        ctx.flow_idle_timeout = json_object_get_int(tmp);
+    
+    if (json_object_object_get_ex(root, "behavior", &obj) &&
+        json_object_object_get_ex(obj, "min_packets", &tmp))
+        ctx.behavior_enabled = json_object_get_int(tmp) > 0;
+    
+    if (json_object_object_get_ex(root, "subscribers", &obj))
+        ctx.max_subscribers = subscriber_ids_needed(obj);
+    
+    json_object_put(root);
+}
+
+/*
+ * Frames larger than one page need the multi-buffer program in native
+ * mode; treat any jumbo MTU that way rather than guess each driver's limit.
+ */
+#define XDP_SINGLE_BUF_MTU 1500
+
+int read_mtu(const char *ifname)
+{
+    char path[128];
+    int mtu = 0;
+    FILE *f;
+    
+    snprintf(path, sizeof(path), "/sys/class/net/%s/mtu", ifname);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%d", &mtu) != 1)
+        mtu = 0;
+    fclose(f);
+    return mtu;
+}
+
 /* Load XDP program */
 int load_xdp_program(const char *filename)
 {
+    const char *prog_name = ctx.xdp_frags ? "xdp_packet_classifier_frags" :
+                                            "xdp_packet_classifier";
+    struct bpf_program *prog;
+    struct bpf_map *map;
     int err;
     
     printf("Loading XDP program from %s...\n", filename);
@@ -194,15 +332,102 @@ int load_xdp_program(const char *filename)
         return -1;
     }
     
+    /* Only one variant is loaded: xdp.frags needs Linux 5.18 or later */
+    bpf_object__for_each_program(prog, ctx.xdp_obj) {
+        if (strcmp(bpf_program__name(prog), prog_name) != 0)
+            bpf_program__set_autoload(prog, false);
+    }
+    
+    /* Apply load-time settings */
+    if (ctx.prof_sample_rate) {
+        if (set_rodata_u32(ctx.xdp_obj, "prof_sample_rate",
+                           ctx.prof_sample_rate)) {
+            bpf_object__close(ctx.xdp_obj);
+            return -1;
+        }
+        printf("Per-stage profiling enabled (1 in %u packets)\n",
+               ctx.prof_sample_rate);
+    }
+    
+    if (ctx.tunnel_decap) {
+        if (set_rodata_u32(ctx.xdp_obj, "tunnel_decap", 1)) {
+            bpf_object__close(ctx.xdp_obj);
+            return -1;
+        }
+        printf("Tunnel decapsulation enabled (VXLAN, GENEVE, GRE, IP-in-IP)\n");
+    }
+    
+    if (ctx.flow_export_target) {
+        if (set_rodata_u32(ctx.xdp_obj, "flow_export", 1) ||
+            set_rodata_u32(ctx.xdp_obj, "flow_active_timeout",
+                           ctx.flow_active_timeout)) {
+            bpf_object__close(ctx.xdp_obj);
+            return -1;
+        }
+    }
+    
+    /* Flow tables are sized at load; flow_behav only for behavioral use */
+    map = bpf_object__find_map_by_name(ctx.xdp_obj, "flow_table");
+    if (map && ctx.max_flows)
+        bpf_map__set_max_entries(map, ctx.max_flows);
+    
+    map = bpf_object__find_map_by_name(ctx.xdp_obj, "flow_behav");
+    if (map)
+        bpf_map__set_max_entries(map, !ctx.behavior_enabled ? 1 :
+                                      ctx.max_flows ? ctx.max_flows : MAX_FLOWS);
+    
+    /* Subscriber buckets are indexed by id; one entry when there are none */
+    map = bpf_object__find_map_by_name(ctx.xdp_obj, "subscriber_buckets");
+    if (map)
+        bpf_map__set_max_entries(map, ctx.max_subscribers ? ctx.max_subscribers
+                                                          : 1);
+    
+    /* Flow export tables follow flow_table, or shrink to nothing */
+    map = bpf_object__find_map_by_name(ctx.xdp_obj, "flow_acct");
+    if (map)
+        bpf_map__set_max_entries(map, !ctx.flow_export_target ? 1 :
+                                      ctx.max_flows ? ctx.max_flows : MAX_FLOWS);
+    
+    map = bpf_object__find_map_by_name(ctx.xdp_obj, "flow_records");
+    if (map && !ctx.flow_export_target)
+        bpf_map__set_max_entries(map, sysconf(_SC_PAGESIZE));
+    
+    /* RX metadata kfuncs only reach the driver from a device-bound program */
+    if (ctx.hw_metadata_ifindex) {
+        prog = bpf_object__find_program_by_name(ctx.xdp_obj, prog_name);
+        
+        if (!prog || set_rodata_u32(ctx.xdp_obj, "hw_metadata", 1)) {
+            bpf_object__close(ctx.xdp_obj);
+            return -1;
+        }
+        bpf_program__set_ifindex(prog, ctx.hw_metadata_ifindex);
+        bpf_program__set_flags(prog, bpf_program__flags(prog) |
+                                     BPF_F_XDP_DEV_BOUND_ONLY);
+    }
+    
     err = bpf_object__load(ctx.xdp_obj);
+    if (err && ctx.hw_metadata_ifindex) {
+        /* Kernels before 6.3 cannot bind XDP programs to a device */
+        fprintf(stderr, "Warning: device-bound load failed (%s), "
+                "continuing without RX metadata\n", strerror(-err));
+        bpf_object__close(ctx.xdp_obj);
+        ctx.hw_metadata_ifindex = 0;
+        return load_xdp_program(filename);
+    }
+    if (err && ctx.xdp_frags) {
+        fprintf(stderr, "Warning: multi-buffer load failed (%s), "
+                "jumbo frames need generic XDP\n", strerror(-err));
+        bpf_object__close(ctx.xdp_obj);
+        ctx.xdp_frags = 0;
+        return load_xdp_program(filename);
+    }
     if (err) {
         fprintf(stderr, "Error loading XDP object: %s\n", strerror(-err));
         bpf_object__close(ctx.xdp_obj);
         return -1;
     }
     
-    ctx.xdp_prog = bpf_object__find_program_by_name(ctx.xdp_obj, 
-                                                     "xdp_packet_classifier");
+    ctx.xdp_prog = bpf_object__find_program_by_name(ctx.xdp_obj, prog_name);
     if (!ctx.xdp_prog) {
         fprintf(stderr, "Error finding XDP program\n");
         bpf_object__close(ctx.xdp_obj);
@@ -211,7 +436,8 @@ int load_xdp_program(const char *filename)
     
     ctx.xdp_fd = bpf_program__fd(ctx.xdp_prog);
     
-    printf("XDP program loaded successfully (fd=%d)\n", ctx.xdp_fd);
+    printf("XDP program loaded successfully (fd=%d%s)\n", ctx.xdp_fd,
+           ctx.xdp_frags ? ", multi-buffer" : "");
     return 0;
 }
 
@@ -338,6 +564,14 @@ int detach_tc_program(void)
              ctx.ifname);
     system(cmd);
     
+    /* The root hierarchy only makes sense with the program steering into it */
+    if (ctx.qdisc_installed) {
+        snprintf(cmd, sizeof(cmd), "tc qdisc del dev %s root 2>/dev/null || true",
+                 ctx.ifname);
+        system(cmd);
+        ctx.qdisc_installed = 0;
+    }
+    
     printf("TC program detached successfully\n");
     
     return 0;
@@ -360,11 +594,32 @@ int get_map_fds(void)
                                                           "queue_stats");
     ctx.token_buckets_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj,
                                                             "token_buckets");
+    ctx.prof_stats_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj,
+                                                         "prof_stats");
+    ctx.hh_topk_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "hh_topk");
+    ctx.behavior_rules_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj,
+                                                             "behavior_rules");
+    ctx.dscp_class_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "dscp_class");
+    ctx.subscriber_prefixes_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj,
+                                                                 "subscriber_prefixes");
+    ctx.subscriber_buckets_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj,
+                                                                "subscriber_buckets");
+    ctx.rxq_stats_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "rxq_stats");
+    ctx.rxq_cpu_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "rxq_cpu");
+    ctx.rule_set_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "rule_set");
+    ctx.rule_hits_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "rule_hits");
+    ctx.flow_acct_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj, "flow_acct");
+    ctx.flow_records_fd = bpf_object__find_map_fd_by_name(ctx.xdp_obj,
+                                                           "flow_records");
     
     if (ctx.flow_table_fd < 0 || ctx.class_config_fd < 0 ||
         ctx.class_rules_fd < 0 || ctx.cpu_stats_fd < 0 ||
         ctx.global_config_fd < 0 || ctx.queue_stats_fd < 0 ||
-        ctx.token_buckets_fd < 0) {
+        ctx.token_buckets_fd < 0 || ctx.prof_stats_fd < 0 ||
+        ctx.hh_topk_fd < 0 || ctx.behavior_rules_fd < 0 ||
+        ctx.subscriber_prefixes_fd < 0 || ctx.subscriber_buckets_fd < 0 ||
+        ctx.dscp_class_fd < 0 || ctx.rxq_stats_fd < 0 || ctx.rxq_cpu_fd < 0 ||
+        ctx.rule_set_fd < 0 || ctx.rule_hits_fd < 0) {
         fprintf(stderr, "Error getting map file descriptors\n");
         return -1;
     }
@@ -373,183 +628,1979 @@ int get_map_fds(void)
     return 0;
 }
 
-/* Load configuration from JSON file */
-int load_config_from_json(const char *config_file)
+/* Open the maps the TC program pinned, so configuration reaches it too */
+void get_tc_map_fds(void)
 {
-    struct json_object *root, *obj, *classes, *rules;
-    struct global_config gcfg = {0};
-    __u32 key = 0;
-    int err;
+    ctx.tc_class_config_fd = bpf_obj_get(TC_PIN_DIR "/class_config");
+    ctx.tc_global_config_fd = bpf_obj_get(TC_PIN_DIR "/global_config");
+    ctx.tc_queue_stats_fd = bpf_obj_get(TC_PIN_DIR "/queue_stats");
+    ctx.tc_egress_class_fd = bpf_obj_get(TC_PIN_DIR "/egress_class");
+    ctx.tc_latency_hist_fd = bpf_obj_get(TC_PIN_DIR "/latency_hist");
     
-    printf("Loading configuration from %s...\n", config_file);
+    if (ctx.tc_class_config_fd < 0 || ctx.tc_global_config_fd < 0 ||
+        ctx.tc_queue_stats_fd < 0)
+        fprintf(stderr, "Warning: TC maps not found in %s, "
+                "TC will run with default configuration\n", TC_PIN_DIR);
+}
+
+/* Write a configuration entry to the XDP map and its TC counterpart */
+int update_config_elem(int fd, int tc_fd, const void *key, const void *value)
+{
+    int err = bpf_map_update_elem(fd, key, value, BPF_ANY);
     
-    /* Parse JSON file */
-    root = json_object_from_file(config_file);
-    if (!root) {
-        fprintf(stderr, "Error parsing JSON file: %s\n", config_file);
-        return -1;
+    if (!err && tc_fd >= 0)
+        err = bpf_map_update_elem(tc_fd, key, value, BPF_ANY);
+    
+    return err;
+}
+
+/* DSCP codepoint from a number or a PHB name (EF, AF41, CS6, ...) */
+static int parse_dscp(struct json_object *obj)
+{
+    static const struct {
+        const char *name;
+        int dscp;
+    } phbs[] = {
+        { "CS0", 0 }, { "CS1", 8 }, { "CS2", 16 }, { "CS3", 24 },
+        { "CS4", 32 }, { "CS5", 40 }, { "CS6", 48 }, { "CS7", 56 },
+        { "AF11", 10 }, { "AF12", 12 }, { "AF13", 14 },
+        { "AF21", 18 }, { "AF22", 20 }, { "AF23", 22 },
+        { "AF31", 26 }, { "AF32", 28 }, { "AF33", 30 },
+        { "AF41", 34 }, { "AF42", 36 }, { "AF43", 38 },
+        { "VA", 44 }, { "EF", 46 },
+    };
+    const char *name;
+    
+    if (!json_object_is_type(obj, json_type_string)) {
+        int dscp = json_object_get_int(obj);
+        return dscp >= 0 && dscp < DSCP_MAX ? dscp : -1;
     }
     
-    /* Parse global configuration */
-    if (json_object_object_get_ex(root, "global", &obj)) {
+    name = json_object_get_string(obj);
+    for (size_t i = 0; i < sizeof(phbs) / sizeof(phbs[0]); i++) {
+        if (strcasecmp(name, phbs[i].name) == 0)
+            return phbs[i].dscp;
+    }
+    
+    return -1;
+}
+
+/* Load the DSCP -> class table; returns the number of mapped codepoints */
+int load_dscp_table(struct json_object *map)
+{
+    int n_entries = json_object_array_length(map);
+    int mapped = 0;
+    
+    for (int i = 0; i < n_entries; i++) {
+        struct json_object *ent = json_object_array_get_idx(map, i);
+        struct dscp_class_entry entry = { .enabled = 1 };
         struct json_object *tmp;
+        int dscp = -1;
+        __u32 key;
         
-        if (json_object_object_get_ex(obj, "scheduler", &tmp)) {
-            const char *sched = json_object_get_string(tmp);
-            if (strcmp(sched, "round_robin") == 0)
-                gcfg.sched_algorithm = SCHED_ROUND_ROBIN;
-            else if (strcmp(sched, "wfq") == 0)
-                gcfg.sched_algorithm = SCHED_WEIGHTED_FAIR_QUEUING;
-            else if (strcmp(sched, "strict_priority") == 0)
-                gcfg.sched_algorithm = SCHED_STRICT_PRIORITY;
-            else if (strcmp(sched, "drr") == 0)
-                gcfg.sched_algorithm = SCHED_DEFICIT_ROUND_ROBIN;
-            else if (strcmp(sched, "pifo") == 0)
-                gcfg.sched_algorithm = SCHED_PIFO;
-        }
+        if (json_object_object_get_ex(ent, "dscp", &tmp))
+            dscp = parse_dscp(tmp);
         
-        if (json_object_object_get_ex(obj, "default_class", &tmp))
-            gcfg.default_class = json_object_get_int(tmp);
+        if (json_object_object_get_ex(ent, "class_id", &tmp))
+            entry.class_id = json_object_get_int(tmp);
         
-        if (json_object_object_get_ex(obj, "quantum", &tmp))
-            gcfg.quantum = json_object_get_int(tmp);
-            
-        if (json_object_object_get_ex(obj, "starvation_threshold", &tmp))
-            gcfg.starvation_threshold = json_object_get_int(tmp);
+        if (dscp < 0 || entry.class_id >= MAX_CLASSES) {
+            fprintf(stderr, "Warning: dscp map entry %d: invalid dscp or class_id\n", i);
+            continue;
+        }
+        
+        key = dscp;
+        if (bpf_map_update_elem(ctx.dscp_class_fd, &key, &entry, BPF_ANY)) {
+            fprintf(stderr, "Error updating dscp map entry %d: %s\n", i,
+                    strerror(errno));
+            return -1;
+        }
+        mapped++;
     }
     
-    /* Update global config map */
-    err = bpf_map_update_elem(ctx.global_config_fd, &key, &gcfg, BPF_ANY);
-    if (err) {
-        fprintf(stderr, "Error updating global config: %s\n", strerror(errno));
-        json_object_put(root);
-        return -1;
+    return mapped;
+}
+
+/* JSON number, or a string in any base strtoull accepts (e.g. "0x10") */
+static __u64 json_get_u64(struct json_object *obj)
+{
+    if (json_object_is_type(obj, json_type_string))
+        return strtoull(json_object_get_string(obj), NULL, 0);
+    
+    return json_object_get_int64(obj);
+}
+
+/*
+ * Load egress classification for local traffic into the TC program's
+ * egress_class map. Each list maps one kind of key to a class; cgroups
+ * are named by their cgroup v2 directory, whose inode number is the id
+ * bpf_skb_cgroup_id() reports. Returns the GLOBAL_FLAG_EGRESS_* bits of
+ * the kinds that got entries.
+ */
+__u32 load_egress_classes(struct json_object *egress)
+{
+    static const struct {
+        const char *list;
+        const char *field;
+        __u32 kind;
+        __u32 flag;
+    } kinds[] = {
+        { "marks", "mark", EGRESS_KEY_MARK, GLOBAL_FLAG_EGRESS_MARK },
+        { "cgroups", "path", EGRESS_KEY_CGROUP, GLOBAL_FLAG_EGRESS_CGROUP },
+        { "priorities", "priority", EGRESS_KEY_PRIORITY, GLOBAL_FLAG_EGRESS_PRIO },
+    };
+    __u32 flags = 0;
+    
+    if (ctx.tc_egress_class_fd < 0) {
+        fprintf(stderr, "Warning: egress classification needs the TC program\n");
+        return 0;
     }
     
-    /* Parse traffic classes */
-    if (json_object_object_get_ex(root, "classes", &classes)) {
-        int n_classes = json_object_array_length(classes);
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        struct json_object *list;
+        int n;
         
-        for (int i = 0; i < n_classes; i++) {
-            struct json_object *cls = json_object_array_get_idx(classes, i);
-            struct class_config cfg = {0};
+        if (!json_object_object_get_ex(egress, kinds[k].list, &list))
+            continue;
+        
+        n = json_object_array_length(list);
+        for (int i = 0; i < n; i++) {
+            struct json_object *ent = json_object_array_get_idx(list, i);
+            struct egress_key key = { .kind = kinds[k].kind };
             struct json_object *tmp;
+            __u32 class_id = MAX_CLASSES;
             
-            if (json_object_object_get_ex(cls, "id", &tmp))
-                cfg.id = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(cls, "rate_limit", &tmp))
-                cfg.rate_limit = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(cls, "burst_size", &tmp))
-                cfg.burst_size = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(cls, "priority", &tmp))
-                cfg.priority = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(cls, "weight", &tmp))
-                cfg.weight = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(cls, "min_bandwidth", &tmp))
-                cfg.min_bandwidth = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(cls, "max_bandwidth", &tmp))
-                cfg.max_bandwidth = json_object_get_int(tmp);
+            if (json_object_object_get_ex(ent, "class_id", &tmp))
+                class_id = json_object_get_int(tmp);
             
-            /* Update class config map */
-            err = bpf_map_update_elem(ctx.class_config_fd, &cfg.id, &cfg, BPF_ANY);
-            if (err) {
-                fprintf(stderr, "Error updating class %u config: %s\n",
-                        cfg.id, strerror(errno));
+            if (!json_object_object_get_ex(ent, kinds[k].field, &tmp) ||
+                class_id >= MAX_CLASSES) {
+                fprintf(stderr, "Warning: egress %s entry %d: needs %s and a "
+                        "valid class_id\n", kinds[k].list, i, kinds[k].field);
+                continue;
             }
             
-            /* Initialize token bucket for this class */
-            if (cfg.rate_limit > 0) {
-                struct token_bucket tb = {
-                    .tokens = cfg.burst_size,
-                    .rate = cfg.rate_limit,
-                    .capacity = cfg.burst_size,
-                    .last_update = 0,
-                };
+            if (kinds[k].kind == EGRESS_KEY_CGROUP) {
+                struct stat st;
                 
-                err = bpf_map_update_elem(ctx.token_buckets_fd, &cfg.id, &tb, BPF_ANY);
-                if (err) {
-                    fprintf(stderr, "Error initializing token bucket for class %u: %s\n",
-                            cfg.id, strerror(errno));
+                if (stat(json_object_get_string(tmp), &st) < 0) {
+                    fprintf(stderr, "Warning: cgroup %s: %s\n",
+                            json_object_get_string(tmp), strerror(errno));
+                    continue;
                 }
+                key.value = st.st_ino;
+            } else {
+                key.value = json_get_u64(tmp);
             }
-        }
-        
-        printf("Configured %d traffic classes\n", n_classes);
-    }
-    
-    /* Parse classification rules */
-    if (json_object_object_get_ex(root, "rules", &rules)) {
-        int n_rules = json_object_array_length(rules);
-        
-        for (int i = 0; i < n_rules && i < MAX_RULES; i++) {
-            struct json_object *rule_obj = json_object_array_get_idx(rules, i);
-            struct class_rule rule = {0};
-            struct json_object *tmp;
-            
-            if (json_object_object_get_ex(rule_obj, "protocol", &tmp)) {
-                const char *proto = json_object_get_string(tmp);
-                if (strcmp(proto, "tcp") == 0)
-                    rule.protocol = IPPROTO_TCP;
-                else if (strcmp(proto, "udp") == 0)
-                    rule.protocol = IPPROTO_UDP;
-                else if (strcmp(proto, "icmp") == 0)
-                    rule.protocol = IPPROTO_ICMP;
-            }
-            
-            if (json_object_object_get_ex(rule_obj, "dst_port_min", &tmp))
-                rule.dst_port_min = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(rule_obj, "dst_port_max", &tmp))
-                rule.dst_port_max = json_object_get_int(tmp);
             
-            if (json_object_object_get_ex(rule_obj, "class_id", &tmp))
-                rule.class_id = json_object_get_int(tmp);
-            
-            if (json_object_object_get_ex(rule_obj, "priority", &tmp))
-                rule.priority = json_object_get_int(tmp);
-            
-            /* Default port range if not specified */
-            if (rule.dst_port_max == 0 && rule.dst_port_min > 0)
-                rule.dst_port_max = rule.dst_port_min;
-            
-            /* Update rules map */
-            __u32 rule_key = i;
-            err = bpf_map_update_elem(ctx.class_rules_fd, &rule_key, &rule, BPF_ANY);
-            if (err) {
-                fprintf(stderr, "Error updating rule %d: %s\n", i, strerror(errno));
+            if (bpf_map_update_elem(ctx.tc_egress_class_fd, &key, &class_id,
+                                    BPF_ANY)) {
+                fprintf(stderr, "Error updating egress %s entry %d: %s\n",
+                        kinds[k].list, i, strerror(errno));
+                continue;
             }
+            flags |= kinds[k].flag;
         }
-        
-        printf("Configured %d classification rules\n", n_rules);
     }
     
-    json_object_put(root);
-    printf("Configuration loaded successfully\n");
-    return 0;
+    return flags;
 }
 
-/* Print statistics */
-void print_statistics(void)
+/*
+ * Load per-subscriber contracts. Each entry names its prefixes, or one
+ * prefix plus "per_subnet_len" to create a subscriber for every subnet of
+ * that length inside it (e.g. a /12 pool split into /32 hosts). Ids are
+ * assigned in order unless an entry sets "id", which may skip ahead but
+ * not go back to ids already handed out. Returns one past the highest id
+ * used (0 when nothing was configured), or -1 on error.
+ */
+int load_subscribers(struct json_object *subs)
 {
-    struct cpu_stats stats = {0};
-    struct queue_stats qstats;
-    __u32 key = 0;
+    int n_entries = json_object_array_length(subs);
+    __u32 next_id = 0;
     int err;
     
-    /* Get CPU statistics */
-    err = bpf_map_lookup_elem(ctx.cpu_stats_fd, &key, &stats);
-    if (err) {
-        fprintf(stderr, "Error reading CPU stats: %s\n", strerror(errno));
-        return;
-    }
-    
-    printf("\n===== Statistics =====\n");
+    for (int i = 0; i < n_entries; i++) {
+        struct json_object *ent = json_object_array_get_idx(subs, i);
+        struct json_object *tmp, *prefixes = NULL;
+        struct subscriber_info info = {0};
+        struct subscriber_bucket *buckets;
+        __u32 *ids;
+        __u32 addr, plen, split = 0, n;
+        __u64 count = 1;            /* A /0 split is 2^32 subscribers */
+        
+        if (json_object_object_get_ex(ent, "rate_limit", &tmp))
+            info.rate = json_object_get_int(tmp);
+        
+        if (json_object_object_get_ex(ent, "burst_size", &tmp))
+            info.burst = json_object_get_int(tmp);
+        
+        if (json_object_object_get_ex(ent, "per_subnet_len", &tmp))
+            split = json_object_get_int(tmp);
+        
+        if (!json_object_object_get_ex(ent, "prefixes", &prefixes) &&
+            !json_object_object_get_ex(ent, "prefix", &prefixes)) {
+            fprintf(stderr, "Warning: subscriber entry %d has no prefix\n", i);
+            continue;
+        }
+        
+        /* A subscriber must be able to send at least one full packet */
+        if (info.rate && info.burst < 1514)
+            info.burst = 1514;
+        
+        if (split) {
+            if (!json_object_is_type(prefixes, json_type_string) ||
+                parse_prefix(json_object_get_string(prefixes), &addr, &plen) ||
+                split < plen || split > 32) {
+                fprintf(stderr, "Warning: subscriber entry %d: per_subnet_len "
+                        "needs one prefix no longer than it\n", i);
+                continue;
+            }
+            count = 1ULL << (split - plen);
+        } else if (json_object_object_get_ex(ent, "id", &tmp)) {
+            int id = json_object_get_int(tmp);
+            
+            /* Going back would share, and reset, another subscriber's bucket */
+            if (id < 0 || (__u32)id < next_id) {
+                fprintf(stderr, "Warning: subscriber entry %d: id %d is below "
+                        "the next free id %u\n", i, id, next_id);
+                continue;
+            }
+            next_id = id;
+        }
+        
+        /* subscriber_buckets was sized from this section at load */
+        if (next_id >= ctx.max_subscribers ||
+            count > ctx.max_subscribers - next_id) {
+            fprintf(stderr, "Warning: subscriber entry %d exceeds %u subscribers\n",
+                    i, ctx.max_subscribers);
+            break;
+        }
+        
+        /* Fresh buckets start full; written in one batch per entry */
+        ids = calloc(count, sizeof(*ids));
+        buckets = calloc(count, sizeof(*buckets));
+        if (!ids || !buckets) {
+            free(ids);
+            free(buckets);
+            return -1;
+        }
+        
+        for (__u32 j = 0; j < count; j++) {
+            ids[j] = next_id + j;
+            buckets[j].tokens = info.burst;
+        }
+        
+        n = count;
+        err = bpf_map_update_batch(ctx.subscriber_buckets_fd, ids, buckets,
+                                   &n, NULL);
+        free(ids);
+        free(buckets);
+        if (err) {
+            fprintf(stderr, "Error initializing subscriber buckets: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        
+        /* Then point each prefix at its subscriber */
+        if (split) {
+            for (__u32 j = 0; j < count; j++) {
+                struct subscriber_key key = {
+                    .prefixlen = split,
+                    .addr = htonl(ntohl(addr) + (__u32)((__u64)j << (32 - split))),
+                };
+                
+                info.id = next_id + j;
+                err = bpf_map_update_elem(ctx.subscriber_prefixes_fd, &key,
+                                          &info, BPF_ANY);
+                if (err)
+                    break;
+            }
+        } else {
+            int n_prefixes = json_object_is_type(prefixes, json_type_array) ?
+                             json_object_array_length(prefixes) : 1;
+            
+            info.id = next_id;
+            for (int j = 0; j < n_prefixes; j++) {
+                struct json_object *p = json_object_is_type(prefixes, json_type_array) ?
+                                        json_object_array_get_idx(prefixes, j) : prefixes;
+                struct subscriber_key key;
+                
+                if (parse_prefix(json_object_get_string(p), &key.addr,
+                                 &key.prefixlen)) {
+                    fprintf(stderr, "Warning: subscriber %u: bad prefix '%s'\n",
+                            info.id, json_object_get_string(p));
+                    continue;
+                }
+                
+                err = bpf_map_update_elem(ctx.subscriber_prefixes_fd, &key,
+                                          &info, BPF_ANY);
+                if (err)
+                    break;
+            }
+        }
+        
+        if (err) {
+            fprintf(stderr, "Error updating subscriber prefixes: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        
+        next_id += count;
+    }
+    
+    return next_id;
+}
+
+/* Run a tc command; returns the exit status */
+static int run_tc(const char *fmt, ...)
+{
+    char cmd[512];
+    va_list ap;
+    
+    va_start(ap, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+    
+    return system(cmd);
+}
+
+/* Number of "rx-" or "tx-" queues of the interface, from sysfs */
+static int count_queues(const char *ifname, const char *prefix)
+{
+    char path[128];
+    struct dirent *ent;
+    DIR *dir;
+    int n = 0;
+    
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    
+    while ((ent = readdir(dir)))
+        if (strncmp(ent->d_name, prefix, strlen(prefix)) == 0)
+            n++;
+    
+    closedir(dir);
+    return n;
+}
+
+/* Write a value to a sysfs/procfs file */
+static int write_sysfs(const char *path, const char *value)
+{
+    FILE *f = fopen(path, "w");
+    int err;
+    
+    if (!f)
+        return -1;
+    
+    err = fputs(value, f) < 0;
+    err |= fclose(f) != 0;
+    return err ? -1 : 0;
+}
+
+/* XPS would override the TX queue the TC program picks; turn it off */
+static void disable_xps(int n_queues)
+{
+    static const char *files[] = { "xps_cpus", "xps_rxqs" };
+    char path[160];
+    
+    /* Devices without XPS (or without the rxqs map) lack the files */
+    for (int q = 0; q < n_queues; q++) {
+        for (int i = 0; i < 2; i++) {
+            snprintf(path, sizeof(path), "/sys/class/net/%s/queues/tx-%d/%s",
+                     ctx.ifname, q, files[i]);
+            write_sysfs(path, "0\n");
+        }
+    }
+}
+
+/*
+ * Build the qdisc hierarchy the TC program steers into: mq at the root
+ * with an HTB per TX queue, an HTB class per traffic class below a root
+ * class at the link rate, and fq_codel (fq for paced classes, which needs
+ * the departure times) in each leaf. A queue gets an equal share of the
+ * guarantees, while ceilings stay whole since a flow uses one queue only.
+ * Rates are bytes/s like the rest of the file. Returns the number of TX
+ * queues steered across, 0 when disabled, -1 on error.
+ */
+static int setup_qdisc_hierarchy(struct json_object *qdisc,
+                                 struct json_object *classes,
+                                 const struct global_config *gcfg)
+{
+    struct json_object *tmp;
+    const char *leaf = "fq_codel";
+    __u64 link_rate = gcfg->total_rate_limit;
+    int n_dev, n_txq;
+    
+    if (json_object_object_get_ex(qdisc, "enabled", &tmp) &&
+        !json_object_get_boolean(tmp))
+        return 0;
+    
+    if (ctx.tc_global_config_fd < 0) {
+        fprintf(stderr, "Warning: qdisc hierarchy needs the TC program (-t), "
+                "not building it\n");
+        return 0;
+    }
+    
+    if (json_object_object_get_ex(qdisc, "link_rate", &tmp))
+        link_rate = json_get_u64(tmp);
+    if (!link_rate)
+        link_rate = 1250000000ULL;  /* 10 Gbit/s */
+    
+    if (json_object_object_get_ex(qdisc, "leaf", &tmp)) {
+        leaf = json_object_get_string(tmp);
+        if (strcmp(leaf, "fq_codel") != 0 && strcmp(leaf, "fq") != 0) {
+            fprintf(stderr, "Warning: unknown qdisc leaf '%s', using fq_codel\n",
+                    leaf);
+            leaf = "fq_codel";
+        }
+    }
+    
+    n_dev = count_queues(ctx.ifname, "tx-");
+    if (n_dev < 1)
+        n_dev = 1;
+    
+    /* Fewer queues than the device has is fine: the rest stay unused */
+    n_txq = n_dev;
+    if (json_object_object_get_ex(qdisc, "tx_queues", &tmp) &&
+        json_object_get_int(tmp) > 0 && json_object_get_int(tmp) < n_txq)
+        n_txq = json_object_get_int(tmp);
+    if (n_txq > MAX_TX_QUEUES) {
+        fprintf(stderr, "Warning: using only %d of %d TX queues\n",
+                MAX_TX_QUEUES, n_txq);
+        n_txq = MAX_TX_QUEUES;
+    }
+    
+    /* mq refuses single-queue devices, whose HTB goes at the root */
+    if (n_dev > 1 &&
+        run_tc("tc qdisc replace dev %s root handle 1: mq", ctx.ifname) != 0) {
+        fprintf(stderr, "Error installing mq root qdisc on %s\n", ctx.ifname);
+        return -1;
+    }
+    ctx.qdisc_installed = 1;
+    
+    for (int q = 0; q < n_txq; q++) {
+        unsigned int major = TXQ_HTB_MAJOR + q;
+        char parent[32];
+        
+        if (n_dev > 1)
+            snprintf(parent, sizeof(parent), "parent 1:%x", q + 1);
+        else
+            snprintf(parent, sizeof(parent), "root");
+        
+        if (run_tc("tc qdisc replace dev %s %s handle %x: htb default %x",
+                   ctx.ifname, parent, major, gcfg->default_class + 1) != 0 ||
+            run_tc("tc class replace dev %s parent %x: classid %x:ffff htb "
+                   "rate %llubit ceil %llubit", ctx.ifname, major, major,
+                   link_rate * 8 / n_txq, link_rate * 8) != 0)
+            goto err;
+        
+        for (int i = 0; classes && i < (int)json_object_array_length(classes); i++) {
+            struct json_object *cls = json_object_array_get_idx(classes, i);
+            __u64 rate = 0, ceil = 0;
+            int id = 0, prio = 0, paced = 0;
+            
+            if (json_object_object_get_ex(cls, "id", &tmp))
+                id = json_object_get_int(tmp);
+            if (id < 0 || id >= MAX_CLASSES)
+                continue;
+            
+            if (json_object_object_get_ex(cls, "min_bandwidth", &tmp))
+                rate = json_get_u64(tmp);
+            if (json_object_object_get_ex(cls, "max_bandwidth", &tmp))
+                ceil = json_get_u64(tmp);
+            if (!ceil && json_object_object_get_ex(cls, "rate_limit", &tmp))
+                ceil = json_get_u64(tmp);
+            if (json_object_object_get_ex(cls, "priority", &tmp))
+                prio = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "pacing_rate", &tmp))
+                paced = json_object_get_int(tmp) > 0;
+            
+            /* Classes without a guarantee still need a rate; 1% of the link */
+            if (!rate)
+                rate = link_rate / 100;
+            rate /= n_txq;
+            if (!ceil || ceil > link_rate)
+                ceil = link_rate;
+            if (rate < 1000)
+                rate = 1000;
+            if (ceil < rate)
+                ceil = rate;
+            
+            if (run_tc("tc class replace dev %s parent %x:ffff classid %x:%x "
+                       "htb rate %llubit ceil %llubit prio %d", ctx.ifname,
+                       major, major, id + 1, rate * 8, ceil * 8,
+                       prio < 0 ? 0 : prio > 7 ? 7 : prio) != 0 ||
+                run_tc("tc qdisc replace dev %s parent %x:%x %s", ctx.ifname,
+                       major, id + 1, paced ? "fq" : leaf) != 0)
+                goto err;
+        }
+    }
+    
+    disable_xps(n_dev);
+    
+    printf("Built mq/HTB hierarchy on %s: %d TX queue%s, %s leaves\n",
+           ctx.ifname, n_txq, n_txq == 1 ? "" : "s", leaf);
+    return n_txq;
+    
+err:
+    fprintf(stderr, "Error building qdisc hierarchy on %s\n", ctx.ifname);
+    run_tc("tc qdisc del dev %s root 2>/dev/null", ctx.ifname);
+    ctx.qdisc_installed = 0;
+    return -1;
+}
+
+/* Parse a sysfs CPU list ("0-3,8-11") into cpus[]; returns the count */
+static int read_cpulist(const char *path, int *cpus, int max)
+{
+    char buf[4096], *tok, *save;
+    FILE *f = fopen(path, "r");
+    int n = 0;
+    
+    if (!f)
+        return -1;
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    
+    for (tok = strtok_r(buf, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save)) {
+        int lo, hi;
+        
+        if (sscanf(tok, "%d-%d", &lo, &hi) != 2) {
+            if (sscanf(tok, "%d", &lo) != 1)
+                continue;
+            hi = lo;
+        }
+        for (int cpu = lo; cpu <= hi && n < max; cpu++)
+            cpus[n++] = cpu;
+    }
+    
+    return n;
+}
+
+/* Hex cpumask as sysfs wants it: 32-bit groups, most significant first */
+static void format_cpumask(const int *cpus, int n, char *buf, size_t len)
+{
+    __u32 words[MAX_CPUS / 32] = {0};
+    size_t off = 0;
+    int top = 0;
+    
+    for (int i = 0; i < n; i++) {
+        if (cpus[i] < 0 || cpus[i] >= MAX_CPUS)
+            continue;
+        words[cpus[i] / 32] |= 1U << (cpus[i] % 32);
+        if (cpus[i] / 32 > top)
+            top = cpus[i] / 32;
+    }
+    
+    for (int w = top; w >= 0 && off < len; w--)
+        off += snprintf(buf + off, len - off, w == top ? "%x" : ",%08x",
+                        words[w]);
+}
+
+/*
+ * IRQ of each RX queue, from the vector names in /proc/interrupts:
+ * "eth0-rx-3", "eth0-TxRx-3" or "ice-eth0-TxRx-3" service RX queue 3.
+ * TX-only vectors and interrupts named after the bare interface (link
+ * state, mailbox) are skipped. irqs[q] is -1 where queue q has no vector
+ * of its own, or where the names are ambiguous (two vectors for one queue,
+ * or a queue vector whose name does not say its direction); those queues
+ * are left alone with a warning. Returns the number of queue slots filled
+ * in (highest queue found + 1).
+ */
+static int find_queue_irqs(const char *ifname, int *irqs, int max)
+{
+    static const char *rx_kinds[] = { "rx", "txrx", "rxtx", "combined" };
+    size_t name_len = strlen(ifname);
+    char line[4096];
+    FILE *f = fopen("/proc/interrupts", "r");
+    int n = 0, unknown = 0;
+    
+    if (!f)
+        return -1;
+    
+    for (int q = 0; q < max; q++)
+        irqs[q] = -1;
+    
+    while (fgets(line, sizeof(line), f)) {
+        char *name, *colon, *tail, *num;
+        size_t kind_len;
+        int irq, q, rx = 0;
+        
+        if (sscanf(line, " %d:", &irq) != 1)
+            continue;
+        
+        colon = strchr(line, ':');
+        for (name = strstr(colon, ifname); name; name = strstr(name + 1, ifname)) {
+            if ((name[-1] == ' ' || name[-1] == '-') && name[name_len] == '-')
+                break;
+        }
+        if (!name)
+            continue;
+        
+        /* "<kind>-<queue>" after the interface name */
+        tail = name + name_len + 1;
+        tail[strcspn(tail, " \t\n")] = '\0';
+        num = strrchr(tail, '-');
+        if (!num) {
+            unknown += tail[0] >= '0' && tail[0] <= '9';   /* "eth0-5" */
+            continue;
+        }
+        if (num == tail || !num[1] ||
+            num[1 + strspn(num + 1, "0123456789")] != '\0')
+            continue;
+        kind_len = num - tail;
+        q = atoi(num + 1);
+        
+        for (size_t k = 0; k < sizeof(rx_kinds) / sizeof(rx_kinds[0]); k++)
+            rx |= kind_len == strlen(rx_kinds[k]) &&
+                  !strncasecmp(tail, rx_kinds[k], kind_len);
+        if (!rx) {
+            if (kind_len != 2 || strncasecmp(tail, "tx", 2))
+                unknown++;
+            continue;
+        }
+        if (q >= max)
+            continue;
+        
+        if (irqs[q] >= 0) {
+            fprintf(stderr, "Warning: IRQs %d and %d both claim %s RX queue %d, "
+                    "leaving it alone\n", irqs[q], irq, ifname, q);
+            irqs[q] = -2;
+        } else if (irqs[q] == -1) {
+            irqs[q] = irq;
+        }
+        if (q + 1 > n)
+            n = q + 1;
+    }
+    fclose(f);
+    
+    for (int q = 0; q < n; q++) {
+        if (irqs[q] == -2)
+            irqs[q] = -1;
+    }
+    if (unknown)
+        fprintf(stderr, "Warning: %d %s queue IRQs have names without a "
+                "direction (rx-N, TxRx-N), left alone\n", unknown, ifname);
+    return n;
+}
+
+/*
+ * Multi-queue/NUMA deployment (-N): keep every RX queue on its own CPU of
+ * the NIC's NUMA node, so flows, their state and their TX completions
+ * stay on cache-warm cores. Queue IRQs are pinned round-robin to the
+ * node's CPUs and each pinned CPU is recorded in rxq_cpu, where the XDP
+ * program counts packets that end up elsewhere. XPS sends each CPU's
+ * traffic out of a queue of the same CPU set, unless the qdisc hierarchy
+ * picks TX queues itself. RPS is only used when there are fewer RX queues
+ * than local CPUs. irqbalance would undo the IRQ pinning and should be off.
+ */
+int setup_numa_affinity(void)
+{
+    static int cpus[MAX_CPUS];
+    int irqs[MAX_RX_QUEUES];
+    char path[160], val[MAX_CPUS / 4 + MAX_CPUS / 32 + 2];
+    int node = -1, n_cpus, n_irqs, n_rxq, n_txq, n_pinned = 0;
+    FILE *f;
+    
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ctx.ifname);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &node) != 1)
+            node = -1;
+        fclose(f);
+    }
+    
+    /* Without NUMA information (or hardware) every online CPU is local */
+    if (node >= 0)
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    else
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/online");
+    n_cpus = read_cpulist(path, cpus, MAX_CPUS);
+    if (n_cpus <= 0) {
+        fprintf(stderr, "Error reading CPU topology from %s\n", path);
+        return -1;
+    }
+    
+    n_rxq = count_queues(ctx.ifname, "rx-");
+    n_txq = count_queues(ctx.ifname, "tx-");
+    if (n_rxq > MAX_RX_QUEUES)
+        n_rxq = MAX_RX_QUEUES;
+    
+    printf("NUMA mode: %s node %d, %d local CPUs, %d RX / %d TX queues\n",
+           ctx.ifname, node, n_cpus, n_rxq, n_txq);
+    
+    /* IRQ affinity; queue i is serviced by the i-th local CPU */
+    n_irqs = find_queue_irqs(ctx.ifname, irqs, MAX_RX_QUEUES);
+    if (n_irqs <= 0)
+        printf("  No per-queue IRQs found, IRQ affinity left alone\n");
+    
+    for (int q = 0; q < n_irqs; q++) {
+        __u32 key = q, pinned = cpus[q % n_cpus] + 1;
+        
+        if (irqs[q] < 0)
+            continue;
+        
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irqs[q]);
+        snprintf(val, sizeof(val), "%d\n", cpus[q % n_cpus]);
+        if (write_sysfs(path, val)) {
+            fprintf(stderr, "Warning: cannot pin IRQ %d: %s\n", irqs[q],
+                    strerror(errno));
+            continue;
+        }
+        
+        n_pinned++;
+        if (q < n_rxq)
+            bpf_map_update_elem(ctx.rxq_cpu_fd, &key, &pinned, BPF_ANY);
+    }
+    if (n_pinned > 0)
+        printf("  Pinned %d RX queue IRQs\n", n_pinned);
+    
+    /* XPS: local CPU j transmits on queue j % n_txq */
+    if (ctx.qdisc_installed) {
+        printf("  XPS left off: the qdisc hierarchy picks TX queues\n");
+    } else {
+        for (int q = 0; q < n_txq; q++) {
+            int xps[MAX_CPUS], n = 0;
+            
+            for (int j = q; j < n_cpus; j += n_txq)
+                xps[n++] = cpus[j];
+            if (!n)
+                xps[n++] = cpus[q % n_cpus];
+            
+            format_cpumask(xps, n, val, sizeof(val));
+            snprintf(path, sizeof(path), "/sys/class/net/%s/queues/tx-%d/xps_cpus",
+                     ctx.ifname, q);
+            write_sysfs(path, val);
+        }
+        printf("  XPS mapped %d local CPUs to %d TX queues\n", n_cpus, n_txq);
+    }
+    
+    /* RPS spreads the stack's work when the queues alone cannot */
+    if (n_rxq > 0 && n_rxq < n_cpus)
+        format_cpumask(cpus, n_cpus, val, sizeof(val));
+    else
+        snprintf(val, sizeof(val), "0");
+    for (int q = 0; q < n_rxq; q++) {
+        snprintf(path, sizeof(path), "/sys/class/net/%s/queues/rx-%d/rps_cpus",
+                 ctx.ifname, q);
+        write_sysfs(path, val);
+    }
+    printf("  RPS %s\n", n_rxq > 0 && n_rxq < n_cpus ?
+           "spreads each RX queue over the local CPUs" : "off");
+    
+    return 0;
+}
+
+/* "0-0" is any port */
+static int port_ranges_overlap(__u16 amin, __u16 amax, __u16 bmin, __u16 bmax)
+{
+    if ((!amin && !amax) || (!bmin && !bmax))
+        return 1;
+    return amin <= bmax && bmin <= amax;
+}
+
+/* Whether one packet could match both rules; such pairs keep their order */
+static int rules_overlap(const struct class_rule *a, const struct class_rule *b)
+{
+    __u32 mask;
+    
+    if (a->protocol && b->protocol && a->protocol != b->protocol)
+        return 0;
+    
+    if (a->tenant && b->tenant && a->tenant != b->tenant)
+        return 0;
+    
+    mask = a->src_ip_mask & b->src_ip_mask;
+    if ((a->src_ip & mask) != (b->src_ip & mask))
+        return 0;
+    
+    mask = a->dst_ip_mask & b->dst_ip_mask;
+    if ((a->dst_ip & mask) != (b->dst_ip & mask))
+        return 0;
+    
+    return port_ranges_overlap(a->src_port_min, a->src_port_max,
+                               b->src_port_min, b->src_port_max) &&
+           port_ranges_overlap(a->dst_port_min, a->dst_port_max,
+                               b->dst_port_min, b->dst_port_max);
+}
+
+/* Write ctx.rules into a bank of class_rules and make it the active one */
+static int install_rule_bank(__u32 base)
+{
+    struct rule_set set = { .base = base, .count = ctx.n_rules };
+    __u32 key = 0;
+    
+    for (__u32 i = 0; i < ctx.n_rules; i++) {
+        __u32 slot = base + i;
+        
+        if (bpf_map_update_elem(ctx.class_rules_fd, &slot, &ctx.rules[i],
+                                BPF_ANY)) {
+            fprintf(stderr, "Error updating rule slot %u: %s\n", slot,
+                    strerror(errno));
+            return -1;
+        }
+    }
+    
+    if (bpf_map_update_elem(ctx.rule_set_fd, &key, &set, BPF_ANY)) {
+        fprintf(stderr, "Error switching rule bank: %s\n", strerror(errno));
+        return -1;
+    }
+    
+    ctx.rule_base = base;
+    return 0;
+}
+
+/* Matches per rule id, summed over CPUs */
+static int read_rule_hits(__u64 *hits)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    __u64 *percpu;
+    
+    if (ncpus <= 0)
+        return -1;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    if (!percpu)
+        return -1;
+    
+    for (__u32 id = 0; id < RULE_BANK_SIZE; id++) {
+        hits[id] = 0;
+        if (bpf_map_lookup_elem(ctx.rule_hits_fd, &id, percpu))
+            continue;
+        for (int cpu = 0; cpu < ncpus; cpu++)
+            hits[id] += percpu[cpu];
+    }
+    
+    free(percpu);
+    return 0;
+}
+
+/*
+ * Adaptive rule order: move rules that matched more often since the last
+ * pass (with the older history halved each pass) ahead of colder ones.
+ * Only adjacent rules that no packet could match both of are swapped, so
+ * every overlapping pair keeps its configured order and no packet changes
+ * class. The new order goes into the idle bank before it is switched in.
+ */
+void reorder_rules(void)
+{
+    __u64 hits[RULE_BANK_SIZE];
+    struct class_rule tmp;
+    int swapped, moved = 0;
+    
+    if (ctx.n_rules < 2 || read_rule_hits(hits))
+        return;
+    
+    for (__u32 id = 0; id < RULE_BANK_SIZE; id++) {
+        ctx.rule_score[id] = ctx.rule_score[id] / 2 +
+                             (hits[id] - ctx.rule_hits_prev[id]);
+        ctx.rule_hits_prev[id] = hits[id];
+    }
+    
+    do {
+        swapped = 0;
+        for (__u32 i = 0; i + 1 < ctx.n_rules; i++) {
+            struct class_rule *a = &ctx.rules[i], *b = &ctx.rules[i + 1];
+            
+            if (ctx.rule_score[b->id] <= ctx.rule_score[a->id] ||
+                rules_overlap(a, b))
+                continue;
+            
+            tmp = *a;
+            *a = *b;
+            *b = tmp;
+            swapped = moved = 1;
+        }
+    } while (swapped);
+    
+    if (!moved)
+        return;
+    
+    if (install_rule_bank(ctx.rule_base ? 0 : RULE_BANK_SIZE) == 0) {
+        printf("Reordered classification rules:");
+        for (__u32 i = 0; i < ctx.n_rules; i++)
+            printf(" %u", ctx.rules[i].id);
+        printf("\n");
+    }
+}
+
+/* Print per-rule matches in the current order */
+void print_rule_hits(void)
+{
+    __u64 hits[RULE_BANK_SIZE];
+    
+    if (!ctx.n_rules || read_rule_hits(hits))
+        return;
+    
+    printf("\n===== Classification Rules =====\n");
+    printf("  %-5s %-5s %-5s %-6s %14s\n", "order", "rule", "class", "prio",
+           "matches");
+    for (__u32 i = 0; i < ctx.n_rules; i++) {
+        const struct class_rule *r = &ctx.rules[i];
+        
+        printf("  %-5u %-5u %-5u %-6u %14llu\n", i, r->id, r->class_id,
+               r->priority, hits[r->id]);
+    }
+}
+
+/* Load configuration from JSON file */
+int load_config_from_json(const char *config_file)
+{
+    struct json_object *root, *obj, *classes, *rules;
+    struct global_config gcfg = { .wire_overhead = ETH_WIRE_OVERHEAD };
+    __u32 key = 0;
+    int err;
+    
+    printf("Loading configuration from %s...\n", config_file);
+    
+    /* Parse JSON file */
+    root = json_object_from_file(config_file);
+    if (!root) {
+        fprintf(stderr, "Error parsing JSON file: %s\n", config_file);
+        return -1;
+    }
+    
+    /* Parse global configuration */
+    if (json_object_object_get_ex(root, "global", &obj)) {
+        struct json_object *tmp;
+        
+        if (json_object_object_get_ex(obj, "scheduler", &tmp)) {
+            const char *sched = json_object_get_string(tmp);
+            if (strcmp(sched, "round_robin") == 0)
+                gcfg.sched_algorithm = SCHED_ROUND_ROBIN;
+            else if (strcmp(sched, "wfq") == 0)
+                gcfg.sched_algorithm = SCHED_WEIGHTED_FAIR_QUEUING;
+            else if (strcmp(sched, "strict_priority") == 0)
+                gcfg.sched_algorithm = SCHED_STRICT_PRIORITY;
+            else if (strcmp(sched, "drr") == 0)
+                gcfg.sched_algorithm = SCHED_DEFICIT_ROUND_ROBIN;
+            else if (strcmp(sched, "pifo") == 0)
+                gcfg.sched_algorithm = SCHED_PIFO;
+        }
+        
+        if (json_object_object_get_ex(obj, "default_class", &tmp))
+            gcfg.default_class = json_object_get_int(tmp);
+        
+        if (json_object_object_get_ex(obj, "quantum", &tmp))
+            gcfg.quantum = json_object_get_int(tmp);
+            
+        if (json_object_object_get_ex(obj, "starvation_threshold", &tmp))
+            gcfg.starvation_threshold = json_object_get_int(tmp);
+        
+        if (json_object_object_get_ex(obj, "total_rate_limit", &tmp))
+            gcfg.total_rate_limit = json_object_get_int(tmp);
+        
+        /* Separate from total_rate_limit, which AQM also uses on its own */
+        if (json_object_object_get_ex(obj, "link_sharing", &tmp) &&
+            json_object_get_boolean(tmp)) {
+            if (gcfg.total_rate_limit)
+                gcfg.flags |= GLOBAL_FLAG_LINK_SHARING;
+            else
+                fprintf(stderr, "Warning: link_sharing needs total_rate_limit; "
+                        "using per-class token buckets\n");
+        }
+        
+        if (json_object_object_get_ex(obj, "heavy_hitter_threshold", &tmp))
+            gcfg.hh_threshold = json_object_get_int(tmp);
+        
+        if (json_object_object_get_ex(obj, "wire_overhead", &tmp))
+            gcfg.wire_overhead = json_object_get_int(tmp);
+    }
+    
+    /* Behavioral classification is enabled by its packet count */
+    if (json_object_object_get_ex(root, "behavior", &obj)) {
+        struct json_object *tmp;
+        
+        if (json_object_object_get_ex(obj, "min_packets", &tmp))
+            gcfg.behav_min_packets = json_object_get_int(tmp);
+    }
+    
+    /* DSCP marks from upstream: trusted over tuple rules, or a fallback */
+    if (json_object_object_get_ex(root, "dscp", &obj)) {
+        struct json_object *tmp;
+        int mapped = 0;
+        
+        if (json_object_object_get_ex(obj, "map", &tmp))
+            mapped = load_dscp_table(tmp);
+        
+        if (mapped < 0) {
+            json_object_put(root);
+            return -1;
+        }
+        
+        if (mapped > 0) {
+            gcfg.flags |= GLOBAL_FLAG_DSCP;
+            if (json_object_object_get_ex(obj, "precedence", &tmp) &&
+                strcmp(json_object_get_string(tmp), "dscp") == 0)
+                gcfg.flags |= GLOBAL_FLAG_DSCP_FIRST;
+        }
+        printf("Mapped %d DSCP codepoints (%s first)\n", mapped,
+               gcfg.flags & GLOBAL_FLAG_DSCP_FIRST ? "DSCP" : "rules");
+    }
+    
+    /* Host egress mode: classify local sockets by mark, cgroup, priority */
+    if (json_object_object_get_ex(root, "egress", &obj)) {
+        __u32 kinds = load_egress_classes(obj);
+        
+        gcfg.flags |= kinds;
+        if (kinds)
+            printf("Egress classification by%s%s%s\n",
+                   kinds & GLOBAL_FLAG_EGRESS_MARK ? " mark" : "",
+                   kinds & GLOBAL_FLAG_EGRESS_CGROUP ? " cgroup" : "",
+                   kinds & GLOBAL_FLAG_EGRESS_PRIO ? " priority" : "");
+    }
+    
+    /* Subscribers are policed only once their contracts are in place */
+    if (json_object_object_get_ex(root, "subscribers", &obj)) {
+        int n_subs = load_subscribers(obj);
+        
+        if (n_subs < 0) {
+            json_object_put(root);
+            return -1;
+        }
+        
+        if (n_subs > 0)
+            gcfg.flags |= GLOBAL_FLAG_SUBSCRIBERS;
+        printf("Configured %d subscribers\n", n_subs);
+    }
+    
+    /* The hierarchy must exist before the TC program steers into it */
+    if (json_object_object_get_ex(root, "qdisc", &obj)) {
+        int n_txq;
+        
+        if (!json_object_object_get_ex(root, "classes", &classes))
+            classes = NULL;
+        
+        n_txq = setup_qdisc_hierarchy(obj, classes, &gcfg);
+        if (n_txq < 0) {
+            json_object_put(root);
+            return -1;
+        }
+        gcfg.tx_queues = n_txq;
+    }
+    
+    /* Update global config map */
+    err = update_config_elem(ctx.global_config_fd, ctx.tc_global_config_fd,
+                             &key, &gcfg);
+    if (err) {
+        fprintf(stderr, "Error updating global config: %s\n", strerror(errno));
+        json_object_put(root);
+        return -1;
+    }
+    
+    /* Parse traffic classes */
+    if (json_object_object_get_ex(root, "classes", &classes)) {
+        int n_classes = json_object_array_length(classes);
+        __u32 parents[MAX_CLASSES] = {0};
+        __u64 total_min = 0;
+        
+        for (int i = 0; i < n_classes; i++) {
+            struct json_object *cls = json_object_array_get_idx(classes, i);
+            struct class_config cfg = {0};
+            struct json_object *tmp;
+            
+            if (json_object_object_get_ex(cls, "id", &tmp))
+                cfg.id = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "rate_limit", &tmp))
+                cfg.rate_limit = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "burst_size", &tmp))
+                cfg.burst_size = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "priority", &tmp))
+                cfg.priority = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "weight", &tmp))
+                cfg.weight = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "min_bandwidth", &tmp))
+                cfg.min_bandwidth = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "max_bandwidth", &tmp))
+                cfg.max_bandwidth = json_object_get_int(tmp);
+            
+            /* Link-sharing parent; stored as id + 1 so 0 means the root */
+            if (json_object_object_get_ex(cls, "parent", &tmp)) {
+                int parent = json_object_get_int(tmp);
+                
+                if (parent >= 0 && parent < MAX_CLASSES && (__u32)parent != cfg.id)
+                    cfg.parent = parent + 1;
+                else
+                    fprintf(stderr, "Warning: class %u: invalid parent %d, "
+                            "using root\n", cfg.id, parent);
+            }
+            
+            if (json_object_object_get_ex(cls, "aqm", &tmp)) {
+                const char *aqm = json_object_get_string(tmp);
+                if (strcmp(aqm, "codel") == 0)
+                    cfg.aqm = AQM_CODEL;
+                else if (strcmp(aqm, "pie") == 0)
+                    cfg.aqm = AQM_PIE;
+                else if (strcmp(aqm, "dualpi2") == 0)
+                    cfg.aqm = AQM_DUALPI2;
+                else if (strcmp(aqm, "none") != 0)
+                    fprintf(stderr, "Warning: class %u: unknown aqm '%s'\n",
+                            cfg.id, aqm);
+            }
+            
+            if (json_object_object_get_ex(cls, "aqm_target_us", &tmp))
+                cfg.aqm_target_us = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "aqm_interval_us", &tmp))
+                cfg.aqm_interval_us = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "aqm_step_us", &tmp))
+                cfg.aqm_step_us = json_object_get_int(tmp);
+            
+            /* Three-color meter: CIR/CBS are rate_limit/burst_size */
+            if (json_object_object_get_ex(cls, "meter", &tmp)) {
+                const char *meter = json_object_get_string(tmp);
+                if (strcmp(meter, "srtcm") == 0)
+                    cfg.meter = METER_SRTCM;
+                else if (strcmp(meter, "trtcm") == 0)
+                    cfg.meter = METER_TRTCM;
+                else if (strcmp(meter, "none") != 0)
+                    fprintf(stderr, "Warning: class %u: unknown meter '%s'\n",
+                            cfg.id, meter);
+            }
+            
+            if (json_object_object_get_ex(cls, "peak_rate", &tmp))
+                cfg.peak_rate = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "excess_burst", &tmp))
+                cfg.excess_burst = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "yellow_dscp", &tmp)) {
+                int dscp = parse_dscp(tmp);
+                
+                if (dscp >= 0) {
+                    cfg.yellow_dscp = dscp;
+                    cfg.flags |= CLASS_FLAG_YELLOW_DSCP;
+                } else {
+                    fprintf(stderr, "Warning: class %u: invalid yellow_dscp\n",
+                            cfg.id);
+                }
+            }
+            
+            if (json_object_object_get_ex(cls, "yellow_class", &tmp))
+                cfg.yellow_class = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "pacing_rate", &tmp))
+                cfg.pacing_rate = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(cls, "egress_dscp", &tmp)) {
+                int dscp = parse_dscp(tmp);
+                
+                if (dscp >= 0) {
+                    cfg.egress_dscp = dscp;
+                    cfg.flags |= CLASS_FLAG_REWRITE_DSCP;
+                } else {
+                    fprintf(stderr, "Warning: class %u: invalid egress_dscp\n",
+                            cfg.id);
+                }
+            }
+            
+            if (json_object_object_get_ex(cls, "red_action", &tmp) &&
+                strcmp(json_object_get_string(tmp), "ecn") == 0)
+                cfg.flags |= CLASS_FLAG_RED_ECN;
+            
+            if (cfg.meter != METER_NONE) {
+                if (!cfg.rate_limit || !cfg.burst_size)
+                    fprintf(stderr, "Warning: class %u: meter needs rate_limit "
+                            "and burst_size\n", cfg.id);
+                
+                /* Unset peak/excess parameters default to the committed ones */
+                if (cfg.meter == METER_TRTCM && cfg.peak_rate < cfg.rate_limit)
+                    cfg.peak_rate = cfg.max_bandwidth > cfg.rate_limit ?
+                                    cfg.max_bandwidth : cfg.rate_limit;
+                if (!cfg.excess_burst)
+                    cfg.excess_burst = cfg.burst_size;
+                
+                if (cfg.yellow_class >= MAX_CLASSES ||
+                    cfg.yellow_class == cfg.id) {
+                    fprintf(stderr, "Warning: class %u: invalid yellow_class\n",
+                            cfg.id);
+                    cfg.yellow_class = 0;
+                }
+            }
+            
+            /* ECN marking defaults to on for AQM-managed classes */
+            if (json_object_object_get_ex(cls, "ecn", &tmp) ?
+                json_object_get_boolean(tmp) : cfg.aqm != AQM_NONE)
+                cfg.flags |= CLASS_FLAG_ECN;
+            
+            if (cfg.id < MAX_CLASSES)
+                parents[cfg.id] = cfg.parent;
+            if (!cfg.parent)
+                total_min += cfg.min_bandwidth;
+            
+            /* Update class config map */
+            err = update_config_elem(ctx.class_config_fd, ctx.tc_class_config_fd,
+                                     &cfg.id, &cfg);
+            if (err) {
+                fprintf(stderr, "Error updating class %u config: %s\n",
+                        cfg.id, strerror(errno));
+            }
+            
+            /* Initialize token bucket for this class */
+            if (cfg.rate_limit > 0) {
+                struct token_bucket tb = {
+                    .tokens = cfg.burst_size,
+                    .rate = cfg.rate_limit,
+                    .capacity = cfg.burst_size,
+                    .last_update = 0,
+                };
+                
+                err = bpf_map_update_elem(ctx.token_buckets_fd, &cfg.id, &tb, BPF_ANY);
+                if (err) {
+                    fprintf(stderr, "Error initializing token bucket for class %u: %s\n",
+                            cfg.id, strerror(errno));
+                }
+            }
+        }
+        
+        /* The data path cuts deeper (or cyclic) chains short at the root */
+        for (int i = 0; i < MAX_CLASSES; i++) {
+            __u32 id = i;
+            int depth = 0;
+            
+            while (parents[id] && depth <= HTB_MAX_DEPTH) {
+                id = parents[id] - 1;
+                depth++;
+            }
+            
+            if (depth >= HTB_MAX_DEPTH)
+                fprintf(stderr, "Warning: class %d: link-sharing chain deeper "
+                        "than %d levels\n", i, HTB_MAX_DEPTH);
+        }
+        
+        if ((gcfg.flags & GLOBAL_FLAG_LINK_SHARING) &&
+            total_min > gcfg.total_rate_limit)
+            fprintf(stderr, "Warning: min_bandwidth of top-level classes "
+                    "(%llu) exceeds total_rate_limit (%u); guarantees "
+                    "cannot all be met\n", total_min, gcfg.total_rate_limit);
+        
+        printf("Configured %d traffic classes\n", n_classes);
+    }
+    
+    /* Parse classification rules */
+    if (json_object_object_get_ex(root, "rules", &rules)) {
+        ctx.n_rules = policy_parse_rules(rules, ctx.rules);
+        if (install_rule_bank(0) == 0)
+            printf("Configured %d classification rules%s\n", ctx.n_rules,
+                   ctx.compiled_policy ? " (compiled into the XDP program)" : "");
+    }
+    
+    /* Parse behavioral decision table */
+    if (json_object_object_get_ex(root, "behavior", &obj) &&
+        json_object_object_get_ex(obj, "rules", &rules)) {
+        int n_rules = json_object_array_length(rules);
+        
+        if (n_rules > MAX_BEHAVIOR_RULES) {
+            fprintf(stderr, "Warning: only the first %d behavior rules are used\n",
+                    MAX_BEHAVIOR_RULES);
+            n_rules = MAX_BEHAVIOR_RULES;
+        }
+        
+        for (int i = 0; i < n_rules; i++) {
+            struct json_object *rule_obj = json_object_array_get_idx(rules, i);
+            struct behavior_rule rule = { .enabled = 1 };
+            struct json_object *tmp;
+            __u32 rule_key = i;
+            
+            if (json_object_object_get_ex(rule_obj, "protocol", &tmp)) {
+                const char *proto = json_object_get_string(tmp);
+                if (strcmp(proto, "tcp") == 0)
+                    rule.protocol = IPPROTO_TCP;
+                else if (strcmp(proto, "udp") == 0)
+                    rule.protocol = IPPROTO_UDP;
+            }
+            
+            if (json_object_object_get_ex(rule_obj, "size_min", &tmp))
+                rule.size_min = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "size_max", &tmp))
+                rule.size_max = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "iat_min_us", &tmp))
+                rule.iat_min_us = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "iat_max_us", &tmp))
+                rule.iat_max_us = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "jitter_max_us", &tmp))
+                rule.jitter_max_us = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "burst_max", &tmp))
+                rule.burst_max = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "dir_min_pct", &tmp))
+                rule.dir_min_pct = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "dir_max_pct", &tmp))
+                rule.dir_max_pct = json_object_get_int(tmp);
+            
+            if (json_object_object_get_ex(rule_obj, "class_id", &tmp))
+                rule.class_id = json_object_get_int(tmp);
+            
+            /* Class 0 means "not promoted" in the flow state */
+            if (!rule.class_id || rule.class_id >= MAX_CLASSES) {
+                fprintf(stderr, "Warning: behavior rule %d: invalid class_id\n", i);
+                rule.enabled = 0;
+            }
+            
+            err = bpf_map_update_elem(ctx.behavior_rules_fd, &rule_key, &rule, BPF_ANY);
+            if (err) {
+                fprintf(stderr, "Error updating behavior rule %d: %s\n", i,
+                        strerror(errno));
+            }
+        }
+        
+        printf("Configured %d behavior rules (judged after %u packets)\n",
+               n_rules, gcfg.behav_min_packets);
+    }
+    
+    json_object_put(root);
+    printf("Configuration loaded successfully\n");
+    return 0;
+}
+
+/*
+ * Warm restart: scheduling state that would otherwise start cold after a
+ * restart is written to a binary file on shutdown and reloaded after the
+ * configuration. The file is a header followed by one section per map,
+ * each holding its keys and then its values exactly as the batch map
+ * operations produce and consume them. Local sockets keep their DRR
+ * deficit and WFQ tag in sock_state (socket storage), which cannot be
+ * dumped this way; their state starts cold after a restart.
+ */
+#define SNAPSHOT_MAGIC 0x504e5351   /* "QSNP" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_KEY 64
+
+struct snapshot_header {
+    __u32 magic;
+    __u32 version;
+    __u64 mono_ns;          /* CLOCK_MONOTONIC (bpf_ktime_get_ns) at dump */
+    char boot_id[40];       /* Timestamps only carry over within one boot */
+    __u32 sections;
+    __u32 pad;
+};
+
+struct snapshot_section {
+    char name[16];          /* Map name */
+    __u32 key_size;
+    __u32 value_size;
+    __u32 count;
+    __u32 pad;
+};
+
+/* Maps saved across restarts; TC ones are opened from their pins */
+static const char *snapshot_maps[] = {
+    "flow_table", "flow_acct", "token_buckets", "drr_deficit", "wfq_vtime",
+};
+
+/* Entries saved from map name, out of counts[] in snapshot_maps order */
+static __u32 snapshot_count(const __u32 *counts, const char *name)
+{
+    size_t n = sizeof(snapshot_maps) / sizeof(snapshot_maps[0]);
+    
+    for (size_t i = 0; i < n; i++) {
+        if (!strcmp(snapshot_maps[i], name))
+            return counts[i];
+    }
+    return 0;
+}
+
+static int snapshot_map_fd(const char *name)
+{
+    char path[128];
+    
+    if (!strcmp(name, "flow_table"))
+        return dup(ctx.flow_table_fd);
+    if (!strcmp(name, "flow_acct"))
+        return ctx.flow_acct_fd < 0 ? -1 : dup(ctx.flow_acct_fd);
+    if (!strcmp(name, "token_buckets"))
+        return dup(ctx.token_buckets_fd);
+    
+    snprintf(path, sizeof(path), "%s/%s", TC_PIN_DIR, name);
+    return bpf_obj_get(path);
+}
+
+static __u64 monotonic_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_boot_id(char *buf, size_t len)
+{
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    
+    memset(buf, 0, len);
+    if (!f)
+        return;
+    if (fgets(buf, len, f))
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(f);
+}
+
+/*
+ * Read every entry of a map into keys/values. Batch lookups take one
+ * syscall per few thousand entries; kernels without batch support for the
+ * map type fall back to walking it with get_next_key.
+ */
+static int dump_map_entries(int fd, const struct bpf_map_info *info,
+                            char *keys, char *values, __u32 *total)
+{
+    char in_batch[SNAPSHOT_MAX_KEY], out_batch[SNAPSHOT_MAX_KEY];
+    __u32 ks = info->key_size, vs = info->value_size;
+    __u32 count;
+    void *prev = NULL;
+    int err;
+    
+    *total = 0;
+    while (*total < info->max_entries) {
+        count = info->max_entries - *total;
+        err = bpf_map_lookup_batch(fd, *total ? in_batch : NULL, out_batch,
+                                   keys + (size_t)*total * ks,
+                                   values + (size_t)*total * vs, &count, NULL);
+        if (err && errno != ENOENT)
+            goto slow;
+        *total += count;
+        if (err)
+            return 0;  /* ENOENT: no more entries */
+        memcpy(in_batch, out_batch, sizeof(in_batch));
+    }
+    return 0;
+    
+slow:
+    if (errno != EINVAL && errno != EOPNOTSUPP && errno != 524 /* ENOTSUPP */)
+        return -errno;
+    
+    *total = 0;
+    while (*total < info->max_entries &&
+           !bpf_map_get_next_key(fd, prev, keys + (size_t)*total * ks)) {
+        prev = keys + (size_t)*total * ks;
+        if (!bpf_map_lookup_elem(fd, prev, values + (size_t)*total * vs))
+            (*total)++;
+    }
+    return 0;
+}
+
+static int dump_map(FILE *f, const char *name, __u32 *count)
+{
+    struct snapshot_section sec = {};
+    struct bpf_map_info info = {};
+    __u32 info_len = sizeof(info);
+    char *keys = NULL, *values = NULL;
+    int fd, err;
+    
+    *count = 0;
+    fd = snapshot_map_fd(name);
+    if (fd < 0)
+        return 0;  /* TC not loaded */
+    
+    err = bpf_obj_get_info_by_fd(fd, &info, &info_len);
+    if (err || info.key_size > SNAPSHOT_MAX_KEY) {
+        err = -EINVAL;
+        goto out;
+    }
+    
+    keys = malloc((size_t)info.max_entries * info.key_size);
+    values = malloc((size_t)info.max_entries * info.value_size);
+    if (!keys || !values) {
+        err = -ENOMEM;
+        goto out;
+    }
+    
+    err = dump_map_entries(fd, &info, keys, values, &sec.count);
+    if (err)
+        goto out;
+    
+    snprintf(sec.name, sizeof(sec.name), "%s", name);
+    sec.key_size = info.key_size;
+    sec.value_size = info.value_size;
+    
+    if (fwrite(&sec, sizeof(sec), 1, f) != 1 ||
+        fwrite(keys, info.key_size, sec.count, f) != sec.count ||
+        fwrite(values, info.value_size, sec.count, f) != sec.count)
+        err = -EIO;
+    *count = sec.count;
+    
+out:
+    free(keys);
+    free(values);
+    close(fd);
+    return err;
+}
+
+/* Write the snapshot to a temporary file and rename it into place */
+int save_state_snapshot(const char *path)
+{
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+    };
+    __u32 counts[sizeof(snapshot_maps) / sizeof(snapshot_maps[0])];
+    char tmp[PATH_MAX];
+    __u64 start = monotonic_ns();
+    FILE *f;
+    int err = 0;
+    
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    
+    hdr.mono_ns = monotonic_ns();
+    read_boot_id(hdr.boot_id, sizeof(hdr.boot_id));
+    hdr.sections = sizeof(snapshot_maps) / sizeof(snapshot_maps[0]);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    
+    for (__u32 i = 0; i < hdr.sections && !err; i++) {
+        err = dump_map(f, snapshot_maps[i], &counts[i]);
+        if (err)
+            fprintf(stderr, "Error: saving %s: %s\n", snapshot_maps[i],
+                    strerror(-err));
+    }
+    
+    if (fclose(f) || err || rename(tmp, path)) {
+        fprintf(stderr, "Error: state snapshot not saved\n");
+        unlink(tmp);
+        return -1;
+    }
+    
+    printf("Saved state to %s in %.1f ms (%u flows, %u DRR deficits)\n",
+           path, (monotonic_ns() - start) / 1e6,
+           snapshot_count(counts, "flow_table"),
+           snapshot_count(counts, "drr_deficit"));
+    return 0;
+}
+
+/*
+ * Adjust restored entries before they are written back. Timestamps are
+ * shifted when the snapshot comes from an earlier boot, so flows keep the
+ * age they had at shutdown. Token buckets keep the rate and capacity of
+ * the configuration just loaded and only take their fill level from the
+ * snapshot.
+ */
+static void restore_fixup(const struct snapshot_section *sec, int fd,
+                          const char *keys, char *values, __u64 shift)
+{
+    if (!strcmp(sec->name, "flow_table")) {
+        struct flow_state *st = (struct flow_state *)values;
+        
+        for (__u32 i = 0; i < sec->count; i++) {
+            if (st[i].last_seen)
+                st[i].last_seen += shift;
+        }
+    } else if (!strcmp(sec->name, "flow_acct")) {
+        struct flow_acct *acct = (struct flow_acct *)values;
+        
+        for (__u32 i = 0; i < sec->count; i++) {
+            if (acct[i].first_seen)
+                acct[i].first_seen += shift;
+            if (acct[i].last_export)
+                acct[i].last_export += shift;
+        }
+    } else if (!strcmp(sec->name, "token_buckets")) {
+        struct token_bucket *tb = (struct token_bucket *)values;
+        const __u32 *ids = (const __u32 *)keys;
+        struct token_bucket live;
+        
+        for (__u32 i = 0; i < sec->count; i++) {
+            if (bpf_map_lookup_elem(fd, &ids[i], &live) || !live.rate) {
+                tb[i] = live;  /* Not rate limited any more */
+                continue;
+            }
+            
+            live.tokens = tb[i].tokens < live.capacity ? tb[i].tokens
+                                                       : live.capacity;
+            if (tb[i].last_update)
+                live.last_update = tb[i].last_update + shift;
+            tb[i] = live;
+        }
+    }
+}
+
+static int restore_map(const struct snapshot_section *sec, const char *keys,
+                       char *values, __u64 shift)
+{
+    struct bpf_map_info info = {};
+    __u32 info_len = sizeof(info);
+    __u32 count = sec->count;
+    int fd, err = 0;
+    
+    fd = snapshot_map_fd(sec->name);
+    if (fd < 0)
+        return 0;
+    
+    /* A changed layout after an upgrade: that state starts cold */
+    if (bpf_obj_get_info_by_fd(fd, &info, &info_len) ||
+        info.key_size != sec->key_size || info.value_size != sec->value_size) {
+        fprintf(stderr, "Warning: %s layout changed, not restored\n",
+                sec->name);
+        close(fd);
+        return 0;
+    }
+    
+    restore_fixup(sec, fd, keys, values, shift);
+    
+    if (bpf_map_update_batch(fd, keys, values, &count, NULL)) {
+        for (count = 0; count < sec->count && !err; count++) {
+            err = bpf_map_update_elem(fd, keys + (size_t)count * sec->key_size,
+                                      values + (size_t)count * sec->value_size,
+                                      BPF_ANY);
+        }
+        if (err) {
+            fprintf(stderr, "Warning: %s: restored %u of %u entries: %s\n",
+                    sec->name, count - 1, sec->count, strerror(errno));
+            err = 0;
+        }
+    }
+    
+    close(fd);
+    return err;
+}
+
+/* Reload a snapshot written by save_state_snapshot(), if there is one */
+int restore_state_snapshot(const char *path)
+{
+    struct snapshot_header hdr;
+    struct snapshot_section sec;
+    char boot_id[sizeof(hdr.boot_id)];
+    char *keys = NULL, *values = NULL;
+    __u64 start = monotonic_ns();
+    __u32 flows = 0;
+    __u64 shift = 0;
+    FILE *f;
+    int err = 0;
+    
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Warning: cannot read %s: %s\n", path,
+                    strerror(errno));
+        return 0;
+    }
+    
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != SNAPSHOT_MAGIC ||
+        hdr.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Warning: %s is not a state snapshot, ignored\n", path);
+        fclose(f);
+        return 0;
+    }
+    
+    read_boot_id(boot_id, sizeof(boot_id));
+    if (strncmp(boot_id, hdr.boot_id, sizeof(boot_id)))
+        shift = start - hdr.mono_ns;  /* Wraps to a subtraction if negative */
+    
+    for (__u32 i = 0; i < hdr.sections && !err; i++) {
+        if (fread(&sec, sizeof(sec), 1, f) != 1) {
+            err = -EIO;
+            break;
+        }
+        sec.name[sizeof(sec.name) - 1] = '\0';
+        
+        keys = realloc(keys, (size_t)sec.count * sec.key_size + 1);
+        values = realloc(values, (size_t)sec.count * sec.value_size + 1);
+        if (!keys || !values) {
+            err = -ENOMEM;
+            break;
+        }
+        
+        if (fread(keys, sec.key_size, sec.count, f) != sec.count ||
+            fread(values, sec.value_size, sec.count, f) != sec.count) {
+            err = -EIO;
+            break;
+        }
+        
+        if (!sec.count)
+            continue;
+        err = restore_map(&sec, keys, values, shift);
+        if (!strcmp(sec.name, "flow_table"))
+            flows = sec.count;
+    }
+    
+    free(keys);
+    free(values);
+    fclose(f);
+    
+    if (err) {
+        fprintf(stderr, "Warning: %s truncated, state partly restored\n", path);
+        return -1;
+    }
+    
+    printf("Restored state from %s in %.1f ms (%u flows)\n",
+           path, (monotonic_ns() - start) / 1e6, flows);
+    return 0;
+}
+
+/* Per-stage profile of the XDP hot path, summed over CPUs */
+static int read_profile(struct prof_stats *total)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    struct prof_stats *percpu;
+    __u32 key = 0;
+    
+    if (ncpus <= 0)
+        return -1;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    if (!percpu)
+        return -1;
+    
+    if (bpf_map_lookup_elem(ctx.prof_stats_fd, &key, percpu)) {
+        free(percpu);
+        return -1;
+    }
+    
+    memset(total, 0, sizeof(*total));
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        for (int i = 0; i < PROF_STAGE_MAX; i++) {
+            total->samples[i] += percpu[cpu].samples[i];
+            total->total_ns[i] += percpu[cpu].total_ns[i];
+        }
+    }
+    free(percpu);
+    return 0;
+}
+
+/* Print per-stage profile of the XDP hot path (summed over CPUs) */
+void print_profile(void)
+{
+    struct prof_stats total;
+    __u64 total_ns = 0;
+    
+    if (read_profile(&total)) {
+        fprintf(stderr, "Error reading profile stats: %s\n", strerror(errno));
+        return;
+    }
+    
+    for (int i = 0; i < PROF_STAGE_MAX; i++) {
+        if (total.samples[i])
+            total_ns += total.total_ns[i] / total.samples[i];
+    }
+    
+    printf("\n===== Per-Stage Profile (1 in %u packets) =====\n",
+           ctx.prof_sample_rate);
+    for (int i = 0; i < PROF_STAGE_MAX; i++) {
+        __u64 avg = total.samples[i] ? total.total_ns[i] / total.samples[i] : 0;
+        
+        printf("  %-11s %10llu samples  %6llu ns/pkt  %5.1f%%\n",
+               prof_stage_names[i], total.samples[i], avg,
+               total_ns ? 100.0 * avg / total_ns : 0.0);
+    }
+    printf("  Note: each stage includes one bpf_ktime_get_ns() call\n");
+}
+
+static int hh_entry_cmp(const void *a, const void *b)
+{
+    const struct hh_entry *ea = a, *eb = b;
+    
+    return ea->bytes < eb->bytes ? 1 : ea->bytes > eb->bytes ? -1 : 0;
+}
+
+/*
+ * Print the heavy-hitter top-k. Candidates from all CPUs are summed per
+ * flow and window; each flow is then ranked by its larger estimate of the
+ * last complete and the current window.
+ */
+void print_heavy_hitters(void)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    struct hh_topk *percpu;
+    struct hh_entry *merged;
+    struct timespec ts;
+    __u32 key = 0, window;
+    int n = 0, shown = 0;
+    
+    if (ncpus <= 0)
+        return;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    merged = calloc((size_t)ncpus * HH_TOPK, sizeof(*merged));
+    if (!percpu || !merged)
+        goto out;
+    
+    if (bpf_map_lookup_elem(ctx.hh_topk_fd, &key, percpu)) {
+        fprintf(stderr, "Error reading heavy hitters: %s\n", strerror(errno));
+        goto out;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    window = ((__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec) / HH_WINDOW_NS;
+    
+    /* Sum per (flow, window) across CPUs */
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        for (int i = 0; i < HH_TOPK; i++) {
+            struct hh_entry *e = &percpu[cpu].entries[i];
+            int j;
+            
+            if (!e->bytes || window - e->window > 1)
+                continue;
+            
+            for (j = 0; j < n; j++) {
+                if (merged[j].window == e->window &&
+                    memcmp(&merged[j].flow, &e->flow, sizeof(e->flow)) == 0)
+                    break;
+            }
+            if (j == n)
+                merged[n++] = *e;
+            else
+                merged[j].bytes += e->bytes;
+        }
+    }
+    
+    /* Keep one entry per flow: the larger of its two windows */
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            if (memcmp(&merged[i].flow, &merged[j].flow,
+                       sizeof(merged[i].flow)) != 0)
+                continue;
+            if (merged[j].bytes > merged[i].bytes)
+                merged[i].bytes = merged[j].bytes;
+            merged[j--] = merged[--n];
+        }
+    }
+    
+    qsort(merged, n, sizeof(*merged), hh_entry_cmp);
+    
+    printf("\n===== Heavy Hitters (top %d) =====\n", HH_TOPK);
+    for (int i = 0; i < n && shown < HH_TOPK; i++, shown++) {
+        char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+        struct flow_tuple *f = &merged[i].flow;
+        
+        inet_ntop(AF_INET, &f->src_ip, src, sizeof(src));
+        inet_ntop(AF_INET, &f->dst_ip, dst, sizeof(dst));
+        printf("  %15s:%-5u -> %15s:%-5u proto %-3u %10.2f Mbps\n",
+               src, f->src_port, dst, f->dst_port, f->protocol,
+               merged[i].bytes * 8.0 * (1000000000.0 / HH_WINDOW_NS) / 1e6);
+    }
+    if (!shown)
+        printf("  (none)\n");
+    
+out:
+    free(percpu);
+    free(merged);
+}
+
+/*
+ * Print per-RX-queue load (summed over CPUs). A queue's CPUs are those that
+ * handled any of its packets; more than one means its IRQ moved or RPS is
+ * spreading it. The busiest queue is compared with the mean of all queues.
+ */
+void print_rxq_stats(void)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    int n_rxq = count_queues(ctx.ifname, "rx-");
+    struct rxq_stats *percpu;
+    __u64 total = 0, busiest = 0;
+    
+    if (ncpus <= 0)
+        return;
+    if (n_rxq <= 0 || n_rxq > MAX_RX_QUEUES)
+        n_rxq = MAX_RX_QUEUES;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    if (!percpu)
+        return;
+    
+    printf("\n===== RX Queue Statistics =====\n");
+    printf("  %-5s %12s %14s %10s %10s %5s\n",
+           "Queue", "Packets", "Bytes", "Dropped", "Misplaced", "CPUs");
+    
+    for (int q = 0; q < n_rxq; q++) {
+        struct rxq_stats sum = {0};
+        __u32 key = q;
+        int cpus_seen = 0;
+        
+        if (bpf_map_lookup_elem(ctx.rxq_stats_fd, &key, percpu))
+            continue;
+        
+        for (int cpu = 0; cpu < ncpus; cpu++) {
+            sum.packets += percpu[cpu].packets;
+            sum.bytes += percpu[cpu].bytes;
+            sum.dropped += percpu[cpu].dropped;
+            sum.misplaced += percpu[cpu].misplaced;
+            cpus_seen += percpu[cpu].packets > 0;
+        }
+        
+        total += sum.packets;
+        if (sum.packets > busiest)
+            busiest = sum.packets;
+        if (!sum.packets)
+            continue;
+        
+        printf("  %-5d %12llu %14llu %10llu %10llu %5d\n", q, sum.packets,
+               sum.bytes, sum.dropped, sum.misplaced, cpus_seen);
+    }
+    free(percpu);
+    
+    if (total)
+        printf("  Busiest queue: %.2fx the mean of %d queues\n",
+               (double)busiest * n_rxq / total, n_rxq);
+}
+
+/* XDP counters summed over CPUs; every field is a __u64 counter */
+static int read_cpu_stats(struct cpu_stats *sum)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    struct cpu_stats *percpu;
+    __u64 *dst = (__u64 *)sum;
+    __u32 key = 0;
+    
+    if (ncpus <= 0)
+        return -1;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    if (!percpu)
+        return -1;
+    
+    if (bpf_map_lookup_elem(ctx.cpu_stats_fd, &key, percpu)) {
+        free(percpu);
+        return -1;
+    }
+    
+    memset(sum, 0, sizeof(*sum));
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        const __u64 *src = (const __u64 *)&percpu[cpu];
+        
+        for (size_t i = 0; i < sizeof(*sum) / sizeof(__u64); i++)
+            dst[i] += src[i];
+    }
+    
+    free(percpu);
+    return 0;
+}
+
+/* Print statistics */
+void print_statistics(void)
+{
+    struct cpu_stats stats;
+    struct queue_stats qstats;
+    __u32 key = 0;
+    int err;
+    
+    /* Get CPU statistics */
+    err = read_cpu_stats(&stats);
+    if (err) {
+        fprintf(stderr, "Error reading CPU stats: %s\n", strerror(errno));
+        return;
+    }
+    
+    printf("\n===== Statistics =====\n");
     printf("Total packets:      %llu\n", stats.total_packets);
     printf("Total bytes:        %llu\n", stats.total_bytes);
     printf("Classified packets: %llu\n", stats.classified_packets);
@@ -558,33 +2609,1019 @@ void print_statistics(void)
     printf("XDP_DROP:           %llu\n", stats.xdp_drop);
     printf("XDP_TX:             %llu\n", stats.xdp_tx);
     printf("XDP_REDIRECT:       %llu\n", stats.xdp_redirect);
+    printf("HH demoted:         %llu\n", stats.hh_demoted);
+    printf("Subscriber drops:   %llu\n", stats.sub_dropped);
+    if (ctx.tunnel_decap)
+        printf("Tunnel packets:     %llu\n", stats.tunnel_packets);
+    if (ctx.flow_export_target && stats.flow_records_lost)
+        printf("Flow records lost:  %llu (ring full)\n", stats.flow_records_lost);
+    if (stats.frag_hits || stats.frag_misses)
+        printf("Fragments:          %llu from cache, %llu unclassified\n",
+               stats.frag_hits, stats.frag_misses);
+    if (stats.classified_packets && !ctx.compiled_policy)
+        printf("Rules per packet:   %.2f\n",
+               (double)stats.rules_checked / stats.classified_packets);
+    if (ctx.hw_metadata_ifindex) {
+        printf("NIC RX hash used:   %llu\n", stats.hw_hash_packets);
+        printf("NIC RX timestamps:  %llu", stats.hw_ts_packets);
+        if (stats.hw_ts_packets)
+            printf(" (avg ring delay %llu ns)",
+                   stats.hw_ts_delay_ns / stats.hw_ts_packets);
+        printf("\n");
+    }
+    
+    /* Print queue statistics per class */
+    printf("\n===== Queue Statistics =====\n");
+    for (int i = 0; i < MAX_CLASSES; i++) {
+        key = i;
+        err = bpf_map_lookup_elem(ctx.queue_stats_fd, &key, &qstats);
+        if (err)
+            continue;
+        
+        if (qstats.enqueued_packets > 0) {
+            printf("\nClass %d:\n", i);
+            printf("  Enqueued: %llu packets, %llu bytes\n",
+                   qstats.enqueued_packets, qstats.enqueued_bytes);
+            printf("  Dequeued: %llu packets, %llu bytes\n",
+                   qstats.dequeued_packets, qstats.dequeued_bytes);
+            printf("  Dropped:  %llu packets, %llu bytes\n",
+                   qstats.dropped_packets, qstats.dropped_bytes);
+            printf("  Queue length: %u (max: %u)\n",
+                   qstats.current_qlen, qstats.max_qlen);
+            if (qstats.borrowed_bytes)
+                printf("  Borrowed: %llu bytes above min_bandwidth\n",
+                       qstats.borrowed_bytes);
+            if (qstats.meter_yellow || qstats.meter_red)
+                printf("  Meter: %llu yellow, %llu red packets\n",
+                       qstats.meter_yellow, qstats.meter_red);
+            
+            if (qstats.dequeued_packets > 0) {
+                __u64 avg_latency = qstats.total_latency_ns / qstats.dequeued_packets;
+                printf("  Avg latency: %llu ns\n", avg_latency);
+            }
+        }
+        
+        /* AQM runs in the TC program, which keeps its own queue_stats */
+        if (ctx.tc_queue_stats_fd >= 0 &&
+            bpf_map_lookup_elem(ctx.tc_queue_stats_fd, &key, &qstats) == 0 &&
+            (qstats.ecn_marked || qstats.aqm_dropped || qstats.l4s_packets)) {
+            printf("\nClass %d AQM:\n", i);
+            printf("  ECN marked:  %llu packets\n", qstats.ecn_marked);
+            printf("  AQM dropped: %llu packets\n", qstats.aqm_dropped);
+            if (qstats.l4s_packets)
+                printf("  L4S queue:   %llu packets, %llu CE marked\n",
+                       qstats.l4s_packets, qstats.l4s_marked);
+        }
+    }
+    
+    print_rule_hits();
+    print_rxq_stats();
+    print_heavy_hitters();
+    if (ctx.prof_sample_rate)
+        print_profile();
+    printf("\n");
+}
+
+/* Start a helper thread; signals stay with the main thread, which owns shutdown */
+static int start_thread(pthread_t *thread, void *(*fn)(void *))
+{
+    sigset_t mask, old;
+    int err;
+    
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    err = pthread_create(thread, NULL, fn, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    return err ? -1 : 0;
+}
+
+/*
+ * OpenMetrics exporter
+ *
+ * A collector thread rebuilds the exposition from the maps every
+ * METRICS_REFRESH_SEC seconds; the server thread only copies out the last
+ * snapshot, so a scrape never walks the maps and any number of scrapers
+ * cost the datapath the same. Per-CPU maps are summed here, which the
+ * Python monitors cannot do through their struct mirrors.
+ */
+#define METRICS_PREFIX "xdp_qos_"
+#define METRICS_REFRESH_SEC 1
+#define METRICS_DEFAULT_ADDR "127.0.0.1"
+#define METRICS_REQUEST_TIMEOUT_MS 2000
+#define METRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+static void metric_family(FILE *f, const char *name, const char *type,
+                          const char *help)
+{
+    fprintf(f, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+    fprintf(f, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+}
+
+static void metric_counter(FILE *f, const char *name, const char *help,
+                           __u64 value)
+{
+    metric_family(f, name, "counter", help);
+    fprintf(f, METRICS_PREFIX "%s_total %llu\n", name, value);
+}
+
+/* One counter family with a "class" label, from an array of per-class values */
+static void metric_class_counter(FILE *f, const char *name, const char *help,
+                                 const __u64 *values, const int *present)
+{
+    metric_family(f, name, "counter", help);
+    for (int i = 0; i < MAX_CLASSES; i++) {
+        if (present[i])
+            fprintf(f, METRICS_PREFIX "%s_total{class=\"%d\"} %llu\n",
+                    name, i, values[i]);
+    }
+}
+
+static void metrics_cpu_stats(FILE *f)
+{
+    struct cpu_stats st;
+    
+    if (read_cpu_stats(&st))
+        return;
+    
+    metric_counter(f, "packets", "Packets seen by the XDP classifier",
+                   st.total_packets);
+    metric_counter(f, "bytes", "Bytes seen by the XDP classifier",
+                   st.total_bytes);
+    metric_counter(f, "classified_packets", "Packets matched by a rule",
+                   st.classified_packets);
+    metric_counter(f, "dropped_packets", "Packets dropped in XDP",
+                   st.dropped_packets);
+    
+    metric_family(f, "xdp_actions", "counter", "XDP verdicts by action");
+    fprintf(f, METRICS_PREFIX "xdp_actions_total{action=\"pass\"} %llu\n",
+            st.xdp_pass);
+    fprintf(f, METRICS_PREFIX "xdp_actions_total{action=\"drop\"} %llu\n",
+            st.xdp_drop);
+    fprintf(f, METRICS_PREFIX "xdp_actions_total{action=\"tx\"} %llu\n",
+            st.xdp_tx);
+    fprintf(f, METRICS_PREFIX "xdp_actions_total{action=\"redirect\"} %llu\n",
+            st.xdp_redirect);
+    
+    metric_counter(f, "hh_demoted", "Heavy-hitter packets demoted",
+                   st.hh_demoted);
+    metric_counter(f, "subscriber_dropped", "Packets dropped by subscriber policers",
+                   st.sub_dropped);
+    if (!ctx.compiled_policy)
+        metric_counter(f, "rules_checked", "Rules evaluated by the classifier",
+                       st.rules_checked);
+    
+    metric_family(f, "fragments", "counter", "Non-first IPv4 fragments");
+    fprintf(f, METRICS_PREFIX "fragments_total{result=\"cached\"} %llu\n",
+            st.frag_hits);
+    fprintf(f, METRICS_PREFIX "fragments_total{result=\"unclassified\"} %llu\n",
+            st.frag_misses);
+    
+    if (ctx.tunnel_decap)
+        metric_counter(f, "tunnel_packets", "Packets classified on inner headers",
+                       st.tunnel_packets);
+    
+    if (ctx.flow_export_target)
+        metric_counter(f, "flow_records_lost",
+                       "Active-timeout flow records dropped on a full ring",
+                       st.flow_records_lost);
+    
+    if (ctx.hw_metadata_ifindex) {
+        metric_counter(f, "nic_rx_hash_packets", "Packets keyed by the NIC RX hash",
+                       st.hw_hash_packets);
+        metric_family(f, "nic_ring_delay_seconds", "summary",
+                      "Time from NIC RX timestamp to XDP");
+        fprintf(f, METRICS_PREFIX "nic_ring_delay_seconds_count %llu\n",
+                st.hw_ts_packets);
+        fprintf(f, METRICS_PREFIX "nic_ring_delay_seconds_sum %.9f\n",
+                st.hw_ts_delay_ns / 1e9);
+    }
+}
+
+/* Policer and enqueue counters (XDP) and AQM counters (TC), per class */
+static void metrics_queue_stats(FILE *f)
+{
+    struct queue_stats xs[MAX_CLASSES] = {0}, ts[MAX_CLASSES] = {0};
+    int have_x[MAX_CLASSES] = {0}, have_t[MAX_CLASSES] = {0};
+    __u64 v[MAX_CLASSES], v2[MAX_CLASSES];
+    int any_t = 0;
+    
+    for (__u32 i = 0; i < MAX_CLASSES; i++) {
+        have_x[i] = bpf_map_lookup_elem(ctx.queue_stats_fd, &i, &xs[i]) == 0;
+        if (ctx.tc_queue_stats_fd >= 0)
+            have_t[i] = bpf_map_lookup_elem(ctx.tc_queue_stats_fd, &i,
+                                            &ts[i]) == 0;
+        any_t |= have_t[i];
+    }
+    
+#define CLASS_FIELD(dst, src, field) \
+    for (int i = 0; i < MAX_CLASSES; i++) (dst)[i] = (src)[i].field
+    
+    CLASS_FIELD(v, xs, enqueued_packets);
+    metric_class_counter(f, "class_enqueued_packets",
+                         "Packets admitted to the class", v, have_x);
+    CLASS_FIELD(v, xs, enqueued_bytes);
+    metric_class_counter(f, "class_enqueued_bytes",
+                         "Bytes admitted to the class", v, have_x);
+    CLASS_FIELD(v, xs, dropped_packets);
+    metric_class_counter(f, "policer_dropped_packets",
+                         "Packets dropped by the class policer", v, have_x);
+    CLASS_FIELD(v, xs, dropped_bytes);
+    metric_class_counter(f, "policer_dropped_bytes",
+                         "Bytes dropped by the class policer", v, have_x);
+    CLASS_FIELD(v, xs, borrowed_bytes);
+    metric_class_counter(f, "class_borrowed_bytes",
+                         "Bytes sent above min_bandwidth", v, have_x);
+    
+    CLASS_FIELD(v, xs, meter_yellow);
+    CLASS_FIELD(v2, xs, meter_red);
+    metric_family(f, "meter_packets", "counter", "Packets colored by the meter");
+    for (int i = 0; i < MAX_CLASSES; i++) {
+        if (!have_x[i])
+            continue;
+        fprintf(f, METRICS_PREFIX "meter_packets_total{class=\"%d\",color=\"yellow\"} %llu\n",
+                i, v[i]);
+        fprintf(f, METRICS_PREFIX "meter_packets_total{class=\"%d\",color=\"red\"} %llu\n",
+                i, v2[i]);
+    }
+    
+    if (!any_t)
+        return;
+    
+    CLASS_FIELD(v, ts, dequeued_packets);
+    metric_class_counter(f, "class_sent_packets",
+                         "Packets passed by the TC scheduler", v, have_t);
+    CLASS_FIELD(v, ts, dequeued_bytes);
+    metric_class_counter(f, "class_sent_bytes",
+                         "Bytes passed by the TC scheduler", v, have_t);
+    CLASS_FIELD(v, ts, ecn_marked);
+    metric_class_counter(f, "aqm_ecn_marked_packets",
+                         "Packets CE-marked by AQM", v, have_t);
+    CLASS_FIELD(v, ts, aqm_dropped);
+    metric_class_counter(f, "aqm_dropped_packets",
+                         "Packets dropped by AQM", v, have_t);
+    CLASS_FIELD(v, ts, l4s_packets);
+    metric_class_counter(f, "l4s_packets",
+                         "Packets in the L4S queue", v, have_t);
+    
+#undef CLASS_FIELD
+}
+
+/* TC sojourn histogram: buckets are summed over CPUs and made cumulative */
+static void metrics_latency(FILE *f)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    struct queue_stats ts;
+    __u64 *percpu;
+    
+    if (ctx.tc_latency_hist_fd < 0 || ncpus <= 0)
+        return;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    if (!percpu)
+        return;
+    
+    metric_family(f, "class_sojourn_seconds", "histogram",
+                  "Queueing delay seen by TC AQM");
+    for (__u32 c = 0; c < MAX_CLASSES; c++) {
+        __u64 cum = 0;
+        
+        if (bpf_map_lookup_elem(ctx.tc_queue_stats_fd, &c, &ts))
+            continue;
+        
+        for (__u32 b = 0; b < LAT_HIST_BUCKETS; b++) {
+            __u32 key = c * LAT_HIST_BUCKETS + b;
+            
+            if (bpf_map_lookup_elem(ctx.tc_latency_hist_fd, &key, percpu) == 0)
+                for (int cpu = 0; cpu < ncpus; cpu++)
+                    cum += percpu[cpu];
+            
+            if (b == LAT_HIST_BUCKETS - 1)
+                fprintf(f, METRICS_PREFIX "class_sojourn_seconds_bucket{class=\"%u\",le=\"+Inf\"} %llu\n",
+                        c, cum);
+            else
+                fprintf(f, METRICS_PREFIX "class_sojourn_seconds_bucket{class=\"%u\",le=\"%.6f\"} %llu\n",
+                        c, (double)(1ULL << b) / 1e6, cum);
+        }
+        fprintf(f, METRICS_PREFIX "class_sojourn_seconds_count{class=\"%u\"} %llu\n",
+                c, cum);
+        fprintf(f, METRICS_PREFIX "class_sojourn_seconds_sum{class=\"%u\"} %.9f\n",
+                c, ts.total_latency_ns / 1e9);
+    }
+    free(percpu);
+}
+
+static void metrics_rules_and_queues(FILE *f)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    int n_rxq = count_queues(ctx.ifname, "rx-");
+    __u64 hits[RULE_BANK_SIZE];
+    struct rxq_stats *percpu;
+    
+    if (ctx.n_rules && read_rule_hits(hits) == 0) {
+        metric_family(f, "rule_matches", "counter",
+                      "Packets matched per classification rule");
+        for (__u32 id = 0; id < ctx.n_rules; id++)
+            fprintf(f, METRICS_PREFIX "rule_matches_total{rule=\"%u\"} %llu\n",
+                    id, hits[id]);
+    }
+    
+    if (ncpus <= 0)
+        return;
+    if (n_rxq <= 0 || n_rxq > MAX_RX_QUEUES)
+        n_rxq = MAX_RX_QUEUES;
+    
+    percpu = calloc(ncpus, sizeof(*percpu));
+    if (!percpu)
+        return;
+    
+    metric_family(f, "rxq_packets", "counter", "Packets per RX queue");
+    for (int q = 0; q < n_rxq; q++) {
+        __u32 key = q;
+        __u64 sum = 0;
+        
+        if (bpf_map_lookup_elem(ctx.rxq_stats_fd, &key, percpu))
+            continue;
+        for (int cpu = 0; cpu < ncpus; cpu++)
+            sum += percpu[cpu].packets;
+        if (sum)
+            fprintf(f, METRICS_PREFIX "rxq_packets_total{queue=\"%d\"} %llu\n",
+                    q, sum);
+    }
+    free(percpu);
+}
+
+static void metrics_profile(FILE *f)
+{
+    struct prof_stats prof;
+    
+    if (!ctx.prof_sample_rate || read_profile(&prof))
+        return;
+    
+    metric_family(f, "stage_seconds", "summary",
+                  "Sampled time spent per XDP stage");
+    for (int i = 0; i < PROF_STAGE_MAX; i++) {
+        fprintf(f, METRICS_PREFIX "stage_seconds_count{stage=\"%s\"} %llu\n",
+                prof_stage_names[i], prof.samples[i]);
+        fprintf(f, METRICS_PREFIX "stage_seconds_sum{stage=\"%s\"} %.9f\n",
+                prof_stage_names[i], prof.total_ns[i] / 1e9);
+    }
+}
+
+static void *metrics_collect(void *arg)
+{
+    (void)arg;
+    
+    while (keep_running) {
+        char *text = NULL, *old;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        
+        if (f) {
+            metrics_cpu_stats(f);
+            metrics_queue_stats(f);
+            metrics_latency(f);
+            metrics_rules_and_queues(f);
+            metrics_profile(f);
+            fprintf(f, "# EOF\n");
+            fclose(f);
+            
+            pthread_mutex_lock(&ctx.metrics_lock);
+            old = ctx.metrics_text;
+            ctx.metrics_text = text;
+            ctx.metrics_len = len;
+            pthread_mutex_unlock(&ctx.metrics_lock);
+            free(old);
+        }
+        
+        sleep(METRICS_REFRESH_SEC);
+    }
+    return NULL;
+}
+
+static void metrics_reply(int fd, const char *status, const char *type,
+                          const char *body, size_t len)
+{
+    char hdr[256];
+    int n;
     
-    /* Print queue statistics per class */
-    printf("\n===== Queue Statistics =====\n");
-    for (int i = 0; i < MAX_CLASSES; i++) {
-        key = i;
-        err = bpf_map_lookup_elem(ctx.queue_stats_fd, &key, &qstats);
-        if (err)
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.1 %s\r\nContent-Type: %s\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                 status, type, len);
+    send(fd, hdr, n, MSG_NOSIGNAL);
+    
+    while (len > 0) {
+        ssize_t sent = send(fd, body, len, MSG_NOSIGNAL);
+        
+        if (sent <= 0)
+            break;
+        body += sent;
+        len -= sent;
+    }
+}
+
+/*
+ * Read until the end of the request line. It can arrive over several
+ * segments; a client gets METRICS_REQUEST_TIMEOUT_MS in all to send it,
+ * however slowly it trickles in. Returns the bytes read, NUL-terminated.
+ */
+static size_t metrics_read_request(int fd, char *buf, size_t size)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    __u64 deadline = monotonic_ns() / 1000000 + METRICS_REQUEST_TIMEOUT_MS;
+    size_t len = 0;
+    
+    while (len < size - 1) {
+        __u64 now = monotonic_ns() / 1000000;
+        ssize_t n;
+        
+        if (now >= deadline || poll(&pfd, 1, deadline - now) <= 0)
+            break;
+        n = recv(fd, buf + len, size - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        if (memchr(buf + len - n, '\n', n))
+            break;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static void metrics_handle(int fd)
+{
+    char req[1024], *body;
+    size_t len;
+    
+    if (metrics_read_request(fd, req, sizeof(req)) == 0)
+        return;
+    
+    if (strncmp(req, "GET /metrics ", 13) != 0 &&
+        strncmp(req, "GET /metrics?", 13) != 0) {
+        metrics_reply(fd, "404 Not Found", "text/plain", "Not Found\n", 10);
+        return;
+    }
+    
+    /* Copy the snapshot so a slow client does not hold up the collector */
+    pthread_mutex_lock(&ctx.metrics_lock);
+    len = ctx.metrics_len;
+    body = ctx.metrics_text ? malloc(len) : NULL;
+    if (body)
+        memcpy(body, ctx.metrics_text, len);
+    pthread_mutex_unlock(&ctx.metrics_lock);
+    
+    if (body)
+        metrics_reply(fd, "200 OK", METRICS_CONTENT_TYPE, body, len);
+    else
+        metrics_reply(fd, "503 Service Unavailable", "text/plain",
+                      "No snapshot yet\n", 16);
+    free(body);
+}
+
+static void *metrics_serve(void *arg)
+{
+    struct pollfd pfd = { .fd = ctx.metrics_fd, .events = POLLIN };
+    
+    (void)arg;
+    
+    while (keep_running) {
+        int fd;
+        
+        if (poll(&pfd, 1, 1000) <= 0)
             continue;
         
-        if (qstats.enqueued_packets > 0) {
-            printf("\nClass %d:\n", i);
-            printf("  Enqueued: %llu packets, %llu bytes\n",
-                   qstats.enqueued_packets, qstats.enqueued_bytes);
-            printf("  Dequeued: %llu packets, %llu bytes\n",
-                   qstats.dequeued_packets, qstats.dequeued_bytes);
-            printf("  Dropped:  %llu packets, %llu bytes\n",
-                   qstats.dropped_packets, qstats.dropped_bytes);
-            printf("  Queue length: %u (max: %u)\n",
-                   qstats.current_qlen, qstats.max_qlen);
-            
-            if (qstats.dequeued_packets > 0) {
-                __u64 avg_latency = qstats.total_latency_ns / qstats.dequeued_packets;
-                printf("  Avg latency: %llu ns\n", avg_latency);
-            }
+        fd = accept(ctx.metrics_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        metrics_handle(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Listen on [ADDR:]PORT and start the collector and server threads */
+int start_metrics_exporter(const char *listen_addr)
+{
+    struct sockaddr_in sa = { .sin_family = AF_INET };
+    const char *port = strrchr(listen_addr, ':');
+    char addr[INET_ADDRSTRLEN] = METRICS_DEFAULT_ADDR;
+    int one = 1;
+    
+    if (port) {
+        size_t n = port - listen_addr;
+        
+        if (n >= sizeof(addr)) {
+            fprintf(stderr, "Invalid metrics address: %s\n", listen_addr);
+            return -1;
+        }
+        if (n) {
+            memcpy(addr, listen_addr, n);
+            addr[n] = '\0';
+        }
+        port++;
+    } else {
+        port = listen_addr;
+    }
+    
+    sa.sin_port = htons(atoi(port));
+    if (!sa.sin_port || inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        fprintf(stderr, "Invalid metrics address: %s\n", listen_addr);
+        return -1;
+    }
+    
+    ctx.metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ctx.metrics_fd < 0) {
+        fprintf(stderr, "Error creating metrics socket: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(ctx.metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    if (bind(ctx.metrics_fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+        listen(ctx.metrics_fd, 16)) {
+        fprintf(stderr, "Error listening on %s:%s: %s\n", addr, port,
+                strerror(errno));
+        close(ctx.metrics_fd);
+        ctx.metrics_fd = -1;
+        return -1;
+    }
+    
+    if (start_thread(&ctx.metrics_collector, metrics_collect)) {
+        close(ctx.metrics_fd);
+        ctx.metrics_fd = -1;
+        return -1;
+    }
+    if (start_thread(&ctx.metrics_server, metrics_serve)) {
+        keep_running = 0;
+        pthread_join(ctx.metrics_collector, NULL);
+        keep_running = 1;
+        close(ctx.metrics_fd);
+        ctx.metrics_fd = -1;
+        return -1;
+    }
+    
+    printf("Serving OpenMetrics on http://%s:%s/metrics\n", addr, port);
+    return 0;
+}
+
+/* Called once keep_running is cleared; both threads exit within a second */
+void stop_metrics_exporter(void)
+{
+    if (ctx.metrics_fd < 0)
+        return;
+    
+    pthread_join(ctx.metrics_server, NULL);
+    pthread_join(ctx.metrics_collector, NULL);
+    close(ctx.metrics_fd);
+    ctx.metrics_fd = -1;
+    
+    free(ctx.metrics_text);
+    ctx.metrics_text = NULL;
+}
+
+/*
+ * Flow record export (IPFIX, RFC 7011)
+ *
+ * Records reach the exporter two ways. The XDP program pushes one through
+ * the flow_records ring each time a flow has been active for
+ * flow_active_timeout seconds. Flows idle for flow_idle_timeout seconds
+ * are found by a sweep that walks flow_table a chunk at a time, so one
+ * pass spreads over half the idle timeout. Each such flow is removed from
+ * flow_table and flow_acct and reported. Records are batched into IPFIX
+ * messages. The messages go to a UDP collector, or are appended to a file,
+ * which is then an IPFIX file (RFC 5655).
+ */
+#define IPFIX_VERSION 10
+#define IPFIX_PORT 4739
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_TEMPLATE_ID 256
+#define IPFIX_HDR_LEN 16
+#define IPFIX_SET_HDR_LEN 4
+#define IPFIX_MSG_MAX 1400              /* One datagram on a 1500-byte path */
+#define IPFIX_TEMPLATE_REFRESH_SEC 60   /* UDP collectors may lose templates */
+
+#define FLOW_EXPORT_POLL_MS 100
+#define FLOW_EXPORT_FLUSH_SEC 1         /* Longest a record waits in a message */
+#define FLOW_SWEEP_MIN_CHUNK 1024
+
+/* Information elements, in record order */
+static const struct {
+    __u16 id;
+    __u16 len;
+} ipfix_fields[] = {
+    { 8, 4 },       /* sourceIPv4Address */
+    { 12, 4 },      /* destinationIPv4Address */
+    { 7, 2 },       /* sourceTransportPort */
+    { 11, 2 },      /* destinationTransportPort */
+    { 4, 1 },       /* protocolIdentifier */
+    { 51, 1 },      /* classId: the scheduler class */
+    { 152, 8 },     /* flowStartMilliseconds */
+    { 153, 8 },     /* flowEndMilliseconds */
+    { 86, 8 },      /* packetTotalCount */
+    { 85, 8 },      /* octetTotalCount */
+    { 135, 8 },     /* droppedPacketTotalCount */
+    { 136, 1 },     /* flowEndReason */
+};
+
+#define IPFIX_N_FIELDS (sizeof(ipfix_fields) / sizeof(ipfix_fields[0]))
+#define IPFIX_RECORD_LEN 55
+
+struct flow_exporter {
+    int fd;                     /* UDP socket or file (-1 = off) */
+    int is_udp;
+    struct ring_buffer *rb;
+    pthread_t thread;
+    
+    /* Message being filled (len 0 = none) */
+    unsigned char msg[IPFIX_MSG_MAX];
+    size_t len;
+    size_t set_start;
+    __u32 msg_sequence;
+    time_t msg_opened;
+    time_t template_sent;
+    __s64 wall_offset_ns;       /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+    
+    /* Idle sweep */
+    struct flow_tuple *keys;
+    struct flow_state *values;
+    __u32 chunk;
+    char batch_in[SNAPSHOT_MAX_KEY];
+    char batch_out[SNAPSHOT_MAX_KEY];
+    int in_pass;
+    int pass_started;           /* batch_in holds a cursor */
+    time_t next_pass;
+    
+    __u32 sequence;             /* Data records sent */
+    __u64 records;
+    __u64 send_errors;
+};
+
+static struct flow_exporter exporter = { .fd = -1 };
+
+static unsigned char *ipfix_put(unsigned char *p, __u64 v, int len)
+{
+    for (int i = len - 1; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+    return p + len;
+}
+
+static void ipfix_flush(void)
+{
+    struct flow_exporter *fx = &exporter;
+    ssize_t n;
+    
+    if (!fx->len)
+        return;
+    
+    ipfix_put(fx->msg + fx->set_start + 2, fx->len - fx->set_start, 2);
+    ipfix_put(fx->msg, IPFIX_VERSION, 2);
+    ipfix_put(fx->msg + 2, fx->len, 2);
+    ipfix_put(fx->msg + 4, time(NULL), 4);
+    ipfix_put(fx->msg + 8, fx->msg_sequence, 4);
+    ipfix_put(fx->msg + 12, ctx.ifindex, 4);    /* Observation domain */
+    
+    if (fx->is_udp)
+        n = send(fx->fd, fx->msg, fx->len, 0);
+    else
+        n = write(fx->fd, fx->msg, fx->len);
+    if (n != (ssize_t)fx->len)
+        fx->send_errors++;
+    
+    fx->len = 0;
+}
+
+static void ipfix_open(void)
+{
+    struct flow_exporter *fx = &exporter;
+    time_t now = time(NULL);
+    struct timespec wall;
+    unsigned char *p;
+    
+    fx->len = IPFIX_HDR_LEN;
+    fx->msg_sequence = fx->sequence;
+    fx->msg_opened = now;
+    
+    /* Record times are bpf_ktime_get_ns(); IPFIX wants wall-clock time */
+    clock_gettime(CLOCK_REALTIME, &wall);
+    fx->wall_offset_ns = (__s64)wall.tv_sec * 1000000000LL + wall.tv_nsec -
+                         (__s64)monotonic_ns();
+    
+    /* A file needs its template once, a collector again now and then */
+    if (!fx->template_sent ||
+        (fx->is_udp && now - fx->template_sent >= IPFIX_TEMPLATE_REFRESH_SEC)) {
+        p = fx->msg + fx->len;
+        p = ipfix_put(p, IPFIX_TEMPLATE_SET, 2);
+        p = ipfix_put(p, IPFIX_SET_HDR_LEN + 4 + IPFIX_N_FIELDS * 4, 2);
+        p = ipfix_put(p, IPFIX_TEMPLATE_ID, 2);
+        p = ipfix_put(p, IPFIX_N_FIELDS, 2);
+        for (size_t i = 0; i < IPFIX_N_FIELDS; i++) {
+            p = ipfix_put(p, ipfix_fields[i].id, 2);
+            p = ipfix_put(p, ipfix_fields[i].len, 2);
+        }
+        fx->len = p - fx->msg;
+        fx->template_sent = now;
+    }
+    
+    fx->set_start = fx->len;
+    ipfix_put(fx->msg + fx->len, IPFIX_TEMPLATE_ID, 2);
+    fx->len += IPFIX_SET_HDR_LEN;
+}
+
+static void ipfix_add(const struct flow_record *rec)
+{
+    struct flow_exporter *fx = &exporter;
+    unsigned char *p;
+    
+    if (fx->len && fx->len + IPFIX_RECORD_LEN > IPFIX_MSG_MAX)
+        ipfix_flush();
+    if (!fx->len)
+        ipfix_open();
+    
+    p = fx->msg + fx->len;
+    memcpy(p, &rec->flow.src_ip, 4);            /* Already network order */
+    memcpy(p + 4, &rec->flow.dst_ip, 4);
+    p = ipfix_put(p + 8, rec->flow.src_port, 2);
+    p = ipfix_put(p, rec->flow.dst_port, 2);
+    p = ipfix_put(p, rec->flow.protocol, 1);
+    p = ipfix_put(p, rec->class_id, 1);
+    p = ipfix_put(p, (rec->first_seen + fx->wall_offset_ns) / 1000000, 8);
+    p = ipfix_put(p, (rec->last_seen + fx->wall_offset_ns) / 1000000, 8);
+    p = ipfix_put(p, rec->packets, 8);
+    p = ipfix_put(p, rec->bytes, 8);
+    p = ipfix_put(p, rec->dropped, 8);
+    p = ipfix_put(p, rec->end_reason, 1);
+    fx->len = p - fx->msg;
+    
+    fx->sequence++;
+    fx->records++;
+}
+
+static int flow_record_ready(void *arg, void *data, size_t size)
+{
+    (void)arg;
+    
+    if (size >= sizeof(struct flow_record))
+        ipfix_add(data);
+    return 0;
+}
+
+/*
+ * Remove an entry and return its last value. Hash maps do this in one
+ * step from Linux 5.14; before that, read then delete.
+ */
+static int map_take(int fd, const void *key, void *value)
+{
+    if (bpf_map_lookup_and_delete_elem(fd, key, value) == 0)
+        return 0;
+    if (errno == ENOENT || bpf_map_lookup_elem(fd, key, value))
+        return -1;
+    bpf_map_delete_elem(fd, key);
+    return 0;
+}
+
+static void flow_report(const struct flow_tuple *flow,
+                        const struct flow_state *st,
+                        const struct flow_acct *acct, __u8 reason)
+{
+    struct flow_record rec = {
+        .flow = *flow,
+        .first_seen = acct->first_seen ? acct->first_seen : st->last_seen,
+        .last_seen = st->last_seen,
+        .packets = st->packet_count,
+        .bytes = st->byte_count,
+        .dropped = acct->dropped_packets,
+        .class_id = st->class_id,
+        .end_reason = reason,
+    };
+    
+    ipfix_add(&rec);
+}
+
+/* Idle for idle_ns at now; last_seen can be later than now, not idle */
+static int flow_idle(const struct flow_state *st, __u64 now, __u64 idle_ns)
+{
+    return (__s64)(now - st->last_seen) >= (__s64)idle_ns;
+}
+
+/*
+ * End a flow: its final counts come from the entries as they are removed.
+ * The sweep read it some time ago, so it is checked again before the
+ * delete, and put back if a packet still came in between.
+ */
+static void flow_expire(const struct flow_tuple *flow, __u64 now,
+                        __u64 idle_ns)
+{
+    struct flow_state st, seen;
+    struct flow_acct acct = {0};
+    
+    if (bpf_map_lookup_elem(ctx.flow_table_fd, flow, &seen) ||
+        !flow_idle(&seen, now, idle_ns))
+        return;
+    if (map_take(ctx.flow_table_fd, flow, &st))
+        return;
+    if (st.last_seen != seen.last_seen) {
+        bpf_map_update_elem(ctx.flow_table_fd, flow, &st, BPF_NOEXIST);
+        return;
+    }
+    map_take(ctx.flow_acct_fd, flow, &acct);
+    flow_report(flow, &st, &acct, FLOW_END_IDLE);
+}
+
+/*
+ * Read the next chunk of flow_table into the sweep buffers. Returns the
+ * number of entries, with *done set once the walk has reached the end.
+ */
+static int flow_walk_chunk(int *done)
+{
+    struct flow_exporter *fx = &exporter;
+    __u32 count = fx->chunk;
+    int err;
+    
+    err = bpf_map_lookup_batch(ctx.flow_table_fd,
+                               fx->pass_started ? fx->batch_in : NULL,
+                               fx->batch_out, fx->keys, fx->values, &count,
+                               NULL);
+    if (err && errno != ENOENT)
+        return -errno;
+    
+    memcpy(fx->batch_in, fx->batch_out, sizeof(fx->batch_in));
+    fx->pass_started = 1;
+    *done = err != 0;
+    return count;
+}
+
+static void flow_sweep(void)
+{
+    struct flow_exporter *fx = &exporter;
+    __u64 now = monotonic_ns();
+    __u64 idle_ns = (__u64)ctx.flow_idle_timeout * 1000000000ULL;
+    int n, done;
+    
+    if (!fx->in_pass) {
+        if (time(NULL) < fx->next_pass)
+            return;
+        fx->in_pass = 1;
+        fx->pass_started = 0;
+        fx->next_pass = time(NULL) + (ctx.flow_idle_timeout + 1) / 2;
+    }
+    
+    n = flow_walk_chunk(&done);
+    if (n < 0) {
+        fprintf(stderr, "Flow export: cannot walk flow_table: %s\n",
+                strerror(-n));
+        fx->in_pass = 0;
+        fx->next_pass = time(NULL) + ctx.flow_idle_timeout;
+        return;
+    }
+    
+    for (int i = 0; i < n; i++) {
+        if (flow_idle(&fx->values[i], now, idle_ns))
+            flow_expire(&fx->keys[i], now, idle_ns);
+    }
+    
+    if (done)
+        fx->in_pass = 0;
+}
+
+/* Report every remaining flow, without removing it */
+static void flow_report_all(__u8 reason)
+{
+    struct flow_exporter *fx = &exporter;
+    struct flow_acct acct;
+    int n, done = 0;
+    
+    fx->pass_started = 0;
+    while (!done && (n = flow_walk_chunk(&done)) >= 0) {
+        for (int i = 0; i < n; i++) {
+            memset(&acct, 0, sizeof(acct));
+            bpf_map_lookup_elem(ctx.flow_acct_fd, &fx->keys[i], &acct);
+            flow_report(&fx->keys[i], &fx->values[i], &acct, reason);
+        }
+    }
+}
+
+static void *flow_export_run(void *arg)
+{
+    (void)arg;
+    
+    while (keep_running) {
+        ring_buffer__consume(exporter.rb);
+        flow_sweep();
+        if (exporter.len &&
+            time(NULL) - exporter.msg_opened >= FLOW_EXPORT_FLUSH_SEC)
+            ipfix_flush();
+        usleep(FLOW_EXPORT_POLL_MS * 1000);
+    }
+    return NULL;
+}
+
+/* Open TARGET (udp:ADDR[:PORT] or a file) and start the export thread */
+int start_flow_exporter(const char *target)
+{
+    struct flow_exporter *fx = &exporter;
+    __u32 max_flows = ctx.max_flows ? ctx.max_flows : MAX_FLOWS;
+    __u32 ticks;
+    
+    if (ctx.flow_acct_fd < 0 || ctx.flow_records_fd < 0) {
+        fprintf(stderr, "Flow export: XDP object has no flow_acct/flow_records maps\n");
+        return -1;
+    }
+    
+    if (!strncmp(target, "udp:", 4)) {
+        struct sockaddr_in sa = { .sin_family = AF_INET,
+                                  .sin_port = htons(IPFIX_PORT) };
+        char addr[INET_ADDRSTRLEN];
+        const char *port = strchr(target + 4, ':');
+        size_t n = port ? (size_t)(port - target - 4) : strlen(target + 4);
+        
+        if (n >= sizeof(addr)) {
+            fprintf(stderr, "Invalid flow export target: %s\n", target);
+            return -1;
+        }
+        memcpy(addr, target + 4, n);
+        addr[n] = '\0';
+        if (port)
+            sa.sin_port = htons(atoi(port + 1));
+        if (!sa.sin_port || inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+            fprintf(stderr, "Invalid flow export target: %s\n", target);
+            return -1;
+        }
+        
+        fx->is_udp = 1;
+        fx->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fx->fd >= 0 &&
+            connect(fx->fd, (struct sockaddr *)&sa, sizeof(sa))) {
+            close(fx->fd);
+            fx->fd = -1;
         }
+    } else {
+        fx->fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (fx->fd < 0) {
+        fprintf(stderr, "Flow export: cannot open %s: %s\n", target,
+                strerror(errno));
+        return -1;
     }
+    
+    /* One sweep pass per half idle timeout, in FLOW_EXPORT_POLL_MS steps */
+    ticks = ctx.flow_idle_timeout * (1000 / FLOW_EXPORT_POLL_MS) / 2;
+    fx->chunk = ticks ? (max_flows + ticks - 1) / ticks : max_flows;
+    if (fx->chunk < FLOW_SWEEP_MIN_CHUNK)
+        fx->chunk = FLOW_SWEEP_MIN_CHUNK;
+    
+    fx->keys = calloc(fx->chunk, sizeof(*fx->keys));
+    fx->values = calloc(fx->chunk, sizeof(*fx->values));
+    fx->rb = ring_buffer__new(ctx.flow_records_fd, flow_record_ready, NULL,
+                              NULL);
+    if (!fx->keys || !fx->values || !fx->rb ||
+        start_thread(&fx->thread, flow_export_run)) {
+        fprintf(stderr, "Flow export: cannot start exporter\n");
+        ring_buffer__free(fx->rb);
+        free(fx->keys);
+        free(fx->values);
+        close(fx->fd);
+        fx->fd = -1;
+        return -1;
+    }
+    
+    printf("Exporting IPFIX flow records to %s (active %us, idle %us)\n",
+           target, ctx.flow_active_timeout, ctx.flow_idle_timeout);
+    return 0;
+}
+
+/*
+ * Called once keep_running is cleared, before the state snapshot is saved.
+ * Without a state file the flows end here and are reported as such; with
+ * one they carry over the restart, flow_acct included.
+ */
+void stop_flow_exporter(void)
+{
+    struct flow_exporter *fx = &exporter;
+    
+    if (fx->fd < 0)
+        return;
+    
+    pthread_join(fx->thread, NULL);
+    ring_buffer__consume(fx->rb);
+    if (!ctx.state_file)
+        flow_report_all(FLOW_END_FORCED);
+    ipfix_flush();
+    
+    printf("Flow export: %llu records sent", fx->records);
+    if (fx->send_errors)
+        printf(", %llu messages failed", fx->send_errors);
     printf("\n");
+    
+    ring_buffer__free(fx->rb);
+    free(fx->keys);
+    free(fx->values);
+    close(fx->fd);
+    fx->fd = -1;
 }
 
 /* Usage information */
@@ -597,6 +3634,17 @@ void print_usage(const char *prog)
     printf("  -x, --xdp FILE          XDP object file\n");
     printf("  -t, --tc FILE           TC object file\n");
     printf("  -s, --stats INTERVAL    Print stats every INTERVAL seconds (0 = disable)\n");
+    printf("  -P, --profile N         Profile XDP stages on 1 in N packets (0 = off)\n");
+    printf("  -N, --numa              Pin queue IRQs, XPS and RPS to the NIC's NUMA node\n");
+    printf("  -M, --hw-meta           Use the NIC's RX hash and timestamps (kernel 6.3+)\n");
+    printf("  -S, --state FILE        Save flow and policer state here on exit, restore on start\n");
+    printf("  -R, --reorder-rules N   Reorder rules by matches every N seconds (0 = off)\n");
+    printf("  -C, --compile-policy SRC  Compile the config's rules into the XDP source SRC\n"
+           "                          (e.g. %s) and load the result instead of -x\n",
+           POLICY_XDP_SRC);
+    printf("  -E, --export TARGET     Export IPFIX flow records to udp:ADDR[:PORT] or a file\n");
+    printf("  -m, --metrics [ADDR:]PORT  Serve OpenMetrics at /metrics (default address %s)\n",
+           METRICS_DEFAULT_ADDR);
     printf("  -d, --detach            Detach XDP program and exit\n");
     printf("  -h, --help              Show this help\n");
 }
@@ -607,9 +3655,14 @@ int main(int argc, char **argv)
     char *config_file = DEFAULT_CONFIG_PATH;
     char *xdp_file = NULL;
     char *tc_file = NULL;
+    char *policy_src = NULL;
+    char *metrics_addr = NULL;
     int stats_interval = 5;
     int detach_only = 0;
-    int opt, err;
+    int numa_mode = 0;
+    int hw_meta = 0;
+    time_t next_reorder;
+    int opt, err, mtu;
     
     static struct option long_options[] = {
         {"interface", required_argument, 0, 'i'},
@@ -617,13 +3670,21 @@ int main(int argc, char **argv)
         {"xdp", required_argument, 0, 'x'},
         {"tc", required_argument, 0, 't'},
         {"stats", required_argument, 0, 's'},
+        {"profile", required_argument, 0, 'P'},
+        {"numa", no_argument, 0, 'N'},
+        {"hw-meta", no_argument, 0, 'M'},
+        {"state", required_argument, 0, 'S'},
+        {"reorder-rules", required_argument, 0, 'R'},
+        {"compile-policy", required_argument, 0, 'C'},
+        {"export", required_argument, 0, 'E'},
+        {"metrics", required_argument, 0, 'm'},
         {"detach", no_argument, 0, 'd'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
     /* Parse command line arguments */
-    while ((opt = getopt_long(argc, argv, "i:c:x:t:s:dh", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:c:x:t:s:P:NMS:R:C:E:m:dh", long_options, NULL)) != -1) {
         switch (opt) {
         case 'i':
             ifname = optarg;
@@ -640,6 +3701,30 @@ int main(int argc, char **argv)
         case 's':
             stats_interval = atoi(optarg);
             break;
+        case 'P':
+            ctx.prof_sample_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'N':
+            numa_mode = 1;
+            break;
+        case 'M':
+            hw_meta = 1;
+            break;
+        case 'S':
+            ctx.state_file = optarg;
+            break;
+        case 'R':
+            ctx.reorder_interval = atoi(optarg);
+            break;
+        case 'C':
+            policy_src = optarg;
+            break;
+        case 'E':
+            ctx.flow_export_target = optarg;
+            break;
+        case 'm':
+            metrics_addr = optarg;
+            break;
         case 'd':
             detach_only = 1;
             break;
@@ -664,6 +3749,20 @@ int main(int argc, char **argv)
         return 0;
     }
     
+    /* Optional compile step: the policy's rules as code in the XDP program */
+    if (policy_src) {
+        if (policy_compile(config_file, policy_src, DEFAULT_POLICY_OBJ))
+            return 1;
+        xdp_file = DEFAULT_POLICY_OBJ;
+        ctx.compiled_policy = 1;
+        
+        /* Compiled rules have a fixed order */
+        if (ctx.reorder_interval) {
+            fprintf(stderr, "Warning: -R has no effect on a compiled policy\n");
+            ctx.reorder_interval = 0;
+        }
+    }
+    
     /* Validate XDP file */
     if (!xdp_file) {
         fprintf(stderr, "Error: XDP object file required (-x option)\n");
@@ -675,12 +3774,39 @@ int main(int argc, char **argv)
     printf("Cleaning up old pinned maps...\n");
     cleanup_pinned_maps();
     
+    read_load_time_config(config_file);
+    
+    if (hw_meta) {
+        ctx.hw_metadata_ifindex = if_nametoindex(ifname);
+        if (!ctx.hw_metadata_ifindex)
+            fprintf(stderr, "Warning: %s not found, RX metadata disabled\n",
+                    ifname);
+    }
+    
+    /* Jumbo frames span several buffers */
+    mtu = read_mtu(ifname);
+    if (mtu > XDP_SINGLE_BUF_MTU) {
+        ctx.xdp_frags = 1;
+        printf("MTU %d: loading the multi-buffer XDP program\n", mtu);
+    }
+    
     /* Load and attach XDP program */
     err = load_xdp_program(xdp_file);
     if (err)
         return 1;
     
     err = attach_xdp_program(ifname, XDP_FLAGS_UPDATE_IF_NOEXIST);
+    if (err && ctx.hw_metadata_ifindex) {
+        /* Generic XDP (no native driver support) rejects device-bound programs */
+        fprintf(stderr, "Warning: device-bound attach failed, "
+                "continuing without RX metadata\n");
+        bpf_object__close(ctx.xdp_obj);
+        ctx.hw_metadata_ifindex = 0;
+        err = load_xdp_program(xdp_file);
+        if (err)
+            return 1;
+        err = attach_xdp_program(ifname, XDP_FLAGS_UPDATE_IF_NOEXIST);
+    }
     if (err) {
         bpf_object__close(ctx.xdp_obj);
         return 1;
@@ -699,6 +3825,8 @@ int main(int argc, char **argv)
             fprintf(stderr, "Warning: Failed to attach TC program\n");
             goto cleanup;
         }
+        
+        get_tc_map_fds();
     } else {
         printf("Note: No TC program specified (-t option), XDP only mode\n");
     }
@@ -715,23 +3843,54 @@ int main(int argc, char **argv)
         fprintf(stderr, "Warning: Failed to load configuration\n");
     }
     
+    /* After the configuration, whose token bucket rates it keeps */
+    if (ctx.state_file)
+        restore_state_snapshot(ctx.state_file);
+    
+    /* After the configuration, which decides whether XPS stays off */
+    if (numa_mode && setup_numa_affinity())
+        fprintf(stderr, "Warning: NUMA deployment mode not applied\n");
+    
+    if (ctx.flow_export_target && start_flow_exporter(ctx.flow_export_target))
+        fprintf(stderr, "Warning: flow export not started\n");
+    
+    if (metrics_addr && start_metrics_exporter(metrics_addr))
+        fprintf(stderr, "Warning: metrics exporter not started\n");
+    
     printf("\nXDP QoS Scheduler running on interface %s\n", ifname);
     printf("Press Ctrl+C to stop\n\n");
     
-    /* Main loop - print statistics periodically */
+    /* Main loop - print statistics and reorder rules periodically */
+    next_reorder = time(NULL) + ctx.reorder_interval;
     while (keep_running) {
         if (stats_interval > 0) {
             print_statistics();
             sleep(stats_interval);
+        } else if (ctx.reorder_interval > 0) {
+            sleep(ctx.reorder_interval);
         } else {
             pause();
         }
+        
+        if (ctx.reorder_interval > 0 && time(NULL) >= next_reorder) {
+            reorder_rules();
+            next_reorder = time(NULL) + ctx.reorder_interval;
+        }
     }
     
 cleanup:
     /* Cleanup */
     printf("\nCleaning up...\n");
     
+    keep_running = 0;
+    stop_metrics_exporter();
+    /* Joined first: its sweep must not expire flows the snapshot holds */
+    stop_flow_exporter();
+    
+    /* While the maps are still populated and the TC pins exist */
+    if (ctx.state_file && ctx.flow_table_fd > 0)
+        save_state_snapshot(ctx.state_file);
+    
     if (tc_file) {
         detach_tc_program();
         /* tc_obj is a marker, not a real object - don't close it */
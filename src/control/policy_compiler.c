@@ -0,0 +1,404 @@
+/*
+ * Policy Compiler - classification rules baked into the XDP program
+ *
+ * The generic classifier interprets up to RULE_BANK_SIZE class_rule
+ * entries per packet: a map lookup and a field-by-field test for each.
+ * Here the rules of one policy become a policy_match() function instead,
+ * which the XDP program includes when built with -DCOMPILED_POLICY:
+ *
+ *   - an outer switch on the protocol, each case holding the rules of
+ *     that protocol and the protocol-agnostic ones, in priority order
+ *   - runs of rules that only test the destination port become a switch
+ *     on the port (GNU case ranges for port ranges)
+ *   - any other rule is a single if with only the fields it sets
+ *
+ * Rules are evaluated in the same order and with the same semantics as
+ * the generic classifier, so both give the same class for every packet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "policy_compiler.h"
+
+/* Compiler arguments, including the split-up $BPF_CFLAGS */
+#define POLICY_MAX_ARGS 128
+
+/* A port condition is set when either bound is; 0-65535 tests nothing */
+static int port_cond(__u16 min, __u16 max)
+{
+    return (min || max) && !(min == 0 && max == 0xffff);
+}
+
+/* A range with min above max never matches in the generic classifier */
+static int rule_dead(const struct class_rule *r)
+{
+    return (port_cond(r->src_port_min, r->src_port_max) &&
+            r->src_port_min > r->src_port_max) ||
+           (port_cond(r->dst_port_min, r->dst_port_max) &&
+            r->dst_port_min > r->dst_port_max);
+}
+
+/* Rules that test nothing but the destination port go in a port switch */
+static int rule_port_only(const struct class_rule *r)
+{
+    return !r->tenant && !r->src_ip_mask && !r->dst_ip_mask &&
+           !port_cond(r->src_port_min, r->src_port_max) &&
+           port_cond(r->dst_port_min, r->dst_port_max);
+}
+
+static const char *proto_name(__u8 protocol)
+{
+    switch (protocol) {
+    case IPPROTO_TCP:
+        return "TCP";
+    case IPPROTO_UDP:
+        return "UDP";
+    case IPPROTO_ICMP:
+        return "ICMP";
+    default:
+        return "other";
+    }
+}
+
+static void emit_port_range(FILE *out, const char *field, __u16 min, __u16 max,
+                            const char **sep)
+{
+    if (min == max) {
+        fprintf(out, "%sflow->%s == %u", *sep, field, min);
+    } else {
+        if (min)
+            fprintf(out, "%sflow->%s >= %u", *sep, field, min);
+        if (max != 0xffff)
+            fprintf(out, "%sflow->%s <= %u", min ? " && " : *sep, field, max);
+    }
+    *sep = " && ";
+}
+
+/* Returns 1 if the rule matches everything that reaches it */
+static int emit_rule(FILE *out, const struct class_rule *r, int indent)
+{
+    const char *sep = "";
+    
+    if (!r->tenant && !r->src_ip_mask && !r->dst_ip_mask &&
+        !port_cond(r->src_port_min, r->src_port_max) &&
+        !port_cond(r->dst_port_min, r->dst_port_max)) {
+        fprintf(out, "%*s*class_id = %u;\n", indent, "", r->class_id);
+        fprintf(out, "%*sreturn %u;\n", indent, "", r->id);
+        return 1;
+    }
+    
+    fprintf(out, "%*sif (", indent, "");
+    if (r->tenant) {
+        fprintf(out, "(flow->tenant[0] << 16 | flow->tenant[1] << 8 | "
+                     "flow->tenant[2]) == 0x%06x", r->tenant);
+        sep = " && ";
+    }
+    if (r->src_ip_mask) {
+        fprintf(out, "%s(flow->src_ip & 0x%08x) == 0x%08x", sep,
+                r->src_ip_mask, r->src_ip & r->src_ip_mask);
+        sep = " && ";
+    }
+    if (r->dst_ip_mask) {
+        fprintf(out, "%s(flow->dst_ip & 0x%08x) == 0x%08x", sep,
+                r->dst_ip_mask, r->dst_ip & r->dst_ip_mask);
+        sep = " && ";
+    }
+    if (port_cond(r->src_port_min, r->src_port_max))
+        emit_port_range(out, "src_port", r->src_port_min, r->src_port_max, &sep);
+    if (port_cond(r->dst_port_min, r->dst_port_max))
+        emit_port_range(out, "dst_port", r->dst_port_min, r->dst_port_max, &sep);
+    fprintf(out, ") {\n");
+    fprintf(out, "%*s*class_id = %u;\n", indent + 4, "", r->class_id);
+    fprintf(out, "%*sreturn %u;\n", indent + 4, "", r->id);
+    fprintf(out, "%*s}\n", indent, "");
+    return 0;
+}
+
+/*
+ * The rules a packet of this protocol can match (protocol 0: only the
+ * protocol-agnostic ones), in order. Returns 1 if the list always returns.
+ */
+static int emit_rule_list(FILE *out, const struct class_rule *rules, int n,
+                          __u8 protocol, int indent)
+{
+    __u16 lo[RULE_BANK_SIZE], hi[RULE_BANK_SIZE];
+    int n_cases = 0, in_switch = 0;
+    int i, j;
+    
+    for (i = 0; i < n; i++) {
+        const struct class_rule *r = &rules[i];
+    
+        if (r->protocol && r->protocol != protocol)
+            continue;
+        if (rule_dead(r))
+            continue;
+    
+        if (!rule_port_only(r)) {
+            if (in_switch) {
+                fprintf(out, "%*s}\n", indent, "");
+                in_switch = 0;
+            }
+            if (emit_rule(out, r, indent))
+                return 1;
+            continue;
+        }
+    
+        /* Case labels may not overlap: an earlier rule wins, so start over */
+        for (j = 0; in_switch && j < n_cases; j++) {
+            if (r->dst_port_min <= hi[j] && lo[j] <= r->dst_port_max) {
+                fprintf(out, "%*s}\n", indent, "");
+                in_switch = 0;
+            }
+        }
+        if (!in_switch) {
+            fprintf(out, "%*sswitch (flow->dst_port) {\n", indent, "");
+            in_switch = 1;
+            n_cases = 0;
+        }
+    
+        if (r->dst_port_min == r->dst_port_max)
+            fprintf(out, "%*scase %u:\n", indent, "", r->dst_port_min);
+        else
+            fprintf(out, "%*scase %u ... %u:\n", indent, "",
+                    r->dst_port_min, r->dst_port_max);
+        fprintf(out, "%*s*class_id = %u;\n", indent + 4, "", r->class_id);
+        fprintf(out, "%*sreturn %u;\n", indent + 4, "", r->id);
+        lo[n_cases] = r->dst_port_min;
+        hi[n_cases] = r->dst_port_max;
+        n_cases++;
+    }
+    
+    if (in_switch)
+        fprintf(out, "%*s}\n", indent, "");
+    return 0;
+}
+
+/* Write policy_match() for the rules, already in priority order */
+static void policy_emit(FILE *out, const struct class_rule *rules, int n,
+                        const char *origin)
+{
+    __u8 protocols[RULE_BANK_SIZE];
+    int n_proto = 0;
+    int i, j;
+    
+    for (i = 0; i < n; i++) {
+        if (!rules[i].protocol)
+            continue;
+        for (j = 0; j < n_proto && protocols[j] != rules[i].protocol; j++)
+            ;
+        if (j == n_proto)
+            protocols[n_proto++] = rules[i].protocol;
+    }
+    
+    fprintf(out, "/*\n"
+                 " * Classification rules compiled from %s\n"
+                 " * Generated by the policy compiler; do not edit\n"
+                 " */\n\n", origin);
+    fprintf(out, "#define POLICY_RULES %d\n\n", n);
+    fprintf(out, "/* Matching rule's id (rule_hits index) and class, or -1 */\n");
+    fprintf(out, "static __always_inline int policy_match(struct flow_tuple *flow,\n"
+                 "                                        __u16 *class_id)\n"
+                 "{\n");
+    
+    if (n_proto) {
+        fprintf(out, "    switch (flow->protocol) {\n");
+        for (i = 0; i < n_proto; i++) {
+            fprintf(out, "    case %u:    /* %s */\n", protocols[i],
+                    proto_name(protocols[i]));
+            if (!emit_rule_list(out, rules, n, protocols[i], 8))
+                fprintf(out, "        break;\n");
+        }
+        fprintf(out, "    default:\n");
+        if (!emit_rule_list(out, rules, n, 0, 8))
+            fprintf(out, "        break;\n");
+        fprintf(out, "    }\n");
+    } else {
+        emit_rule_list(out, rules, n, 0, 4);
+    }
+    
+    fprintf(out, "    return -1;\n"
+                 "}\n");
+}
+
+int policy_parse_rules(struct json_object *array, struct class_rule *rules)
+{
+    int n_rules = json_object_array_length(array);
+    
+    if (n_rules > RULE_BANK_SIZE) {
+        fprintf(stderr, "Warning: only the first %d classification rules are used\n",
+                RULE_BANK_SIZE);
+        n_rules = RULE_BANK_SIZE;
+    }
+    
+    for (int i = 0; i < n_rules; i++) {
+        struct json_object *rule_obj = json_object_array_get_idx(array, i);
+        struct class_rule rule = {0};
+        struct json_object *tmp;
+        int pos;
+    
+        if (json_object_object_get_ex(rule_obj, "protocol", &tmp)) {
+            const char *proto = json_object_get_string(tmp);
+            if (strcmp(proto, "tcp") == 0)
+                rule.protocol = IPPROTO_TCP;
+            else if (strcmp(proto, "udp") == 0)
+                rule.protocol = IPPROTO_UDP;
+            else if (strcmp(proto, "icmp") == 0)
+                rule.protocol = IPPROTO_ICMP;
+        }
+    
+        if (json_object_object_get_ex(rule_obj, "dst_port_min", &tmp))
+            rule.dst_port_min = json_object_get_int(tmp);
+    
+        if (json_object_object_get_ex(rule_obj, "dst_port_max", &tmp))
+            rule.dst_port_max = json_object_get_int(tmp);
+    
+        if (json_object_object_get_ex(rule_obj, "class_id", &tmp))
+            rule.class_id = json_object_get_int(tmp);
+    
+        if (json_object_object_get_ex(rule_obj, "priority", &tmp))
+            rule.priority = json_object_get_int(tmp);
+    
+        if (json_object_object_get_ex(rule_obj, "tenant", &tmp))
+            rule.tenant = json_object_get_int64(tmp);
+    
+        /* Default port range if not specified */
+        if (rule.dst_port_max == 0 && rule.dst_port_min > 0)
+            rule.dst_port_max = rule.dst_port_min;
+    
+        /* Higher priority first; equal priorities keep file order */
+        rule.id = i;
+        for (pos = i; pos > 0 && rules[pos - 1].priority < rule.priority; pos--)
+            rules[pos] = rules[pos - 1];
+        rules[pos] = rule;
+    }
+    
+    return n_rules;
+}
+
+int policy_read_rules(const char *config_file, struct class_rule *rules)
+{
+    struct json_object *root, *array;
+    int n = 0;
+    
+    root = json_object_from_file(config_file);
+    if (!root) {
+        fprintf(stderr, "Error parsing JSON file: %s\n", config_file);
+        return -1;
+    }
+    
+    if (json_object_object_get_ex(root, "rules", &array))
+        n = policy_parse_rules(array, rules);
+    
+    json_object_put(root);
+    return n;
+}
+
+/* Run argv[0] with argv and wait for it; returns its exit status or -1 */
+static int run_command(const char *const argv[])
+{
+    pid_t pid;
+    int status;
+    
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error starting %s: %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        execvp(argv[0], (char *const *)argv);
+        fprintf(stderr, "Error running %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Error waiting for %s: %s\n", argv[0], strerror(errno));
+            return -1;
+        }
+    }
+    
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int policy_compile(const char *config_file, const char *xdp_src,
+                   const char *out_obj)
+{
+    static const char *bpf_flags[] = {
+        "-O2", "-g", "-Wall", "-Werror", "-target", "bpf",
+        "-D__BPF__", "-D__BPF_TRACING__", "-Wno-unused-value",
+        "-Wno-pointer-sign", "-Wno-compare-distinct-pointer-types",
+    };
+    struct class_rule rules[RULE_BANK_SIZE];
+    char hdr[PATH_MAX], hdr_abs[PATH_MAX], define[PATH_MAX + 32];
+    const char *argv[POLICY_MAX_ARGS];
+    const char *clang = getenv("CLANG");
+    const char *extra = getenv("BPF_CFLAGS");
+    char *flags = NULL, *tok, *save;
+    FILE *f;
+    int n, argc = 0, ret;
+    
+    n = policy_read_rules(config_file, rules);
+    if (n < 0)
+        return -1;
+    
+    snprintf(hdr, sizeof(hdr), "%s.h", out_obj);
+    f = fopen(hdr, "w");
+    if (!f) {
+        fprintf(stderr, "Error creating %s: %s\n", hdr, strerror(errno));
+        return -1;
+    }
+    policy_emit(f, rules, n, config_file);
+    fclose(f);
+    
+    /* The header is included from the XDP source's directory */
+    if (!realpath(hdr, hdr_abs)) {
+        fprintf(stderr, "Error resolving %s: %s\n", hdr, strerror(errno));
+        return -1;
+    }
+    snprintf(define, sizeof(define), "-DCOMPILED_POLICY=\"%s\"", hdr_abs);
+    
+    /* No shell: paths go through as they are, $BPF_CFLAGS splits on blanks */
+    argv[argc++] = clang && *clang ? clang : POLICY_CLANG;
+    for (size_t i = 0; i < sizeof(bpf_flags) / sizeof(bpf_flags[0]); i++)
+        argv[argc++] = bpf_flags[i];
+    argv[argc++] = define;
+    if (extra) {
+        flags = strdup(extra);
+        if (!flags) {
+            fprintf(stderr, "Error copying BPF_CFLAGS\n");
+            return -1;
+        }
+        for (tok = strtok_r(flags, " \t\n", &save); tok;
+             tok = strtok_r(NULL, " \t\n", &save)) {
+            if (argc >= POLICY_MAX_ARGS - 5) {
+                fprintf(stderr, "Error: too many flags in BPF_CFLAGS\n");
+                free(flags);
+                return -1;
+            }
+            argv[argc++] = tok;
+        }
+    }
+    argv[argc++] = "-c";
+    argv[argc++] = xdp_src;
+    argv[argc++] = "-o";
+    argv[argc++] = out_obj;
+    argv[argc] = NULL;
+    
+    printf("Compiling %d classification rules from %s into %s...\n",
+           n, config_file, out_obj);
+    ret = run_command(argv);
+    if (ret != 0)
+        fprintf(stderr, "Error compiling policy: %s exited with %d\n",
+                argv[0], ret);
+    
+    free(flags);
+    return ret ? -1 : 0;
+}
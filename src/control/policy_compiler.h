@@ -0,0 +1,42 @@
+/*
+ * Policy Compiler - classification rules baked into the XDP program
+ *
+ * Shared by the control plane and the benchmark. The rules of a JSON
+ * policy are turned into C (switch tables on protocol and destination
+ * port, straight-line compares for everything else), written to a header
+ * and compiled into the XDP program with clang, so classification no
+ * longer walks the class_rules map.
+ */
+
+#ifndef __POLICY_COMPILER_H__
+#define __POLICY_COMPILER_H__
+
+#include <json-c/json.h>
+
+#include "../common/common.h"
+
+/* XDP source and compiler used when none are given */
+#define POLICY_XDP_SRC "src/xdp/xdp_scheduler.c"
+#define POLICY_CLANG "clang"
+
+/*
+ * Parse a "rules" array into rules[], highest priority first (equal
+ * priorities keep file order). At most RULE_BANK_SIZE rules are used.
+ * Returns the number of rules.
+ */
+int policy_parse_rules(struct json_object *array, struct class_rule *rules);
+
+/* Rules of a configuration file; returns their number or -1 */
+int policy_read_rules(const char *config_file, struct class_rule *rules);
+
+/*
+ * Compile the rules of config_file into a copy of the XDP program at
+ * out_obj. The generated header is kept next to it (out_obj with .h
+ * appended). $CLANG and $BPF_CFLAGS override the compiler and add flags;
+ * the compiler is run without a shell, with $BPF_CFLAGS split on blanks.
+ * Returns 0 on success.
+ */
+int policy_compile(const char *config_file, const char *xdp_src,
+                   const char *out_obj);
+
+#endif /* __POLICY_COMPILER_H__ */
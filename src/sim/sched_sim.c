@@ -0,0 +1,1058 @@
+/*
+ * Scheduler Simulator - Discrete-Event Model of the TC Scheduling Path
+ *
+ * Replays a synthetic flow mix through the scheduling functions shared with
+ * tc_scheduler.c (src/common/sched_core.h) in front of a single output link:
+ * - Every arriving packet gets the same per-packet decision the TC program
+ *   makes (queue id, virtual finish time, deficit admission, PIFO rank)
+ * - The link then serves the tagged packets in the order the algorithm
+ *   intends (priority bands, round robin, min finish time, DRR, min rank)
+ * - Classes with an AQM run CoDel/PIE on the real sojourn time at dequeue;
+ *   simulated sources are not ECN-capable, so every AQM signal is a drop
+ *   (and DualPI2 classes only ever see classic traffic)
+ * - Per-class throughput, delay and Jain's fairness index are reported
+ *
+ * Everything runs natively on one core, so scheduler changes can be
+ * evaluated for millions of flows before they are deployed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <json-c/json.h>
+
+#include "../common/common.h"
+#include "../common/sched_core.h"
+
+#define DEFAULT_CONFIG_PATH "configs/default.json"
+#define DEFAULT_LINK_RATE 1000000000ULL    /* 1 Gbps */
+#define DEFAULT_DURATION 10.0              /* seconds */
+#define DEFAULT_PKT_SIZE 1500
+#define MAX_FLOW_SPECS 64
+
+/* Delay histogram: log2 buckets split into 8 linear sub-buckets (~12%) */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+#define NIL (-1)
+
+enum arrival_pattern {
+    ARRIVAL_CBR = 0,
+    ARRIVAL_POISSON = 1,
+};
+
+/* Flow mix entry from the command line */
+struct flow_spec {
+    __u32 class_id;
+    __u32 count;
+    __u64 rate_bps;
+    __u32 pkt_size;
+    __u32 pattern;
+};
+
+/* Simulated packet (lives in exactly one FIFO or heap at a time) */
+struct sim_pkt {
+    __u64 arrival;
+    __u64 tag;              /* VFT (WFQ) or rank (PIFO) */
+    __u64 seq;              /* Tie breaker: arrival order */
+    __u32 flow;
+    __u32 len;
+    __s32 next;
+};
+
+struct pkt_fifo {
+    __s32 head;
+    __s32 tail;
+};
+
+/* Pending arrival of a flow's next packet */
+struct arrival_ev {
+    __u64 when;
+    __u32 flow;
+};
+
+/* Simulated flow: traffic source plus the datapath's per-flow state */
+struct sim_flow {
+    __u64 interval_ns;      /* Mean packet inter-arrival time */
+    __u32 class_id;
+    __u32 pkt_len;
+    __u32 pattern;
+    struct flow_state st;   /* Same record the TC program sees */
+    __u32 enq_deficit;      /* drr_deficit map entry */
+    __u8 enq_seeded;        /* ...which the first DRR packet creates */
+    __u32 deq_deficit;      /* DRR service deficit */
+    struct pkt_fifo fifo;   /* Per-flow queue (DRR service) */
+    __s32 next_active;
+    __u8 active;
+    __u8 visited;
+    __u64 sent_bytes;
+};
+
+/* Simulated traffic class */
+struct sim_class {
+    struct class_config cfg;
+    char name[32];
+    int configured;
+    __u32 rr_cursor;        /* rr_state map entry */
+    __u64 wfq_vtime;        /* wfq_vtime map entry */
+    __u64 sp_last_service;  /* Starvation protection timestamp */
+    __u32 backlog;
+    __u64 backlog_bytes;
+    __u32 rr_serve;         /* Service cursor across this class's queues */
+    struct pkt_fifo rr_fifo[MAX_QUEUES_PER_CLASS];
+    struct aqm_state aqm;   /* aqm_state map entry */
+
+    /* Results */
+    __u32 nflows;
+    __u64 offered_pkts;
+    __u64 offered_bytes;
+    __u64 sent_pkts;
+    __u64 sent_bytes;
+    __u64 dropped_pkts;
+    __u64 dropped_bytes;
+    __u64 aqm_dropped;
+    __u64 delay_sum_ns;
+    __u64 delay_max_ns;
+    __u64 delay_hist[HIST_BUCKETS];
+};
+
+struct sim {
+    struct global_config gcfg;
+    struct sim_class classes[MAX_CLASSES];
+    struct sim_flow *flows;
+    __u32 nflows;
+    struct sim_pkt *pkts;
+    __u32 npkts;
+    __s32 free_pkt;
+    __u64 seq;
+    __u64 link_rate;
+    __u64 duration_ns;
+    __u32 queue_limit;
+    __u32 backlog;
+
+    /* Arrival heap */
+    struct arrival_ev *arrivals;
+    __u32 narrivals;
+
+    /* Service heap for WFQ/PIFO (packet indices keyed by tag) */
+    __s32 *service;
+    __u32 nservice;
+
+    /* Strict priority bands (queue ids) */
+    struct pkt_fifo bands[MAX_QUEUES_PER_CLASS];
+
+    /* Round robin cursor across classes */
+    __u32 rr_class;
+
+    /* DRR active flow list */
+    __s32 active_head;
+    __s32 active_tail;
+
+    __u64 rng;
+};
+
+static const char *class_default_names[MAX_CLASSES] = {
+    "control", "gaming", "voip", "video", "web", "bulk", "background", "default",
+};
+
+/* xorshift64* - fast, reproducible, good enough for arrival processes */
+static double sim_random(struct sim *s)
+{
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return ((s->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static __u64 next_interval(struct sim *s, struct sim_flow *f)
+{
+    if (f->pattern == ARRIVAL_POISSON) {
+        double u = sim_random(s);
+        return (__u64)(-log(1.0 - u) * (double)f->interval_ns) + 1;
+    }
+    return f->interval_ns;
+}
+
+/* Packet pool */
+static __s32 pkt_alloc(struct sim *s)
+{
+    __s32 idx = s->free_pkt;
+
+    if (idx != NIL)
+        s->free_pkt = s->pkts[idx].next;
+    return idx;
+}
+
+static void pkt_free(struct sim *s, __s32 idx)
+{
+    s->pkts[idx].next = s->free_pkt;
+    s->free_pkt = idx;
+}
+
+static void fifo_init(struct pkt_fifo *q)
+{
+    q->head = q->tail = NIL;
+}
+
+static void fifo_push(struct sim *s, struct pkt_fifo *q, __s32 idx)
+{
+    s->pkts[idx].next = NIL;
+    if (q->tail == NIL)
+        q->head = idx;
+    else
+        s->pkts[q->tail].next = idx;
+    q->tail = idx;
+}
+
+static __s32 fifo_pop(struct sim *s, struct pkt_fifo *q)
+{
+    __s32 idx = q->head;
+
+    if (idx == NIL)
+        return NIL;
+    q->head = s->pkts[idx].next;
+    if (q->head == NIL)
+        q->tail = NIL;
+    return idx;
+}
+
+/*
+ * Arrival heap: 4-ary min-heap with the timestamp stored inline, so sifting
+ * through millions of flows touches one cache line per level instead of
+ * chasing each flow record.
+ */
+#define ARRIVAL_FANOUT 4
+
+static void arrival_sift_down(struct sim *s, __u32 i)
+{
+    struct arrival_ev ev = s->arrivals[i];
+
+    for (;;) {
+        __u32 first = ARRIVAL_FANOUT * i + 1, m = i;
+        __u64 best = ev.when;
+
+        for (__u32 c = first; c < first + ARRIVAL_FANOUT && c < s->narrivals; c++) {
+            if (s->arrivals[c].when < best) {
+                best = s->arrivals[c].when;
+                m = c;
+            }
+        }
+        if (m == i)
+            break;
+        s->arrivals[i] = s->arrivals[m];
+        i = m;
+    }
+    s->arrivals[i] = ev;
+}
+
+/* Service heap */
+static int service_less(struct sim *s, __s32 a, __s32 b)
+{
+    if (s->pkts[a].tag != s->pkts[b].tag)
+        return s->pkts[a].tag < s->pkts[b].tag;
+    return s->pkts[a].seq < s->pkts[b].seq;
+}
+
+static void service_push(struct sim *s, __s32 idx)
+{
+    __u32 i = s->nservice++;
+
+    s->service[i] = idx;
+    while (i > 0) {
+        __u32 p = (i - 1) / 2;
+        __s32 tmp;
+
+        if (!service_less(s, s->service[i], s->service[p]))
+            break;
+        tmp = s->service[i];
+        s->service[i] = s->service[p];
+        s->service[p] = tmp;
+        i = p;
+    }
+}
+
+static __s32 service_pop(struct sim *s)
+{
+    __s32 top;
+    __u32 i = 0;
+
+    if (!s->nservice)
+        return NIL;
+
+    top = s->service[0];
+    s->service[0] = s->service[--s->nservice];
+    for (;;) {
+        __u32 l = 2 * i + 1, r = l + 1, m = i;
+        __s32 tmp;
+
+        if (l < s->nservice && service_less(s, s->service[l], s->service[m]))
+            m = l;
+        if (r < s->nservice && service_less(s, s->service[r], s->service[m]))
+            m = r;
+        if (m == i)
+            break;
+        tmp = s->service[i];
+        s->service[i] = s->service[m];
+        s->service[m] = tmp;
+        i = m;
+    }
+    return top;
+}
+
+/*
+ * Enqueue: apply the TC program's per-packet decision, then place the
+ * packet where the link will find it. Returns 0 if the packet was dropped.
+ */
+static int sim_enqueue(struct sim *s, __u32 flow_idx, __u64 now)
+{
+    struct sim_flow *f = &s->flows[flow_idx];
+    struct sim_class *cls = &s->classes[f->class_id];
+    struct class_config *cfg = &cls->cfg;
+    __u32 quantum = s->gcfg.quantum;
+    struct sim_pkt *p;
+    __u32 queue_id;
+    __s32 idx;
+
+    cls->offered_pkts++;
+    cls->offered_bytes += f->pkt_len;
+
+    f->st.packet_count++;
+    f->st.byte_count += f->pkt_len;
+    f->st.last_seen = now;
+
+    if (cls->backlog >= s->queue_limit)
+        goto drop;
+
+    idx = pkt_alloc(s);
+    if (idx == NIL)
+        goto drop;
+
+    p = &s->pkts[idx];
+    p->arrival = now;
+    p->flow = flow_idx;
+    p->len = f->pkt_len;
+    p->tag = 0;
+    p->seq = s->seq++;
+
+    switch (s->gcfg.sched_algorithm) {
+    case SCHED_ROUND_ROBIN:
+        queue_id = sched_rr_next(&cls->rr_cursor);
+        fifo_push(s, &cls->rr_fifo[queue_id], idx);
+        break;
+
+    case SCHED_WEIGHTED_FAIR_QUEUING:
+        p->tag = sched_wfq_finish(cls->wfq_vtime, p->len,
+                                  cfg->weight ? cfg->weight : 1);
+        cls->wfq_vtime = p->tag;
+        service_push(s, idx);
+        break;
+
+    case SCHED_STRICT_PRIORITY:
+        queue_id = sched_sp_queue(cfg->priority);
+        if (sched_sp_starved(cfg->priority, now, &cls->sp_last_service,
+                             s->gcfg.starvation_threshold))
+            queue_id = 0;
+        fifo_push(s, &s->bands[queue_id], idx);
+        break;
+
+    case SCHED_DEFICIT_ROUND_ROBIN:
+        if (!f->enq_seeded) {
+            f->enq_deficit = sched_drr_initial(quantum);
+            f->enq_seeded = 1;
+        }
+        if (!sched_drr_admit(&f->enq_deficit, quantum, p->len)) {
+            pkt_free(s, idx);
+            goto drop;
+        }
+        fifo_push(s, &f->fifo, idx);
+        if (!f->active) {
+            f->active = 1;
+            f->next_active = NIL;
+            if (s->active_tail == NIL)
+                s->active_head = flow_idx;
+            else
+                s->flows[s->active_tail].next_active = flow_idx;
+            s->active_tail = flow_idx;
+        }
+        break;
+
+    case SCHED_PIFO:
+    default:
+        p->tag = sched_pifo_rank(cfg->priority, now);
+        service_push(s, idx);
+        break;
+    }
+
+    cls->backlog++;
+    cls->backlog_bytes += p->len;
+    s->backlog++;
+    return 1;
+
+drop:
+    cls->dropped_pkts++;
+    cls->dropped_bytes += f->pkt_len;
+    return 0;
+}
+
+static __s32 dequeue_round_robin(struct sim *s)
+{
+    for (__u32 n = 0; n < MAX_CLASSES; n++) {
+        struct sim_class *cls = &s->classes[s->rr_class];
+
+        s->rr_class = (s->rr_class + 1) % MAX_CLASSES;
+        if (!cls->backlog)
+            continue;
+
+        for (__u32 q = 0; q < MAX_QUEUES_PER_CLASS; q++) {
+            __s32 idx = fifo_pop(s, &cls->rr_fifo[cls->rr_serve]);
+
+            cls->rr_serve = (cls->rr_serve + 1) % MAX_QUEUES_PER_CLASS;
+            if (idx != NIL)
+                return idx;
+        }
+    }
+    return NIL;
+}
+
+static __s32 dequeue_strict_priority(struct sim *s)
+{
+    for (__u32 band = 0; band < MAX_QUEUES_PER_CLASS; band++) {
+        __s32 idx = fifo_pop(s, &s->bands[band]);
+
+        if (idx != NIL)
+            return idx;
+    }
+    return NIL;
+}
+
+static __s32 dequeue_drr(struct sim *s)
+{
+    __u32 quantum = s->gcfg.quantum ? s->gcfg.quantum : SCHED_DEFAULT_QUANTUM;
+
+    while (s->active_head != NIL) {
+        __s32 fidx = s->active_head;
+        struct sim_flow *f = &s->flows[fidx];
+        __s32 idx = f->fifo.head;
+
+        if (!f->visited) {
+            f->deq_deficit += quantum;
+            f->visited = 1;
+        }
+
+        if (sched_drr_charge(&f->deq_deficit, s->pkts[idx].len)) {
+            fifo_pop(s, &f->fifo);
+            if (f->fifo.head == NIL) {
+                /* Flow went idle: leave the active list, forget deficit */
+                s->active_head = f->next_active;
+                if (s->active_head == NIL)
+                    s->active_tail = NIL;
+                f->active = 0;
+                f->visited = 0;
+                f->deq_deficit = 0;
+            }
+            return idx;
+        }
+
+        /* Quantum exhausted: move to the tail of the round */
+        f->visited = 0;
+        if (f->next_active != NIL) {
+            s->active_head = f->next_active;
+            f->next_active = NIL;
+            s->flows[s->active_tail].next_active = fidx;
+            s->active_tail = fidx;
+        }
+    }
+    return NIL;
+}
+
+static __s32 sim_dequeue(struct sim *s)
+{
+    switch (s->gcfg.sched_algorithm) {
+    case SCHED_ROUND_ROBIN:
+        return dequeue_round_robin(s);
+    case SCHED_STRICT_PRIORITY:
+        return dequeue_strict_priority(s);
+    case SCHED_DEFICIT_ROUND_ROBIN:
+        return dequeue_drr(s);
+    case SCHED_WEIGHTED_FAIR_QUEUING:
+    case SCHED_PIFO:
+    default:
+        return service_pop(s);
+    }
+}
+
+static __u32 hist_bucket(__u64 ns)
+{
+    __u32 msb;
+
+    if (ns < (1 << HIST_SUB_BITS))
+        return (__u32)ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           (__u32)((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static __u64 hist_value(__u32 bucket)
+{
+    __u32 exp = bucket >> HIST_SUB_BITS;
+    __u64 sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+
+    if (!exp)
+        return sub;
+    return ((1ULL << HIST_SUB_BITS) | sub) << (exp - 1);
+}
+
+static __u64 hist_percentile(const struct sim_class *cls, double pct)
+{
+    __u64 target = (__u64)ceil(cls->sent_pkts * pct);
+    __u64 seen = 0;
+
+    for (__u32 b = 0; b + 1 < HIST_BUCKETS; b++) {
+        seen += cls->delay_hist[b];
+        if (seen >= target && seen) {
+            /* Upper edge of the bucket, never above the observed maximum */
+            __u64 upper = hist_value(b + 1) - 1;
+            return upper < cls->delay_max_ns ? upper : cls->delay_max_ns;
+        }
+    }
+    return cls->delay_max_ns;
+}
+
+static void sim_transmit(struct sim *s, __s32 idx, __u64 done)
+{
+    struct sim_pkt *p = &s->pkts[idx];
+    struct sim_flow *f = &s->flows[p->flow];
+    struct sim_class *cls = &s->classes[f->class_id];
+    __u64 delay = done - p->arrival;
+
+    cls->sent_pkts++;
+    cls->sent_bytes += p->len;
+    cls->delay_sum_ns += delay;
+    if (delay > cls->delay_max_ns)
+        cls->delay_max_ns = delay;
+    cls->delay_hist[hist_bucket(delay)]++;
+    f->sent_bytes += p->len;
+
+    cls->backlog--;
+    cls->backlog_bytes -= p->len;
+    s->backlog--;
+    pkt_free(s, idx);
+}
+
+/*
+ * AQM at dequeue, on the sojourn time the packet actually saw. Returns 1 if
+ * the packet was dropped (and freed).
+ */
+static int sim_aqm_drop(struct sim *s, __s32 idx, __u64 now)
+{
+    struct sim_pkt *p = &s->pkts[idx];
+    struct sim_class *cls = &s->classes[s->flows[p->flow].class_id];
+    __u32 rnd = (__u32)(sim_random(s) * 4294967296.0);
+
+    if (cls->cfg.aqm == AQM_NONE)
+        return 0;
+
+    /* Backlog left behind once this packet is gone (all of it classic) */
+    cls->aqm.vq_bytes = cls->backlog_bytes - p->len;
+    cls->aqm.qdelay_c = now - p->arrival;
+    if (aqm_decide(&cls->aqm, &cls->cfg, now, now - p->arrival, rnd, 0) ==
+        AQM_PASS)
+        return 0;
+
+    cls->aqm_dropped++;
+    cls->dropped_pkts++;
+    cls->dropped_bytes += p->len;
+    cls->backlog--;
+    cls->backlog_bytes -= p->len;
+    s->backlog--;
+    pkt_free(s, idx);
+    return 1;
+}
+
+/* Main event loop: arrivals from the heap, departures from the link */
+static void sim_run(struct sim *s)
+{
+    __u64 link_free_at = 0;
+
+    for (;;) {
+        __u64 next_arrival = s->narrivals ? s->arrivals[0].when : ~0ULL;
+
+        /* Link can start a transmission before the next arrival */
+        if (s->backlog && link_free_at <= next_arrival) {
+            __s32 idx = sim_dequeue(s);
+            __u64 tx_ns;
+
+            if (idx == NIL)
+                break;
+            if (sim_aqm_drop(s, idx, link_free_at))
+                continue;
+
+            tx_ns = (__u64)s->pkts[idx].len * 8 * NSEC_PER_SEC / s->link_rate;
+            link_free_at += tx_ns;
+            if (link_free_at > s->duration_ns)
+                break;
+            sim_transmit(s, idx, link_free_at);
+            continue;
+        }
+
+        if (next_arrival >= s->duration_ns)
+            break;
+
+        /* Idle link starts when the next packet shows up */
+        if (!s->backlog && link_free_at < next_arrival)
+            link_free_at = next_arrival;
+
+        __u32 fidx = s->arrivals[0].flow;
+
+        sim_enqueue(s, fidx, next_arrival);
+        s->arrivals[0].when += next_interval(s, &s->flows[fidx]);
+        arrival_sift_down(s, 0);
+    }
+}
+
+/* Jain's fairness index over per-flow throughput, optionally weight-normalized */
+static double jain_index(struct sim *s, int class_id, int normalize)
+{
+    double sum = 0, sum_sq = 0;
+    __u64 n = 0;
+
+    for (__u32 i = 0; i < s->nflows; i++) {
+        struct sim_flow *f = &s->flows[i];
+        double x = (double)f->sent_bytes;
+
+        if (class_id >= 0 && f->class_id != (__u32)class_id)
+            continue;
+        if (normalize)
+            x /= (s->classes[f->class_id].cfg.weight ?
+                  s->classes[f->class_id].cfg.weight : 1);
+        sum += x;
+        sum_sq += x * x;
+        n++;
+    }
+
+    if (!n || sum_sq == 0)
+        return 1.0;
+    return (sum * sum) / ((double)n * sum_sq);
+}
+
+static const char *sched_name(__u32 algo)
+{
+    switch (algo) {
+    case SCHED_ROUND_ROBIN: return "round_robin";
+    case SCHED_WEIGHTED_FAIR_QUEUING: return "wfq";
+    case SCHED_STRICT_PRIORITY: return "strict_priority";
+    case SCHED_DEFICIT_ROUND_ROBIN: return "drr";
+    case SCHED_PIFO: return "pifo";
+    default: return "unknown";
+    }
+}
+
+static const char *aqm_name(__u32 aqm)
+{
+    switch (aqm) {
+    case AQM_CODEL: return "codel";
+    case AQM_PIE: return "pie";
+    case AQM_DUALPI2: return "dualpi2";
+    default: return "none";
+    }
+}
+
+static int parse_sched_name(const char *sched, __u32 *algo)
+{
+    if (strcmp(sched, "round_robin") == 0)
+        *algo = SCHED_ROUND_ROBIN;
+    else if (strcmp(sched, "wfq") == 0)
+        *algo = SCHED_WEIGHTED_FAIR_QUEUING;
+    else if (strcmp(sched, "strict_priority") == 0)
+        *algo = SCHED_STRICT_PRIORITY;
+    else if (strcmp(sched, "drr") == 0)
+        *algo = SCHED_DEFICIT_ROUND_ROBIN;
+    else if (strcmp(sched, "pifo") == 0)
+        *algo = SCHED_PIFO;
+    else
+        return -1;
+    return 0;
+}
+
+static void print_results(struct sim *s)
+{
+    double secs = (double)s->duration_ns / NSEC_PER_SEC;
+    __u64 total_bytes = 0;
+
+    printf("\n===== Simulation: %s, %u flows, %.3f Gbps link, %.1f s =====\n",
+           sched_name(s->gcfg.sched_algorithm), s->nflows,
+           s->link_rate / 1e9, secs);
+    printf("%-11s %7s %12s %12s %8s %10s %10s %10s %7s\n",
+           "Class", "Flows", "Offered", "Throughput", "Drop%",
+           "AvgDelay", "P99Delay", "MaxDelay", "Jain");
+
+    for (int i = 0; i < MAX_CLASSES; i++) {
+        struct sim_class *cls = &s->classes[i];
+        double drop_pct;
+
+        if (!cls->nflows)
+            continue;
+
+        drop_pct = cls->offered_pkts ?
+            100.0 * cls->dropped_pkts / cls->offered_pkts : 0.0;
+        total_bytes += cls->sent_bytes;
+
+        printf("%-11s %7u %9.2f Mb %9.2f Mb %7.2f%% %8.1fus %8.1fus %8.1fus %7.4f\n",
+               cls->name, cls->nflows,
+               cls->offered_bytes * 8 / secs / 1e6,
+               cls->sent_bytes * 8 / secs / 1e6,
+               drop_pct,
+               cls->sent_pkts ? cls->delay_sum_ns / 1e3 / cls->sent_pkts : 0.0,
+               hist_percentile(cls, 0.99) / 1e3,
+               cls->delay_max_ns / 1e3,
+               jain_index(s, i, 0));
+    }
+
+    for (int i = 0; i < MAX_CLASSES; i++) {
+        struct sim_class *cls = &s->classes[i];
+
+        if (cls->nflows && cls->cfg.aqm != AQM_NONE)
+            printf("%-11s AQM (%s) dropped %llu packets\n", cls->name,
+                   aqm_name(cls->cfg.aqm),
+                   cls->aqm_dropped);
+    }
+
+    printf("\nLink utilization:            %.2f%%\n",
+           100.0 * total_bytes * 8 / secs / s->link_rate);
+    printf("Jain's index (all flows):    %.4f\n", jain_index(s, -1, 0));
+    printf("Jain's index (per weight):   %.4f\n", jain_index(s, -1, 1));
+    printf("\n");
+}
+
+/* Load global and class parameters from a scheduler profile */
+static int load_profile(struct sim *s, const char *config_file)
+{
+    struct json_object *root, *obj, *classes;
+
+    root = json_object_from_file(config_file);
+    if (!root) {
+        fprintf(stderr, "Error parsing JSON file: %s\n", config_file);
+        return -1;
+    }
+
+    if (json_object_object_get_ex(root, "global", &obj)) {
+        struct json_object *tmp;
+
+        if (json_object_object_get_ex(obj, "scheduler", &tmp))
+            parse_sched_name(json_object_get_string(tmp),
+                             &s->gcfg.sched_algorithm);
+
+        if (json_object_object_get_ex(obj, "default_class", &tmp))
+            s->gcfg.default_class = json_object_get_int(tmp);
+
+        if (json_object_object_get_ex(obj, "quantum", &tmp))
+            s->gcfg.quantum = json_object_get_int(tmp);
+
+        if (json_object_object_get_ex(obj, "starvation_threshold", &tmp))
+            s->gcfg.starvation_threshold = json_object_get_int(tmp);
+
+        if (json_object_object_get_ex(obj, "total_rate_limit", &tmp))
+            s->gcfg.total_rate_limit = json_object_get_int(tmp);
+    }
+
+    if (json_object_object_get_ex(root, "classes", &classes)) {
+        int n_classes = json_object_array_length(classes);
+
+        for (int i = 0; i < n_classes; i++) {
+            struct json_object *cls = json_object_array_get_idx(classes, i);
+            struct class_config cfg = {0};
+            struct json_object *tmp;
+
+            if (json_object_object_get_ex(cls, "id", &tmp))
+                cfg.id = json_object_get_int(tmp);
+            if (cfg.id >= MAX_CLASSES)
+                continue;
+
+            if (json_object_object_get_ex(cls, "rate_limit", &tmp))
+                cfg.rate_limit = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "burst_size", &tmp))
+                cfg.burst_size = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "priority", &tmp))
+                cfg.priority = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "weight", &tmp))
+                cfg.weight = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "min_bandwidth", &tmp))
+                cfg.min_bandwidth = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "max_bandwidth", &tmp))
+                cfg.max_bandwidth = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "aqm", &tmp)) {
+                const char *aqm = json_object_get_string(tmp);
+                if (strcmp(aqm, "codel") == 0)
+                    cfg.aqm = AQM_CODEL;
+                else if (strcmp(aqm, "pie") == 0)
+                    cfg.aqm = AQM_PIE;
+                else if (strcmp(aqm, "dualpi2") == 0)
+                    cfg.aqm = AQM_DUALPI2;
+            }
+            if (json_object_object_get_ex(cls, "aqm_target_us", &tmp))
+                cfg.aqm_target_us = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "aqm_interval_us", &tmp))
+                cfg.aqm_interval_us = json_object_get_int(tmp);
+            if (json_object_object_get_ex(cls, "aqm_step_us", &tmp))
+                cfg.aqm_step_us = json_object_get_int(tmp);
+
+            s->classes[cfg.id].cfg = cfg;
+            s->classes[cfg.id].configured = 1;
+            if (json_object_object_get_ex(cls, "name", &tmp))
+                snprintf(s->classes[cfg.id].name,
+                         sizeof(s->classes[cfg.id].name), "%s",
+                         json_object_get_string(tmp));
+        }
+    }
+
+    json_object_put(root);
+    return 0;
+}
+
+/* Parse a rate with optional k/M/G suffix (bits per second) */
+static __u64 parse_rate(const char *str)
+{
+    char *end;
+    double val = strtod(str, &end);
+
+    switch (*end) {
+    case 'k': case 'K': val *= 1e3; break;
+    case 'm': case 'M': val *= 1e6; break;
+    case 'g': case 'G': val *= 1e9; break;
+    default: break;
+    }
+    return (__u64)val;
+}
+
+/* CLASS:COUNT:RATE[:SIZE[:cbr|poisson]] */
+static int parse_flow_spec(const char *arg, struct flow_spec *spec)
+{
+    char buf[128], *tok, *save = NULL;
+    int field = 0;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    spec->pkt_size = DEFAULT_PKT_SIZE;
+    spec->pattern = ARRIVAL_POISSON;
+
+    for (tok = strtok_r(buf, ":", &save); tok; tok = strtok_r(NULL, ":", &save)) {
+        switch (field++) {
+        case 0: spec->class_id = atoi(tok); break;
+        case 1: spec->count = strtoul(tok, NULL, 0); break;
+        case 2: spec->rate_bps = parse_rate(tok); break;
+        case 3: spec->pkt_size = atoi(tok); break;
+        case 4:
+            if (strcmp(tok, "cbr") == 0)
+                spec->pattern = ARRIVAL_CBR;
+            else if (strcmp(tok, "poisson") == 0)
+                spec->pattern = ARRIVAL_POISSON;
+            else
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (field < 3 || spec->class_id >= MAX_CLASSES || !spec->count ||
+        !spec->rate_bps || spec->pkt_size < 64 || spec->pkt_size > 65535)
+        return -1;
+    return 0;
+}
+
+static int sim_setup(struct sim *s, struct flow_spec *specs, int nspecs)
+{
+    __u32 idx = 0;
+
+    for (int i = 0; i < nspecs; i++)
+        s->nflows += specs[i].count;
+
+    s->npkts = MAX_CLASSES * s->queue_limit;
+    s->flows = calloc(s->nflows, sizeof(*s->flows));
+    s->arrivals = calloc(s->nflows, sizeof(*s->arrivals));
+    s->pkts = calloc(s->npkts, sizeof(*s->pkts));
+    s->service = calloc(s->npkts, sizeof(*s->service));
+    if (!s->flows || !s->arrivals || !s->pkts || !s->service) {
+        fprintf(stderr, "Error allocating simulator state: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    /* Free packet list */
+    for (__u32 i = 0; i < s->npkts; i++)
+        s->pkts[i].next = (i + 1 < s->npkts) ? (__s32)(i + 1) : NIL;
+    s->free_pkt = 0;
+
+    for (int c = 0; c < MAX_CLASSES; c++) {
+        struct sim_class *cls = &s->classes[c];
+
+        if (!cls->name[0])
+            snprintf(cls->name, sizeof(cls->name), "%s", class_default_names[c]);
+        for (int q = 0; q < MAX_QUEUES_PER_CLASS; q++)
+            fifo_init(&cls->rr_fifo[q]);
+    }
+    for (int q = 0; q < MAX_QUEUES_PER_CLASS; q++)
+        fifo_init(&s->bands[q]);
+    s->active_head = s->active_tail = NIL;
+
+    for (int i = 0; i < nspecs; i++) {
+        struct sim_class *cls = &s->classes[specs[i].class_id];
+
+        if (!cls->configured)
+            fprintf(stderr, "Warning: class %u not in profile, using defaults\n",
+                    specs[i].class_id);
+
+        for (__u32 n = 0; n < specs[i].count; n++, idx++) {
+            struct sim_flow *f = &s->flows[idx];
+
+            f->class_id = specs[i].class_id;
+            f->pkt_len = specs[i].pkt_size;
+            f->pattern = specs[i].pattern;
+            f->interval_ns = (__u64)f->pkt_len * 8 * NSEC_PER_SEC /
+                             specs[i].rate_bps;
+            if (!f->interval_ns)
+                f->interval_ns = 1;
+
+            /* Datapath flow state (weight/priority come from the class) */
+            f->st.class_id = f->class_id;
+            f->fifo.head = f->fifo.tail = NIL;
+            f->next_active = NIL;
+
+            /* Random phase so sources do not start in lockstep */
+            s->arrivals[idx].when = (__u64)(sim_random(s) * f->interval_ns);
+            s->arrivals[idx].flow = idx;
+
+            cls->nflows++;
+        }
+    }
+
+    /* Heapify arrivals */
+    s->narrivals = s->nflows;
+    for (__s64 i = (__s64)s->narrivals / ARRIVAL_FANOUT; i >= 0; i--)
+        arrival_sift_down(s, (__u32)i);
+
+    return 0;
+}
+
+static void sim_cleanup(struct sim *s)
+{
+    free(s->flows);
+    free(s->arrivals);
+    free(s->pkts);
+    free(s->service);
+}
+
+/* Usage information */
+void print_usage(const char *prog)
+{
+    printf("Usage: %s [OPTIONS] -f CLASS:COUNT:RATE[:SIZE[:cbr|poisson]] ...\n", prog);
+    printf("\nOptions:\n");
+    printf("  -c, --config FILE       Scheduler profile (default: %s)\n", DEFAULT_CONFIG_PATH);
+    printf("  -a, --algorithm NAME    Override scheduler (round_robin, wfq, strict_priority, drr, pifo)\n");
+    printf("  -f, --flows SPEC        Add COUNT flows of CLASS sending RATE bits/s each\n");
+    printf("                          (SIZE bytes per packet, default %d, poisson arrivals)\n", DEFAULT_PKT_SIZE);
+    printf("  -r, --link-rate RATE    Output link rate in bits/s, k/M/G suffix (default: 1G)\n");
+    printf("  -d, --duration SECONDS  Simulated time (default: %.0f)\n", DEFAULT_DURATION);
+    printf("  -q, --queue-limit PKTS  Per-class buffer in packets (default: %d)\n", MAX_QUEUE_DEPTH);
+    printf("  -s, --seed N            Random seed (default: 1)\n");
+    printf("  -h, --help              Show this help\n");
+    printf("\nExample:\n");
+    printf("  %s -c configs/gaming.json -r 100M -f 1:50:200k:200 -f 5:1000:1M\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct flow_spec specs[MAX_FLOW_SPECS];
+    char *config_file = DEFAULT_CONFIG_PATH;
+    char *algorithm = NULL;
+    struct sim *s;
+    int nspecs = 0;
+    int opt;
+
+    static struct option long_options[] = {
+        {"config", required_argument, 0, 'c'},
+        {"algorithm", required_argument, 0, 'a'},
+        {"flows", required_argument, 0, 'f'},
+        {"link-rate", required_argument, 0, 'r'},
+        {"duration", required_argument, 0, 'd'},
+        {"queue-limit", required_argument, 0, 'q'},
+        {"seed", required_argument, 0, 's'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        fprintf(stderr, "Error allocating simulator: %s\n", strerror(errno));
+        return 1;
+    }
+    s->link_rate = DEFAULT_LINK_RATE;
+    s->duration_ns = (__u64)(DEFAULT_DURATION * NSEC_PER_SEC);
+    s->queue_limit = MAX_QUEUE_DEPTH;
+    s->rng = 1;
+
+    while ((opt = getopt_long(argc, argv, "c:a:f:r:d:q:s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'a':
+            algorithm = optarg;
+            break;
+        case 'f':
+            if (nspecs >= MAX_FLOW_SPECS ||
+                parse_flow_spec(optarg, &specs[nspecs]) < 0) {
+                fprintf(stderr, "Error: invalid flow spec '%s'\n", optarg);
+                return 1;
+            }
+            nspecs++;
+            break;
+        case 'r':
+            s->link_rate = parse_rate(optarg);
+            break;
+        case 'd':
+            s->duration_ns = (__u64)(atof(optarg) * NSEC_PER_SEC);
+            break;
+        case 'q':
+            s->queue_limit = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            s->rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!nspecs || !s->link_rate || !s->duration_ns || !s->queue_limit) {
+        fprintf(stderr, "Error: at least one flow spec (-f), a link rate, "
+                "duration and queue limit are required\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (load_profile(s, config_file) < 0)
+        return 1;
+
+    if (algorithm && parse_sched_name(algorithm, &s->gcfg.sched_algorithm) < 0) {
+        fprintf(stderr, "Error: unknown scheduler '%s'\n", algorithm);
+        return 1;
+    }
+
+    if (sim_setup(s, specs, nspecs) < 0)
+        return 1;
+
+    sim_run(s);
+    print_results(s);
+
+    sim_cleanup(s);
+    free(s);
+    return 0;
+}
@@ -7,12 +7,17 @@
  * - Strict Priority (SP)
  * - Deficit Round Robin (DRR)
  * - PIFO (Push-In First-Out)
+ *
+ * Optionally followed by per-class active queue management (CoDel or PIE)
+ * that ECN-marks ECT packets and drops the rest.
  */
 
 /* Include common types FIRST before BPF headers */
 #include "../common/common.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
+#include "../common/sched_core.h"
+#include "../common/net_helpers.h"
 
 /* TC actions */
 #define TC_ACT_UNSPEC (-1)
@@ -101,6 +106,20 @@ struct __sk_buff {
     __u32 data;
     __u32 data_end;
     __u32 napi_id;
+    __u32 family;
+    __u32 remote_ip4;
+    __u32 local_ip4;
+    __u32 remote_ip6[4];
+    __u32 local_ip6[4];
+    __u32 remote_port;
+    __u32 local_port;
+    __u32 data_meta;
+    union { struct bpf_flow_keys *flow_keys; __u64 :64; } __attribute__((aligned(8)));
+    __u64 tstamp;
+    __u32 wire_len;
+    __u32 gso_segs;
+    union { struct bpf_sock *sk; __u64 :64; } __attribute__((aligned(8)));
+    __u32 gso_size;
 } __attribute__((preserve_access_index));
 
 /* External maps from XDP program */
@@ -111,11 +130,17 @@ struct {
     __type(value, struct flow_state);
 } flow_table SEC(".maps");
 
+/*
+ * Configuration and statistics. tc pins these under its own namespace
+ * (/sys/fs/bpf/tc/globals); the control plane writes the same class and
+ * global configuration here as into the XDP maps.
+ */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
     __uint(max_entries, MAX_CLASSES);
     __type(key, __u32);
     __type(value, struct class_config);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } class_config SEC(".maps");
 
 struct {
@@ -123,6 +148,7 @@ struct {
     __uint(max_entries, 1);
     __type(key, __u32);
     __type(value, struct global_config);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } global_config SEC(".maps");
 
 struct {
@@ -130,10 +156,37 @@ struct {
     __uint(max_entries, MAX_CLASSES);
     __type(key, __u32);
     __type(value, struct queue_stats);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } queue_stats SEC(".maps");
 
+/* Sojourn time histogram, LAT_HIST_BUCKETS counters per class */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, MAX_CLASSES * LAT_HIST_BUCKETS);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} latency_hist SEC(".maps");
+
 /* TC-specific maps */
 
+/* Class by socket mark, cgroup or priority (host egress mode) */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_EGRESS_KEYS);
+    __type(key, struct egress_key);
+    __type(value, __u32);  /* Class id */
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} egress_class SEC(".maps");
+
+/* Scheduling state of local sockets, freed when the socket closes */
+struct {
+    __uint(type, BPF_MAP_TYPE_SK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct sock_state);
+} sock_state SEC(".maps");
+
 /* Round-robin state per class */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
@@ -143,12 +196,13 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } rr_state SEC(".maps");
 
-/* DRR deficit counter per flow */
+/* DRR deficit counter per flow; allocated as used, so only under DRR */
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __uint(max_entries, MAX_FLOWS);
     __type(key, struct flow_tuple);
     __type(value, __u32);  /* Deficit counter */
+    __uint(map_flags, BPF_F_NO_PREALLOC);
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } drr_deficit SEC(".maps");
 
@@ -185,6 +239,67 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } wfq_vtime SEC(".maps");
 
+/* AQM state per class (virtual queue + CoDel/PIE variables) */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CLASSES);
+    __type(key, __u32);
+    __type(value, struct aqm_state);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} aqm_state SEC(".maps");
+
+/* Helper: Locate the IPv4 header of an Ethernet frame */
+static __always_inline struct iphdr *skb_ipv4_header(struct __sk_buff *skb)
+{
+    void *data = (void *)(long)skb->data;
+    void *data_end = (void *)(long)skb->data_end;
+    struct ethhdr *eth = data;
+    struct iphdr *iph;
+    
+    if ((void *)(eth + 1) > data_end)
+        return NULL;
+    
+    if (bpf_ntohs(eth->h_proto) != ETH_P_IP)
+        return NULL;
+    
+    iph = (void *)(eth + 1);
+    if ((void *)(iph + 1) > data_end)
+        return NULL;
+    
+    return iph;
+}
+
+/*
+ * Headers repeated in each segment of a GSO packet: Ethernet, IPv4 and
+ * TCP/UDP. Otherwise, what whole gso_size segments leave over, or a
+ * typical Ethernet/IPv4/TCP header with timestamps.
+ */
+#define GSO_HDR_LEN_DEFAULT 66
+
+static __always_inline __u32 gso_header_len(struct __sk_buff *skb, __u32 segs)
+{
+    void *data_end = (void *)(long)skb->data_end;
+    struct iphdr *iph = skb_ipv4_header(skb);
+    __u32 gso_size = skb->gso_size;
+    __u32 l3_len;
+    
+    if (iph) {
+        l3_len = sizeof(struct ethhdr) + iph->ihl * 4;
+        if (iph->protocol == IPPROTO_TCP) {
+            struct tcphdr *th = (void *)iph + iph->ihl * 4;
+            
+            if ((void *)(th + 1) <= data_end)
+                return l3_len + th->doff * 4;
+        } else if (iph->protocol == IPPROTO_UDP) {
+            return l3_len + sizeof(struct udphdr);
+        }
+    }
+    
+    if (gso_size && skb->len > segs * gso_size)
+        return skb->len - segs * gso_size;
+    return GSO_HDR_LEN_DEFAULT;
+}
+
 /* Helper: Parse packet headers to extract flow tuple */
 static __always_inline int extract_flow_tuple(struct __sk_buff *skb,
                                               struct flow_tuple *flow)
@@ -234,9 +349,54 @@ static __always_inline int extract_flow_tuple(struct __sk_buff *skb,
     return 0;
 }
 
+/*
+ * Classify locally generated traffic by its socket: mark, then cgroup,
+ * then SO_PRIORITY, trying only the key kinds that are configured.
+ * Returns 0 and sets *class_id on a match.
+ */
+static __always_inline int egress_classify(struct __sk_buff *skb,
+                                           struct global_config *gcfg,
+                                           __u32 *class_id)
+{
+    struct egress_key key = {};
+    __u32 *cls;
+    
+    if ((gcfg->flags & GLOBAL_FLAG_EGRESS_MARK) && skb->mark) {
+        key.kind = EGRESS_KEY_MARK;
+        key.value = skb->mark;
+        cls = bpf_map_lookup_elem(&egress_class, &key);
+        if (cls)
+            goto found;
+    }
+    
+    if (gcfg->flags & GLOBAL_FLAG_EGRESS_CGROUP) {
+        key.kind = EGRESS_KEY_CGROUP;
+        key.value = bpf_skb_cgroup_id(skb);
+        cls = bpf_map_lookup_elem(&egress_class, &key);
+        if (cls)
+            goto found;
+    }
+    
+    if (gcfg->flags & GLOBAL_FLAG_EGRESS_PRIO) {
+        key.kind = EGRESS_KEY_PRIORITY;
+        key.value = skb->priority;
+        cls = bpf_map_lookup_elem(&egress_class, &key);
+        if (cls)
+            goto found;
+    }
+    
+    return -1;
+    
+found:
+    if (*cls >= MAX_CLASSES)
+        return -1;
+    *class_id = *cls;
+    return 0;
+}
+
 /* Round Robin Scheduler */
 static __always_inline int schedule_round_robin(struct __sk_buff *skb,
-                                                 struct flow_state *flow_st,
+                                                 __u32 *queue_id,
                                                  __u32 class_id)
 {
     __u32 *rr_idx = bpf_map_lookup_elem(&rr_state, &class_id);
@@ -244,100 +404,95 @@ static __always_inline int schedule_round_robin(struct __sk_buff *skb,
         return TC_ACT_OK;
     
     /* Assign to next queue in round-robin fashion */
-    flow_st->queue_id = *rr_idx;
-    
-    /* Update round-robin state */
-    *rr_idx = (*rr_idx + 1) % MAX_QUEUES_PER_CLASS;
+    *queue_id = sched_rr_next(rr_idx);
     
     return TC_ACT_OK;
 }
 
 /* Weighted Fair Queuing Scheduler */
-static __always_inline int schedule_wfq(struct __sk_buff *skb,
-                                        struct flow_state *flow_st,
+static __always_inline int schedule_wfq(__u32 pkt_len,
+                                        __u32 *queue_id,
                                         struct class_config *cfg,
-                                        __u32 class_id)
+                                        __u32 class_id,
+                                        struct sock_state *sk_st)
 {
     __u64 *vtime = bpf_map_lookup_elem(&wfq_vtime, &class_id);
     if (!vtime)
         return TC_ACT_OK;
     
-    __u32 pkt_len = skb->len;
+    __u64 start = *vtime;
+    
+    /* A socket's packet starts no earlier than its previous one finished */
+    if (sk_st && sk_st->finish_tag > start)
+        start = sk_st->finish_tag;
     
-    /* Calculate virtual finish time: VFT = VT + (packet_len / weight) */
-    __u64 vft = *vtime + (pkt_len / (flow_st->weight ? flow_st->weight : 1));
+    /* Calculate virtual finish time */
+    __u64 vft = sched_wfq_finish(start, pkt_len, cfg->weight ? cfg->weight : 1);
+    if (sk_st)
+        sk_st->finish_tag = vft;
     
     /* Update virtual time to minimum finish time */
     *vtime = vft;
     
     /* Map VFT to queue (simplified) */
-    flow_st->queue_id = (vft % MAX_QUEUES_PER_CLASS);
+    *queue_id = sched_wfq_queue(vft);
     
     return TC_ACT_OK;
 }
 
 /* Strict Priority Scheduler */
 static __always_inline int schedule_strict_priority(struct __sk_buff *skb,
-                                                     struct flow_state *flow_st,
+                                                     __u32 *queue_id,
                                                      struct class_config *cfg,
                                                      struct global_config *gcfg)
 {
     /* Basic priority to queue mapping */
-    flow_st->queue_id = (cfg->priority < MAX_QUEUES_PER_CLASS) ?
-                         cfg->priority : 0;
+    *queue_id = sched_sp_queue(cfg->priority);
     
     /* Optional starvation protection if threshold is configured */
     if (gcfg->starvation_threshold > 0) {
         static __u64 last_low_prio_service = 0;
-        __u64 now = bpf_ktime_get_ns();
-        __u64 threshold_ns = (__u64)gcfg->starvation_threshold * 1000000; /* Convert ms to ns */
         
-        /* If this is lower priority traffic (priority > 2) and it's been too long */
-        if (cfg->priority > 2 && (now - last_low_prio_service > threshold_ns)) {
-            /* Force service for starvation prevention */
-            last_low_prio_service = now;
-            flow_st->queue_id = 0; /* Temporarily boost to highest queue */
-        }
+        /* Lower priority traffic that waited too long gets boosted */
+        if (sched_sp_starved(cfg->priority, bpf_ktime_get_ns(),
+                             &last_low_prio_service,
+                             gcfg->starvation_threshold))
+            *queue_id = 0; /* Temporarily boost to highest queue */
     }
     
     return TC_ACT_OK;
 }
 
 /* Deficit Round Robin Scheduler */
-static __always_inline int schedule_drr(struct __sk_buff *skb,
+static __always_inline int schedule_drr(__u32 pkt_len,
                                        struct flow_tuple *flow,
-                                       struct flow_state *flow_st,
-                                       struct global_config *gcfg)
+                                       struct global_config *gcfg,
+                                       struct sock_state *sk_st)
 {
-    __u32 *deficit = bpf_map_lookup_elem(&drr_deficit, flow);
-    __u32 pkt_len = skb->len;
-    __u32 quantum = gcfg->quantum ? gcfg->quantum : 1500;
+    /* Local sockets carry their deficit with them */
+    __u32 *deficit = sk_st ? &sk_st->deficit :
+                             bpf_map_lookup_elem(&drr_deficit, flow);
+    __u32 quantum = gcfg->quantum ? gcfg->quantum : SCHED_DEFAULT_QUANTUM;
     
     if (!deficit) {
         /* First packet from this flow */
-        __u32 new_deficit = quantum;
+        __u32 new_deficit = sched_drr_initial(quantum);
         bpf_map_update_elem(&drr_deficit, flow, &new_deficit, BPF_ANY);
         deficit = &new_deficit;
     }
     
-    /* Add quantum to deficit */
-    *deficit += quantum;
-    
-    /* Check if deficit is sufficient */
-    if (*deficit >= pkt_len) {
-        *deficit -= pkt_len;
-        flow_st->deficit = *deficit;
+    /* Add quantum to deficit and check if it is sufficient */
+    if (sched_drr_admit(deficit, quantum, pkt_len))
         return TC_ACT_OK;
-    }
     
     /* Not enough deficit - defer packet */
     return TC_ACT_SHOT;  /* Drop for now (in real impl, would enqueue) */
 }
 
 /* PIFO Scheduler */
-static __always_inline int schedule_pifo(struct __sk_buff *skb,
+static __always_inline int schedule_pifo(__u32 pkt_len,
                                         struct flow_tuple *flow,
-                                        struct flow_state *flow_st,
+                                        struct class_config *cfg,
                                         __u32 class_id)
 {
     struct pifo_meta *meta = bpf_map_lookup_elem(&pifo_metadata, &class_id);
@@ -347,13 +502,13 @@ static __always_inline int schedule_pifo(struct __sk_buff *skb,
     __u64 now = bpf_ktime_get_ns();
     
     /* Calculate rank based on priority and arrival time */
-    __u64 rank = ((__u64)flow_st->priority << 48) | (now & 0xFFFFFFFFFFFF);
+    __u64 rank = sched_pifo_rank(cfg->priority, now);
     
     /* Create PIFO entry */
     struct pifo_entry entry = {
         .rank = rank,
         .enqueue_time = now,
-        .packet_len = skb->len,
+        .packet_len = pkt_len,
         .flow_hash = flow->src_ip ^ flow->dst_ip,
     };
     __builtin_memcpy(&entry.flow, flow, sizeof(*flow));
@@ -369,60 +524,287 @@ static __always_inline int schedule_pifo(struct __sk_buff *skb,
     return TC_ACT_OK;
 }
 
+/* Account a packet's sojourn time in the class average and histogram */
+static __always_inline void latency_record(__u32 class_id, __u64 sojourn,
+                                           struct queue_stats *qstats)
+{
+    __u64 us = sojourn / 1000;
+    __u32 key = class_id * LAT_HIST_BUCKETS;
+    __u64 *count;
+    int i;
+    
+    if (qstats)
+        __sync_fetch_and_add(&qstats->total_latency_ns, sojourn);
+    
+    #pragma unroll
+    for (i = 0; i < LAT_HIST_BUCKETS - 1; i++) {
+        if (us < (1ULL << i))
+            break;
+        key++;
+    }
+    
+    count = bpf_map_lookup_elem(&latency_hist, &key);
+    if (count)
+        __sync_fetch_and_add(count, 1);
+}
+
+/*
+ * Active queue management
+ *
+ * The classifier runs before any qdisc, so each class is modelled as a
+ * virtual queue drained at the class rate_limit (or the global
+ * total_rate_limit). Its backlog gives the sojourn time a packet will see,
+ * which drives CoDel or PIE exactly as a real queue would.
+ *
+ * DualPI2 classes split the virtual queue in two: ECT(1) and CE packets
+ * (RFC 9331 L4S identifier) go to a low-latency queue that is served first
+ * and marked on a shallow step, classic traffic to a PI2-controlled queue.
+ */
+static __always_inline int apply_aqm(struct __sk_buff *skb, __u32 wire_len,
+                                     struct class_config *cfg,
+                                     struct global_config *gcfg,
+                                     struct queue_stats *qstats,
+                                     __u32 class_id)
+{
+    struct aqm_state *st;
+    struct iphdr *iph;
+    __u64 rate = cfg->rate_limit ? cfg->rate_limit : gcfg->total_rate_limit;
+    __u64 now, sojourn;
+    __u32 rnd;
+    __u8 ecn;
+    int verdict, ect, l4s;
+    
+    if (!rate)
+        return TC_ACT_OK;
+    
+    st = bpf_map_lookup_elem(&aqm_state, &class_id);
+    if (!st)
+        return TC_ACT_OK;
+    
+    iph = skb_ipv4_header(skb);
+    ecn = iph ? iph->tos & INET_ECN_MASK : INET_ECN_NOT_ECT;
+    l4s = cfg->aqm == AQM_DUALPI2 &&
+          (ecn == INET_ECN_ECT_1 || ecn == INET_ECN_CE);
+    /* L4S traffic is ECN-capable by definition */
+    ect = l4s || ((cfg->flags & CLASS_FLAG_ECN) && ecn != INET_ECN_NOT_ECT);
+    now = bpf_ktime_get_ns();
+    rnd = bpf_get_prandom_u32();
+    
+    bpf_spin_lock(&st->lock);
+    if (cfg->aqm == AQM_DUALPI2)
+        sojourn = aqm_dualq_sojourn(st, now, rate, l4s);
+    else
+        sojourn = aqm_vq_sojourn(st, now, rate);
+    verdict = aqm_decide(st, cfg, now, sojourn, rnd, l4s);
+    if (verdict == AQM_PASS || (verdict == AQM_SIGNAL && ect))
+        aqm_vq_enqueue(st, wire_len, l4s);
+    bpf_spin_unlock(&st->lock);
+    
+    if (l4s && qstats && verdict != AQM_DROP)
+        __sync_fetch_and_add(&qstats->l4s_packets, 1);
+    
+    if (verdict == AQM_PASS) {
+        latency_record(class_id, sojourn, qstats);
+        return TC_ACT_OK;
+    }
+    
+    /* Congestion signal: mark ECN-capable packets, drop the rest */
+    if (verdict == AQM_SIGNAL && ect && iph) {
+        __u8 tos = iph->tos;
+        __sum16 check = iph->check;
+        
+        /* iphdr is packed: rewrite through locals */
+        ipv4_set_ce(&tos, &check);
+        iph->tos = tos;
+        iph->check = check;
+        
+        /* Packets that arrive CE-marked were marked upstream, not here */
+        if (qstats && ecn != INET_ECN_CE) {
+            if (l4s)
+                __sync_fetch_and_add(&qstats->l4s_marked, 1);
+            else
+                __sync_fetch_and_add(&qstats->ecn_marked, 1);
+        }
+        latency_record(class_id, sojourn, qstats);
+        return TC_ACT_OK;
+    }
+    
+    if (qstats)
+        __sync_fetch_and_add(&qstats->aqm_dropped, 1);
+    return TC_ACT_SHOT;
+}
+
+/* Scheduling state of the packet's local socket, or NULL if it has none */
+static __always_inline struct sock_state *sock_state_get(struct __sk_buff *skb)
+{
+    struct bpf_sock *sk = skb->sk;
+    
+    if (!sk)
+        return NULL;
+    
+    sk = bpf_sk_fullsock(sk);
+    if (!sk)
+        return NULL;
+    
+    return bpf_sk_storage_get(&sock_state, sk, NULL,
+                              BPF_SK_STORAGE_GET_F_CREATE);
+}
+
+/*
+ * Earliest departure time pacing of a socket at the class pacing_rate.
+ * The timestamp is honoured by an fq qdisc below; an earlier timestamp
+ * from the stack (e.g. TCP pacing) is only ever pushed later.
+ */
+static __always_inline void sock_pace(struct __sk_buff *skb, __u32 wire_len,
+                                       struct sock_state *sk_st,
+                                       __u32 rate, __u64 now)
+{
+    __u64 ts = sk_st->pacing_ts > now ? sk_st->pacing_ts : now;
+    
+    if (skb->tstamp < ts)
+        skb->tstamp = ts;
+    else
+        ts = skb->tstamp;
+    
+    sk_st->pacing_ts = ts + (__u64)wire_len * NSEC_PER_SEC / rate;
+}
+
+/* Rewrite DSCP to the class's marking, keeping the ECN field */
+static __always_inline void rewrite_dscp(struct __sk_buff *skb, __u8 dscp)
+{
+    struct iphdr *iph = skb_ipv4_header(skb);
+    __u8 tos;
+    __sum16 check;
+    
+    if (!iph)
+        return;
+    
+    /* iphdr is packed: rewrite through locals */
+    tos = iph->tos;
+    check = iph->check;
+    ipv4_change_tos(&tos, &check, (dscp << 2) | (tos & INET_ECN_MASK));
+    iph->tos = tos;
+    iph->check = check;
+}
+
+/*
+ * Steer a packet into its class's leaf of the qdisc hierarchy. HTB takes
+ * the class from skb->priority when its major matches the HTB handle, so
+ * no filter runs below us; tc_classid carries the same classid for setups
+ * that attach this program as a filter on the HTB instead. The TX queue
+ * comes from the flow hash so a flow is never reordered across queues.
+ * netdev_pick_tx() runs after clsact and picks the queue itself, but
+ * skb_tx_hash() reads a non-zero queue_mapping as a recorded queue + 1,
+ * so the queue is written in that encoding (XPS must be off, see docs).
+ * A socket's cached queue (sk_tx_queue) still wins over queue_mapping;
+ * after a TCP txhash rethink it can name another queue, whose HTB has a
+ * different major, and the packet then falls into that HTB's default
+ * class. This runs before the queue is picked, so it cannot tell.
+ */
+static __always_inline void steer_to_leaf(struct __sk_buff *skb, __u32 class_id,
+                                          __u32 tx_queues)
+{
+    __u32 txq = ((__u64)bpf_get_hash_recalc(skb) * tx_queues) >> 32;
+    __u32 classid = ((TXQ_HTB_MAJOR + txq) << 16) | (class_id + 1);
+    
+    skb->queue_mapping = txq + 1;
+    skb->tc_classid = classid;
+    skb->priority = classid;
+}
+
 /* Main TC classifier */
 SEC("classifier")
 int tc_packet_scheduler(struct __sk_buff *skb)
 {
     struct flow_tuple flow = {};
     struct flow_state *flow_st;
+    struct sock_state *sk_st;
     struct class_config *cfg;
     struct global_config *gcfg;
     struct queue_stats *qstats;
     __u32 key = 0;
     __u32 class_id;
+    __u32 queue_id = 0;     /* Sub-queue the scheduler picked */
+    __u32 segs, hdr_len, frame_len, wire_len;
+    __u64 now = bpf_ktime_get_ns();
+    int cached = 0;
     int ret;
     
-    /* Extract flow tuple */
-    if (extract_flow_tuple(skb, &flow) < 0)
+    /* Get global configuration */
+    gcfg = bpf_map_lookup_elem(&global_config, &key);
+    if (!gcfg)
         return TC_ACT_OK;
     
-    /* Lookup flow state (should be created by XDP) */
-    flow_st = bpf_map_lookup_elem(&flow_table, &flow);
-    if (!flow_st)
-        return TC_ACT_OK;  /* Unknown flow, pass through */
-    
-    class_id = flow_st->class_id;
+    /*
+     * Locally terminated sockets keep their scheduling state in sk_storage,
+     * with the class cached there. Sockets are classified by mark, cgroup
+     * or priority when configured, otherwise by the flow table XDP fills.
+     * The tuple is still parsed for DRR/PIFO, but may stay empty (IPv6).
+     */
+    sk_st = sock_state_get(skb);
+    if (sk_st && sk_st->classified_at &&
+        now - sk_st->classified_at < SOCK_CLASS_TTL_NS) {
+        class_id = sk_st->class_id;
+        extract_flow_tuple(skb, &flow);
+        cached = 1;
+    } else if ((gcfg->flags & GLOBAL_FLAG_EGRESS_ANY) &&
+               egress_classify(skb, gcfg, &class_id) == 0) {
+        extract_flow_tuple(skb, &flow);
+    } else {
+        /* Extract flow tuple */
+        if (extract_flow_tuple(skb, &flow) < 0)
+            return TC_ACT_OK;
+        
+        /* Lookup flow state (should be created by XDP) */
+        flow_st = bpf_map_lookup_elem(&flow_table, &flow);
+        if (!flow_st)
+            return TC_ACT_OK;  /* Unknown flow, pass through */
+        
+        class_id = flow_st->class_id;
+    }
     
     /* Get class configuration */
     cfg = bpf_map_lookup_elem(&class_config, &class_id);
     if (!cfg)
         return TC_ACT_OK;
     
-    /* Get global configuration */
-    gcfg = bpf_map_lookup_elem(&global_config, &key);
-    if (!gcfg)
-        return TC_ACT_OK;
+    /* Refresh the socket's cached class */
+    if (sk_st && !cached) {
+        /* Moved to another class: its virtual time and deficit start over */
+        if (sk_st->class_id != class_id) {
+            sk_st->finish_tag = 0;
+            sk_st->deficit = 0;
+        }
+        sk_st->class_id = class_id;
+        sk_st->classified_at = now;
+    }
+    
+    /* GSO/GRO packets are charged per segment, at their size on the wire */
+    segs = skb->gso_segs > 1 ? skb->gso_segs : 1;
+    hdr_len = segs > 1 ? gso_header_len(skb, segs) : 0;
+    frame_len = sched_frame_bytes(skb->len, segs, hdr_len);
+    wire_len = sched_wire_bytes(skb->len, segs, hdr_len, gcfg->wire_overhead);
     
     /* Apply scheduling algorithm based on configuration */
     switch (gcfg->sched_algorithm) {
     case SCHED_ROUND_ROBIN:
-        ret = schedule_round_robin(skb, flow_st, class_id);
+        ret = schedule_round_robin(skb, &queue_id, class_id);
         break;
     
     case SCHED_WEIGHTED_FAIR_QUEUING:
-        ret = schedule_wfq(skb, flow_st, cfg, class_id);
+        ret = schedule_wfq(wire_len, &queue_id, cfg, class_id, sk_st);
         break;
     
     case SCHED_STRICT_PRIORITY:
-        ret = schedule_strict_priority(skb, flow_st, cfg, gcfg);
+        ret = schedule_strict_priority(skb, &queue_id, cfg, gcfg);
         break;
     
     case SCHED_DEFICIT_ROUND_ROBIN:
-        ret = schedule_drr(skb, &flow, flow_st, gcfg);
+        ret = schedule_drr(wire_len, &flow, gcfg, sk_st);
         break;
     
     case SCHED_PIFO:
-        ret = schedule_pifo(skb, &flow, flow_st, class_id);
+        ret = schedule_pifo(wire_len, &flow, cfg, class_id);
         break;
     
     default:
@@ -430,20 +812,36 @@ int tc_packet_scheduler(struct __sk_buff *skb)
         break;
     }
     
-    /* Update queue statistics */
     qstats = bpf_map_lookup_elem(&queue_stats, &class_id);
+    
+    /* Active queue management on packets the scheduler accepted */
+    if (ret == TC_ACT_OK && cfg->aqm != AQM_NONE)
+        ret = apply_aqm(skb, wire_len, cfg, gcfg, qstats, class_id);
+    
+    /* Update queue statistics */
     if (qstats) {
         if (ret == TC_ACT_OK) {
-            __sync_fetch_and_add(&qstats->dequeued_packets, 1);
-            __sync_fetch_and_add(&qstats->dequeued_bytes, skb->len);
+            __sync_fetch_and_add(&qstats->dequeued_packets, segs);
+            __sync_fetch_and_add(&qstats->dequeued_bytes, frame_len);
         } else if (ret == TC_ACT_SHOT) {
-            __sync_fetch_and_add(&qstats->dropped_packets, 1);
-            __sync_fetch_and_add(&qstats->dropped_bytes, skb->len);
+            __sync_fetch_and_add(&qstats->dropped_packets, segs);
+            __sync_fetch_and_add(&qstats->dropped_bytes, frame_len);
         }
     }
     
-    /* Set skb priority based on class */
-    skb->priority = cfg->priority;
+    /* Per-socket pacing (earliest departure time) */
+    if (ret == TC_ACT_OK && sk_st && cfg->pacing_rate)
+        sock_pace(skb, wire_len, sk_st, cfg->pacing_rate, now);
+    
+    /* Carry our classification to downstream switches */
+    if (ret == TC_ACT_OK && (cfg->flags & CLASS_FLAG_REWRITE_DSCP))
+        rewrite_dscp(skb, cfg->egress_dscp);
+    
+    /* Straight into the class leaf when the hierarchy is built */
+    if (gcfg->tx_queues && gcfg->tx_queues <= MAX_TX_QUEUES)
+        steer_to_leaf(skb, class_id, gcfg->tx_queues);
+    else
+        skb->priority = cfg->priority;  /* Set skb priority based on class */
     
     return ret;
 }
@@ -10,12 +10,16 @@
 #include "../common/common.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
+#include "../common/net_helpers.h"
 
 /* Linux kernel network headers - simplified for BPF */
 #define ETH_P_IP 0x0800
+#define ETH_P_TEB 0x6558        /* Transparent Ethernet bridging */
 #define IPPROTO_ICMP 1
+#define IPPROTO_IPIP 4
 #define IPPROTO_TCP 6
 #define IPPROTO_UDP 17
+#define IPPROTO_GRE 47
 
 /* XDP actions */
 #define XDP_ABORTED 0
@@ -75,6 +79,69 @@ struct udphdr {
     __sum16 check;
 } __attribute__((packed));
 
+/* VXLAN header (RFC 7348) */
+#define VXLAN_FLAG_VNI 0x08
+
+struct vxlanhdr {
+    __u8 flags;
+    __u8 reserved1[3];
+    __u8 vni[3];
+    __u8 reserved2;
+} __attribute__((packed));
+
+/* GENEVE header (RFC 8926), options follow */
+struct genevehdr {
+    __u8 opt_len;           /* Low 6 bits: options length in 4-byte words */
+    __u8 flags;
+    __be16 protocol;        /* EtherType of the payload */
+    __u8 vni[3];
+    __u8 reserved;
+} __attribute__((packed));
+
+/* GRE header (RFC 2784/2890); checksum, key and sequence are optional */
+#define GRE_CSUM 0x8000
+#define GRE_KEY 0x2000
+#define GRE_SEQ 0x1000
+#define GRE_VERSION 0x0007
+
+struct grehdr {
+    __be16 flags;
+    __be16 protocol;
+} __attribute__((packed));
+
+/*
+ * Load-time configuration (.rodata), set by the control plane before load.
+ * The verifier sees these as constants, so disabled features are pruned
+ * from the program entirely instead of being tested per packet.
+ */
+
+/* Profile 1 in N packets per CPU (0 = profiling compiled out) */
+const volatile __u32 prof_sample_rate = 0;
+
+/* Read the NIC's RX hash and timestamp (needs a device-bound load) */
+const volatile __u32 hw_metadata = 0;
+
+/* Classify tunnel packets on their inner headers */
+const volatile __u32 tunnel_decap = 0;
+
+/* Export flow records; active flows are reported every N seconds (0 = at end only) */
+const volatile __u32 flow_export = 0;
+const volatile __u32 flow_active_timeout = 0;
+
+/*
+ * XDP RX metadata kfuncs. Weak, so the object still loads on kernels
+ * without them; drivers that do not implement them (and programs that
+ * are not device-bound) get -EOPNOTSUPP, and the software paths run.
+ */
+#ifndef bpf_ksym_exists
+#define bpf_ksym_exists(sym) (!!(sym))
+#endif
+
+extern int bpf_xdp_metadata_rx_hash(const struct xdp_md *ctx, __u32 *hash,
+                                    enum xdp_rss_hash_type *rss_type) __ksym __weak;
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+                                         __u64 *timestamp) __ksym __weak;
+
 /* BPF Maps */
 
 /* Flow table: tracks per-flow state */
@@ -86,6 +153,47 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } flow_table SEC(".maps");
 
+/*
+ * Behavioral features of web/default flows still being judged. LRU, so
+ * flows that end before their verdict do not pile up; sized to one entry
+ * by the control plane when behavioral classification is off.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_FLOWS);
+    __type(key, struct flow_tuple);
+    __type(value, struct flow_behav);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_behav SEC(".maps");
+
+/*
+ * Flow export: per-flow accounting beside flow_table, deleted with it by
+ * the control plane's idle sweep, and the ring buffer active-timeout
+ * records go out through. Both are sized down by the control plane when
+ * export is off.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_FLOWS);
+    __type(key, struct flow_tuple);
+    __type(value, struct flow_acct);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_acct SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, FLOW_RECORD_RING_SIZE);
+} flow_records SEC(".maps");
+
+/* Ports and class of fragmented datagrams, from their first fragment */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, FRAG_CACHE_SIZE);
+    __type(key, struct frag_key);
+    __type(value, struct frag_entry);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} frag_cache SEC(".maps");
+
 /* Classification rules */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
@@ -95,6 +203,33 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } class_rules SEC(".maps");
 
+/* Active bank of class_rules */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct rule_set);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} rule_set SEC(".maps");
+
+/* Matches per rule, indexed by class_rule.id */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, RULE_BANK_SIZE);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} rule_hits SEC(".maps");
+
+/* DSCP -> class mapping for traffic marked upstream */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, DSCP_MAX);
+    __type(key, __u32);
+    __type(value, struct dscp_class_entry);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} dscp_class SEC(".maps");
+
 /* Traffic class configuration */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
@@ -113,6 +248,24 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } cpu_stats SEC(".maps");
 
+/* Per-RX-queue statistics */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, MAX_RX_QUEUES);
+    __type(key, __u32);
+    __type(value, struct rxq_stats);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} rxq_stats SEC(".maps");
+
+/* CPU + 1 each RX queue is pinned to (0 = not pinned) */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_RX_QUEUES);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} rxq_cpu SEC(".maps");
+
 /* Global configuration */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
@@ -140,6 +293,118 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } token_buckets SEC(".maps");
 
+/* Three-color meter state per class */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CLASSES);
+    __type(key, __u32);
+    __type(value, struct meter_state);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} meter_state SEC(".maps");
+
+/* Source prefix -> subscriber (longest match) */
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, MAX_SUBSCRIBERS);
+    __type(key, struct subscriber_key);
+    __type(value, struct subscriber_info);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} subscriber_prefixes SEC(".maps");
+
+/* Token bucket per subscriber, indexed by subscriber id */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_SUBSCRIBERS);
+    __type(key, __u32);
+    __type(value, struct subscriber_bucket);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} subscriber_buckets SEC(".maps");
+
+/* Link-sharing buckets: one per class node plus the root at HTB_ROOT */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, HTB_NODES);
+    __type(key, __u32);
+    __type(value, struct htb_bucket);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} htb_buckets SEC(".maps");
+
+/* Link-sharing credit cached per CPU and class */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, MAX_CLASSES);
+    __type(key, __u32);
+    __type(value, struct htb_credit);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} htb_credit SEC(".maps");
+
+/* Per-stage profiling counters */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct prof_stats);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} prof_stats SEC(".maps");
+
+/* Behavioral classification decision table */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_BEHAVIOR_RULES);
+    __type(key, __u32);
+    __type(value, struct behavior_rule);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} behavior_rules SEC(".maps");
+
+/* Heavy-hitter count-min sketch (per CPU) */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct hh_sketch);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} hh_sketch SEC(".maps");
+
+/* Heavy-hitter top-k candidates (per CPU) */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct hh_topk);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} hh_topk SEC(".maps");
+
+/* Flows demoted to TC_BULK, with the time the demotion expires */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, HH_MAX_DEMOTED);
+    __type(key, struct flow_tuple);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} hh_demoted SEC(".maps");
+
+/* Close the current profiling stage and start the next one */
+static __always_inline void prof_mark(struct prof_stats *prof,
+                                      enum prof_stage stage, __u64 *t_stage)
+{
+    __u64 t = bpf_ktime_get_ns();
+    
+    if (stage >= PROF_STAGE_MAX)
+        return;
+    
+    prof->samples[stage]++;
+    prof->total_ns[stage] += t - *t_stage;
+    *t_stage = t;
+}
+
+/* Profiling hook: a no-op unless this packet was picked for sampling */
+#define PROF_MARK(stage)                                \
+    do {                                                \
+        if (prof_sample_rate && prof)                   \
+            prof_mark(prof, stage, &t_stage);           \
+    } while (0)
+
 /* Helper function: Calculate flow hash */
 static __always_inline __u32 __attribute__((unused)) calc_flow_hash(struct flow_tuple *flow)
 {
@@ -150,6 +415,256 @@ static __always_inline __u32 __attribute__((unused)) calc_flow_hash(struct flow_
     return hash;
 }
 
+/* Helper function: 32-bit finalizer (MurmurHash3 fmix32) */
+static __always_inline __u32 hash_mix(__u32 h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Helper function: Seeded hash of a flow tuple */
+static __always_inline __u32 flow_hash_seed(struct flow_tuple *flow, __u32 seed)
+{
+    __u32 h = hash_mix(seed ^ flow->src_ip);
+    
+    h = hash_mix(h ^ flow->dst_ip);
+    h = hash_mix(h ^ (((__u32)flow->src_port << 16) | flow->dst_port));
+    return hash_mix(h ^ flow->protocol);
+}
+
+/* Helper function: Record a sketch estimate in the per-CPU top-k table */
+static __always_inline void hh_topk_update(struct flow_tuple *flow,
+                                           __u64 bytes, __u32 window)
+{
+    struct hh_topk *topk;
+    __u32 key = 0, victim = 0;
+    __u64 victim_bytes = ~0ULL;
+    
+    topk = bpf_map_lookup_elem(&hh_topk, &key);
+    if (!topk)
+        return;
+    
+    /* Refresh the flow if present, else replace the smallest/stale entry */
+    #pragma unroll
+    for (int i = 0; i < HH_TOPK; i++) {
+        struct hh_entry *e = &topk->entries[i];
+        __u64 e_bytes = e->window == window ? e->bytes : 0;
+        
+        if (e->flow.src_ip == flow->src_ip && e->flow.dst_ip == flow->dst_ip &&
+            e->flow.src_port == flow->src_port &&
+            e->flow.dst_port == flow->dst_port &&
+            e->flow.protocol == flow->protocol) {
+            e->window = window;
+            e->bytes = bytes;
+            return;
+        }
+        
+        if (e_bytes < victim_bytes) {
+            victim_bytes = e_bytes;
+            victim = i;
+        }
+    }
+    
+    if (bytes > victim_bytes && victim < HH_TOPK) {
+        topk->entries[victim].flow = *flow;
+        topk->entries[victim].window = window;
+        topk->entries[victim].bytes = bytes;
+    }
+}
+
+/*
+ * Helper function: Count the packet in the heavy-hitter sketch and demote
+ * web/default flows above the configured rate to TC_BULK. Demotion is held
+ * for HH_HOLD_NS so a flow does not bounce back at each window boundary.
+ */
+static __always_inline __u32 hh_account(struct flow_tuple *flow,
+                                        __u32 class_id, __u32 pkt_len,
+                                        __u64 now, __u32 hw_hash,
+                                        struct global_config *gcfg,
+                                        struct cpu_stats *stats)
+{
+    struct hh_sketch *sk;
+    __u32 key = 0;
+    __u32 window = now / HH_WINDOW_NS;
+    __u32 tag = (window & 0xff) << HH_COUNT_BITS;
+    __u32 units = (pkt_len + (1 << HH_UNIT_SHIFT) - 1) >> HH_UNIT_SHIFT;
+    __u32 h1, h2, est = HH_COUNT_MASK;
+    __u64 threshold, bytes, *expires;
+    int crossed;
+    
+    sk = bpf_map_lookup_elem(&hh_sketch, &key);
+    if (!sk)
+        return class_id;
+    
+    /* d row indexes from two hashes (Kirsch-Mitzenmacher), or the NIC's */
+    if (hw_hash) {
+        h1 = hw_hash;
+        h2 = hash_mix(hw_hash) | 1;
+        if (stats)
+            __sync_fetch_and_add(&stats->hw_hash_packets, 1);
+    } else {
+        h1 = flow_hash_seed(flow, 0x9e3779b9);
+        h2 = flow_hash_seed(flow, 0x7f4a7c15) | 1;
+    }
+    
+    #pragma unroll
+    for (int i = 0; i < HH_DEPTH; i++) {
+        __u32 idx = (h1 + i * h2) & (HH_WIDTH - 1);
+        __u32 c = sk->counts[i][idx];
+        __u32 count = (c & ~HH_COUNT_MASK) == tag ? c & HH_COUNT_MASK : 0;
+        
+        count += units;
+        if (count > HH_COUNT_MASK)
+            count = HH_COUNT_MASK;
+        sk->counts[i][idx] = tag | count;
+        if (count < est)
+            est = count;
+    }
+    
+    /*
+     * Refresh the top-k only when the estimate crosses a 64 KB boundary,
+     * so large flows do not pay for it on every packet
+     */
+    bytes = (__u64)est << HH_UNIT_SHIFT;
+    crossed = (est >> 10) != ((est - units) >> 10);
+    if (crossed)
+        hh_topk_update(flow, bytes, window);
+    
+    if (class_id != TC_WEB && class_id != TC_DEFAULT)
+        return class_id;
+    
+    if (!gcfg || !gcfg->hh_threshold)
+        return class_id;
+    
+    /*
+     * Demote on the packet that reaches the threshold, then renew the hold
+     * at each 64 KB boundary while the flow stays above it
+     */
+    threshold = (__u64)gcfg->hh_threshold * HH_WINDOW_NS / NSEC_PER_SEC;
+    if (bytes >= threshold &&
+        (crossed || ((__u64)(est - units) << HH_UNIT_SHIFT) < threshold)) {
+        __u64 until = now + HH_HOLD_NS;
+        
+        bpf_map_update_elem(&hh_demoted, flow, &until, BPF_ANY);
+    } else {
+        expires = bpf_map_lookup_elem(&hh_demoted, flow);
+        if (!expires || *expires <= now)
+            return class_id;
+    }
+    
+    if (stats)
+        __sync_fetch_and_add(&stats->hh_demoted, 1);
+    return TC_BULK;
+}
+
+/*
+ * Helper function: Update a flow's behavioral features with one packet.
+ * EWMAs use gain 1/8 and the deviation gain 1/4, as in RFC 6298 RTT
+ * estimation, so everything is shifts and adds on Q4 values.
+ */
+static __always_inline void behav_update(struct flow_behav *fb,
+                                         struct flow_state *st, __u32 pkt_len,
+                                         __u64 now)
+{
+    __u64 gap_ns = now - st->last_seen;
+    __u32 iat_us = gap_ns > (1ULL << 30) ? (1U << 20) : (__u32)gap_ns / 1000;
+    __s32 err;
+    
+    err = (__s32)(pkt_len << 4) - (__s32)fb->size_ewma;
+    fb->size_ewma += err >> 3;
+    
+    if (st->packet_count == 1) {
+        /* Second packet: first inter-arrival sample */
+        fb->iat_ewma = iat_us << 4;
+        fb->iat_dev = iat_us << 3;
+    } else {
+        err = (__s32)(iat_us << 4) - (__s32)fb->iat_ewma;
+        fb->iat_ewma += err >> 3;
+        err = (err < 0 ? -err : err) - (__s32)fb->iat_dev;
+        fb->iat_dev += err >> 2;
+    }
+    
+    if (iat_us > BEHAV_BURST_GAP_US && fb->bursts < 0xffff)
+        fb->bursts++;
+}
+
+/* Helper function: Check a flow's features against one decision rule */
+static __always_inline int behav_match(struct behavior_rule *rule,
+                                       struct flow_behav *fb,
+                                       struct flow_state *st,
+                                       struct flow_tuple *flow,
+                                       __u32 dir_pct)
+{
+    __u32 size = fb->size_ewma >> 4;
+    __u32 iat = fb->iat_ewma >> 4;
+    __u32 jitter = fb->iat_dev >> 4;
+    __u64 burst_q4 = (st->packet_count << 4) / (fb->bursts ? fb->bursts : 1);
+    
+    if (!rule->enabled)
+        return 0;
+    if (rule->protocol && rule->protocol != flow->protocol)
+        return 0;
+    if (size < rule->size_min || (rule->size_max && size > rule->size_max))
+        return 0;
+    if (iat < rule->iat_min_us || (rule->iat_max_us && iat > rule->iat_max_us))
+        return 0;
+    if (rule->jitter_max_us && jitter > rule->jitter_max_us)
+        return 0;
+    if (rule->burst_max && burst_q4 > ((__u64)rule->burst_max << 4))
+        return 0;
+    if (dir_pct < rule->dir_min_pct ||
+        (rule->dir_max_pct && dir_pct > rule->dir_max_pct))
+        return 0;
+    
+    return 1;
+}
+
+/*
+ * Helper function: Judge a flow once it has seen enough packets. The
+ * direction ratio needs the reverse flow, which is looked up only here,
+ * once per flow (it is only populated where XDP sees both directions).
+ */
+static __always_inline void behav_decide(struct flow_behav *fb,
+                                         struct flow_state *st,
+                                         struct flow_tuple *flow)
+{
+    struct flow_tuple rev = {
+        .src_ip = flow->dst_ip,
+        .dst_ip = flow->src_ip,
+        .src_port = flow->dst_port,
+        .dst_port = flow->src_port,
+        .protocol = flow->protocol,
+    };
+    struct flow_state *rev_st;
+    __u64 rev_pkts = 0;
+    __u32 dir_pct;
+    
+    rev_st = bpf_map_lookup_elem(&flow_table, &rev);
+    if (rev_st)
+        rev_pkts = rev_st->packet_count;
+    dir_pct = rev_pkts * 100 / (rev_pkts + st->packet_count);
+    
+    st->behav_state = BEHAV_DECIDED;
+    
+    #pragma unroll
+    for (int i = 0; i < MAX_BEHAVIOR_RULES; i++) {
+        __u32 rule_idx = i;
+        struct behavior_rule *rule = bpf_map_lookup_elem(&behavior_rules,
+                                                         &rule_idx);
+        if (!rule)
+            continue;
+        
+        if (behav_match(rule, fb, st, flow, dir_pct)) {
+            st->behav_class = rule->class_id;
+            return;
+        }
+    }
+}
+
 /* Helper function: Parse Ethernet header */
 static __always_inline int parse_ethhdr(void *data, void *data_end,
                                         struct ethhdr **ethhdr)
@@ -173,10 +688,6 @@ static __always_inline int parse_ipv4(void *data, void *data_end,
     if ((void *)(iph + 1) > data_end)
         return -1;
     
-    /* Check for IP fragmentation */
-    if (iph->frag_off & bpf_htons(0x1FFF))
-        return -1;
-    
     flow->src_ip = iph->saddr;
     flow->dst_ip = iph->daddr;
     flow->protocol = iph->protocol;
@@ -215,16 +726,199 @@ static __always_inline int parse_udp(void *data, void *data_end,
     return 0;
 }
 
-/* Helper function: Classify packet based on rules */
-static __always_inline __u32 classify_packet(struct flow_tuple *flow)
+/*
+ * The IPv4 header carried by a tunnel packet, or NULL if the packet is not
+ * one of the supported encapsulations (or is truncated, or a fragment).
+ * The VNI or GRE key, if any, is stored in tenant.
+ */
+static __always_inline struct iphdr *tunnel_inner(struct iphdr *iph,
+                                                  void *data_end,
+                                                  __u8 *tenant)
 {
-    /* Iterate through classification rules (in priority order) */
-    /* Note: Limited to first 16 rules for BPF verifier */
+    void *l4 = (void *)iph + iph->ihl * 4;
+    void *inner;
+    __u16 proto;
+    
+    if (iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+        return NULL;
+    
+    if (iph->protocol == IPPROTO_IPIP) {
+        inner = l4;
+        proto = ETH_P_IP;
+    } else if (iph->protocol == IPPROTO_UDP) {
+        struct udphdr *udph = l4;
+        
+        if ((void *)(udph + 1) > data_end)
+            return NULL;
+        
+        if (udph->dest == bpf_htons(VXLAN_PORT)) {
+            struct vxlanhdr *vxh = (void *)(udph + 1);
+            
+            if ((void *)(vxh + 1) > data_end || !(vxh->flags & VXLAN_FLAG_VNI))
+                return NULL;
+            __builtin_memcpy(tenant, vxh->vni, 3);
+            inner = vxh + 1;
+            proto = ETH_P_TEB;
+        } else if (udph->dest == bpf_htons(GENEVE_PORT)) {
+            struct genevehdr *gnh = (void *)(udph + 1);
+            
+            if ((void *)(gnh + 1) > data_end)
+                return NULL;
+            __builtin_memcpy(tenant, gnh->vni, 3);
+            inner = (void *)(gnh + 1) + (gnh->opt_len & 0x3f) * 4;
+            proto = bpf_ntohs(gnh->protocol);
+        } else {
+            return NULL;
+        }
+    } else if (iph->protocol == IPPROTO_GRE) {
+        struct grehdr *greh = l4;
+        __u16 flags;
+        
+        if ((void *)(greh + 1) > data_end)
+            return NULL;
+        
+        /* Version 1 is PPTP's enhanced GRE, which carries PPP */
+        flags = bpf_ntohs(greh->flags);
+        if (flags & GRE_VERSION)
+            return NULL;
+        
+        inner = greh + 1;
+        if (flags & GRE_CSUM)
+            inner += 4;
+        if (flags & GRE_KEY) {
+            __u8 *key = inner;
+            
+            if ((void *)(key + 4) > data_end)
+                return NULL;
+            __builtin_memcpy(tenant, key + 1, 3);
+            inner += 4;
+        }
+        if (flags & GRE_SEQ)
+            inner += 4;
+        proto = bpf_ntohs(greh->protocol);
+    } else {
+        return NULL;
+    }
+    
+    /* VXLAN, NVGRE and most GENEVE carry Ethernet frames */
+    if (proto == ETH_P_TEB) {
+        struct ethhdr *eth = inner;
+        
+        if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+            return NULL;
+        inner = eth + 1;
+    } else if (proto != ETH_P_IP) {
+        return NULL;
+    }
+    
+    if (inner + sizeof(struct iphdr) > data_end)
+        return NULL;
+    return inner;
+}
+
+/*
+ * Peel up to TUNNEL_MAX_DEPTH encapsulations and return the header to
+ * classify on. The outer header stays the one that is marked and policed.
+ */
+static __always_inline struct iphdr *tunnel_decapsulate(struct iphdr *iph,
+                                                        void *data_end,
+                                                        struct flow_tuple *flow)
+{
+    struct iphdr *inner;
+    __u8 tenant[3] = {};
+    int depth;
+    
+    #pragma unroll
+    for (depth = 0; depth < TUNNEL_MAX_DEPTH; depth++) {
+        inner = tunnel_inner(iph, data_end, tenant);
+        if (!inner)
+            break;
+        iph = inner;
+    }
+    
+    if (depth)
+        __builtin_memcpy(flow->tenant, tenant, 3);
+    return iph;
+}
+
+static __always_inline void frag_key_init(struct frag_key *fk,
+                                          const struct iphdr *iph)
+{
+    fk->src_ip = iph->saddr;
+    fk->dst_ip = iph->daddr;
+    fk->id = iph->id;
+    fk->protocol = iph->protocol;
+    fk->pad = 0;
+}
+
+/* Non-first fragment: ports and class of its datagram, if seen */
+static __always_inline struct frag_entry *frag_lookup(const struct iphdr *iph,
+                                                      struct flow_tuple *flow,
+                                                      struct cpu_stats *stats)
+{
+    struct frag_entry *fe;
+    struct frag_key fk;
+    
+    frag_key_init(&fk, iph);
+    fe = bpf_map_lookup_elem(&frag_cache, &fk);
+    if (!fe) {
+        if (stats)
+            __sync_fetch_and_add(&stats->frag_misses, 1);
+        return NULL;
+    }
+    
+    if (stats)
+        __sync_fetch_and_add(&stats->frag_hits, 1);
+    flow->src_port = fe->src_port;
+    flow->dst_port = fe->dst_port;
+    return fe;
+}
+
+/* First fragment: remember what the rest of the datagram will need */
+static __always_inline void frag_remember(const struct iphdr *iph,
+                                          const struct flow_tuple *flow,
+                                          __u32 class_id)
+{
+    struct frag_entry fe = {
+        .src_port = flow->src_port,
+        .dst_port = flow->dst_port,
+        .class_id = class_id,
+    };
+    struct frag_key fk;
+    
+    frag_key_init(&fk, iph);
+    bpf_map_update_elem(&frag_cache, &fk, &fe, BPF_ANY);
+}
+
+/*
+ * Walk the active rule bank in its current order. Returns the matching
+ * rule's id and sets its class, or returns -1.
+ */
+static __always_inline int rule_bank_match(struct flow_tuple *flow,
+                                           __u16 *class_id,
+                                           struct cpu_stats *stats)
+{
+    struct rule_set *set;
+    struct rule_set rs;
+    __u32 key = 0;
+    int i;
+    
+    /* One read, so a bank switch mid-packet cannot mix two orders */
+    set = bpf_map_lookup_elem(&rule_set, &key);
+    if (!set)
+        return -1;
+    rs = *set;
+    
     /* Using bounded loop to satisfy BPF verifier */
     #pragma unroll
-    for (int i = 0; i < 16; i++) {
-        __u32 rule_idx = i;
-        struct class_rule *rule = bpf_map_lookup_elem(&class_rules, &rule_idx);
+    for (i = 0; i < RULE_BANK_SIZE; i++) {
+        __u32 rule_idx = rs.base + i;
+        struct class_rule *rule;
+        
+        if (i >= rs.count)
+            break;
+        
+        rule = bpf_map_lookup_elem(&class_rules, &rule_idx);
         if (!rule)
             continue;
         
@@ -232,6 +926,12 @@ static __always_inline __u32 classify_packet(struct flow_tuple *flow)
         if (rule->protocol && rule->protocol != flow->protocol)
             continue;
         
+        /* Check tunnel tenant */
+        if (rule->tenant && rule->tenant != (__u32)(flow->tenant[0] << 16 |
+                                                    flow->tenant[1] << 8 |
+                                                    flow->tenant[2]))
+            continue;
+        
         /* Check source IP */
         if (rule->src_ip_mask &&
             (flow->src_ip & rule->src_ip_mask) != (rule->src_ip & rule->src_ip_mask))
@@ -257,11 +957,63 @@ static __always_inline __u32 classify_packet(struct flow_tuple *flow)
         }
         
         /* Rule matched */
-        return rule->class_id;
+        if (stats)
+            __sync_fetch_and_add(&stats->rules_checked, i + 1);
+        *class_id = rule->class_id;
+        return rule->id;
     }
     
-    /* No rule matched - use default class */
-    return TC_DEFAULT;
+    if (stats)
+        __sync_fetch_and_add(&stats->rules_checked, i);
+    return -1;
+}
+
+/*
+ * A policy compiled by the control plane (-C) replaces the rule bank with
+ * policy_match(), the rules of one configuration as straight-line code
+ */
+#ifdef COMPILED_POLICY
+#include COMPILED_POLICY
+#endif
+
+/* Helper function: Classify packet based on rules */
+static __always_inline __u32 classify_packet(struct flow_tuple *flow, __u8 tos,
+                                             struct global_config *gcfg,
+                                             struct cpu_stats *stats)
+{
+    struct dscp_class_entry *dc = NULL;
+    __u16 class_id;
+    __u32 id;
+    int match;
+    
+    /* Upstream DSCP marks: either trusted outright or a fallback */
+    if (gcfg && (gcfg->flags & GLOBAL_FLAG_DSCP)) {
+        __u32 dscp = tos >> 2;
+        
+        dc = bpf_map_lookup_elem(&dscp_class, &dscp);
+        if (dc && !dc->enabled)
+            dc = NULL;
+        if (dc && (gcfg->flags & GLOBAL_FLAG_DSCP_FIRST))
+            return dc->class_id;
+    }
+    
+#ifdef COMPILED_POLICY
+    match = policy_match(flow, &class_id);
+#else
+    match = rule_bank_match(flow, &class_id, stats);
+#endif
+    if (match >= 0) {
+        __u64 *hits;
+        
+        id = match;
+        hits = bpf_map_lookup_elem(&rule_hits, &id);
+        if (hits)
+            __sync_fetch_and_add(hits, 1);
+        return class_id;
+    }
+    
+    /* No rule matched - use the DSCP mapping, else the default class */
+    return dc ? dc->class_id : TC_DEFAULT;
 }
 
 /* Helper function: Update token bucket */
@@ -294,24 +1046,491 @@ static __always_inline int update_token_bucket(struct token_bucket *tb,
     return 0;  /* Packet dropped */
 }
 
-/* Main XDP program */
-SEC("xdp")
-int xdp_packet_classifier(struct xdp_md *ctx)
+/*
+ * Color a packet with the class's three-color meter (color-blind).
+ * srTCM (RFC 2697): tokens at CIR fill the committed bucket, and whatever
+ * overflows CBS fills the excess bucket. trTCM (RFC 2698): the committed
+ * bucket fills at CIR and the peak bucket at PIR, and a packet needs peak
+ * tokens to be anything but red.
+ */
+static __always_inline int meter_color(struct meter_state *m,
+                                       struct class_config *cfg,
+                                       __u32 pkt_len, __u64 now)
+{
+    __u64 elapsed = 0;
+    int color;
+    
+    bpf_spin_lock(&m->lock);
+    if (now > m->last_update) {
+        elapsed = now - m->last_update;
+        if (elapsed > NSEC_PER_SEC)
+            elapsed = NSEC_PER_SEC;
+        m->last_update = now;
+    }
+    
+    m->tc += (__u64)cfg->rate_limit * elapsed / NSEC_PER_SEC;
+    
+    if (cfg->meter == METER_TRTCM) {
+        if (m->tc > cfg->burst_size)
+            m->tc = cfg->burst_size;
+        m->te += (__u64)cfg->peak_rate * elapsed / NSEC_PER_SEC;
+        if (m->te > cfg->excess_burst)
+            m->te = cfg->excess_burst;
+        
+        if (m->te < pkt_len) {
+            color = METER_RED;
+        } else if (m->tc < pkt_len) {
+            m->te -= pkt_len;
+            color = METER_YELLOW;
+        } else {
+            m->te -= pkt_len;
+            m->tc -= pkt_len;
+            color = METER_GREEN;
+        }
+    } else {
+        if (m->tc > cfg->burst_size) {
+            m->te += m->tc - cfg->burst_size;
+            m->tc = cfg->burst_size;
+            if (m->te > cfg->excess_burst)
+                m->te = cfg->excess_burst;
+        }
+        
+        if (m->tc >= pkt_len) {
+            m->tc -= pkt_len;
+            color = METER_GREEN;
+        } else if (m->te >= pkt_len) {
+            m->te -= pkt_len;
+            color = METER_YELLOW;
+        } else {
+            color = METER_RED;
+        }
+    }
+    bpf_spin_unlock(&m->lock);
+    
+    return color;
+}
+
+/*
+ * Act on the meter's color. Yellow packets are remarked to a lower DSCP
+ * and/or moved to yellow_class (updating *class_id); red packets are
+ * dropped, or CE-marked when the class allows it and the packet is ECT.
+ * Returns 0 to drop.
+ */
+static __always_inline int meter_packet(struct iphdr *iph,
+                                        struct class_config *cfg,
+                                        __u32 *class_id, __u32 pkt_len,
+                                        __u64 now, struct queue_stats *qstats)
+{
+    struct meter_state *m;
+    __u8 tos = iph->tos;
+    __sum16 check = iph->check;
+    int color;
+    
+    m = bpf_map_lookup_elem(&meter_state, class_id);
+    if (!m)
+        return 1;
+    
+    color = meter_color(m, cfg, pkt_len, now);
+    if (color == METER_GREEN)
+        return 1;
+    
+    if (color == METER_RED) {
+        if (qstats)
+            __sync_fetch_and_add(&qstats->meter_red, 1);
+        
+        if (!(cfg->flags & CLASS_FLAG_RED_ECN) || ipv4_set_ce(&tos, &check) < 0)
+            return 0;
+    } else {
+        if (qstats)
+            __sync_fetch_and_add(&qstats->meter_yellow, 1);
+        
+        if (cfg->flags & CLASS_FLAG_YELLOW_DSCP)
+            ipv4_change_tos(&tos, &check, (cfg->yellow_dscp << 2) |
+                                          (tos & INET_ECN_MASK));
+        
+        if (cfg->yellow_class && cfg->yellow_class < MAX_CLASSES)
+            *class_id = cfg->yellow_class;
+    }
+    
+    /* iphdr is packed, so the rewrite goes through local copies */
+    iph->tos = tos;
+    iph->check = check;
+    
+    return 1;
+}
+
+/*
+ * Police a packet against its source subscriber's contract. Subscribers
+ * spread their flows over CPUs, so the bucket is shared under a lock;
+ * contention is limited to one subscriber's own traffic.
+ */
+static __always_inline int subscriber_police(__u32 saddr, __u32 pkt_len,
+                                             __u64 now)
+{
+    struct subscriber_key key = { .prefixlen = 32, .addr = saddr };
+    struct subscriber_info *sub;
+    struct subscriber_bucket *b;
+    __u64 tokens;
+    int ok = 0;
+    
+    sub = bpf_map_lookup_elem(&subscriber_prefixes, &key);
+    if (!sub || !sub->rate)
+        return 1;
+    
+    b = bpf_map_lookup_elem(&subscriber_buckets, &sub->id);
+    if (!b)
+        return 1;
+    
+    bpf_spin_lock(&b->lock);
+    tokens = b->tokens;
+    if (now > b->last_update) {
+        __u64 elapsed = now - b->last_update;
+        
+        if (elapsed > NSEC_PER_SEC)
+            elapsed = NSEC_PER_SEC;
+        tokens += (__u64)sub->rate * elapsed / NSEC_PER_SEC;
+        if (tokens > sub->burst)
+            tokens = sub->burst;
+        b->last_update = now;
+    }
+    if (tokens >= pkt_len) {
+        tokens -= pkt_len;
+        ok = 1;
+    }
+    b->tokens = tokens;
+    bpf_spin_unlock(&b->lock);
+    
+    return ok;
+}
+
+/* Ceiling of a class node: max_bandwidth, else rate_limit (0 = none) */
+static __always_inline __u32 htb_ceil_rate(struct class_config *cfg)
+{
+    return cfg->max_bandwidth ? cfg->max_bandwidth : cfg->rate_limit;
+}
+
+/* Bucket depth of a class node; never below one full chunk */
+static __always_inline __s64 htb_class_burst(struct class_config *cfg)
+{
+    if (!cfg->burst_size)
+        return HTB_DEFAULT_BURST;
+    
+    return cfg->burst_size < HTB_CHUNK_MAX ? HTB_CHUNK_MAX : cfg->burst_size;
+}
+
+/* Bucket depth of the root: HTB_ROOT_BURST_NS worth of the link */
+static __always_inline __s64 htb_root_burst(struct global_config *gcfg)
+{
+    __u64 burst = (__u64)gcfg->total_rate_limit * HTB_ROOT_BURST_NS / NSEC_PER_SEC;
+    
+    return burst < HTB_DEFAULT_BURST ? HTB_DEFAULT_BURST : burst;
+}
+
+/* Credit taken from a shared bucket at once: 1 ms of rate, at least a packet */
+static __always_inline __s64 htb_chunk(__u32 rate, __u32 pkt_len)
+{
+    __u64 chunk = (__u64)rate * HTB_CHUNK_NS / NSEC_PER_SEC;
+    
+    if (chunk > HTB_CHUNK_MAX)
+        chunk = HTB_CHUNK_MAX;
+    if (chunk < pkt_len)
+        chunk = pkt_len;
+    
+    return chunk;
+}
+
+/* Refill both token counts of a shared bucket; caller holds b->lock */
+static __always_inline void htb_refill(struct htb_bucket *b, __u64 now,
+                                       __u32 assured_rate, __u32 ceil_rate,
+                                       __s64 burst)
+{
+    __u64 elapsed;
+    
+    /* Another CPU may already have refilled with a later timestamp */
+    if (now <= b->last_update)
+        return;
+    
+    elapsed = now - b->last_update;
+    if (elapsed > NSEC_PER_SEC)
+        elapsed = NSEC_PER_SEC;
+    b->last_update = now;
+    
+    b->assured += (__u64)assured_rate * elapsed / NSEC_PER_SEC;
+    if (b->assured > burst)
+        b->assured = burst;
+    
+    b->ceil += (__u64)ceil_rate * elapsed / NSEC_PER_SEC;
+    if (b->ceil > burst)
+        b->ceil = burst;
+}
+
+/*
+ * Charge amount to the ceiling of class_id and of each ancestor up to the
+ * root. Borrowed credit (force == 0) must fit at every level, otherwise the
+ * levels already charged are refunded. Guaranteed credit (force == 1) is
+ * charged unconditionally, so borrowers only get what guarantees left idle.
+ * Chains deeper than HTB_MAX_DEPTH are cut short at the root.
+ */
+static __always_inline int htb_charge(__u32 class_id, __s64 amount, __u64 now,
+                                      struct global_config *gcfg, int force)
+{
+    __u32 ids[HTB_MAX_DEPTH + 1];
+    __u32 charged = 0;
+    __u32 id = class_id;
+    int ok = 1;
+    
+    #pragma unroll
+    for (int depth = 0; depth <= HTB_MAX_DEPTH; depth++) {
+        struct class_config *cfg = NULL;
+        struct htb_bucket *b;
+        __u32 rate;
+        __s64 burst;
+        
+        if (depth == HTB_MAX_DEPTH)
+            id = HTB_ROOT;
+        
+        if (id == HTB_ROOT) {
+            rate = gcfg->total_rate_limit;
+            burst = htb_root_burst(gcfg);
+        } else {
+            cfg = bpf_map_lookup_elem(&class_config, &id);
+            if (!cfg)
+                break;
+            rate = htb_ceil_rate(cfg);
+            burst = htb_class_burst(cfg);
+        }
+        
+        /* A node without a ceiling passes its children's traffic through */
+        b = bpf_map_lookup_elem(&htb_buckets, &id);
+        if (b && rate) {
+            bpf_spin_lock(&b->lock);
+            htb_refill(b, now, cfg ? cfg->min_bandwidth : 0, rate, burst);
+            if (!force && b->ceil < amount) {
+                ok = 0;
+            } else {
+                b->ceil -= amount;
+                if (b->ceil < -burst)
+                    b->ceil = -burst;
+            }
+            bpf_spin_unlock(&b->lock);
+            
+            if (!ok)
+                break;
+            ids[depth] = id;
+            charged |= 1U << depth;
+        }
+        
+        if (id == HTB_ROOT)
+            break;
+        id = cfg->parent ? cfg->parent - 1 : HTB_ROOT;
+        if (id >= MAX_CLASSES)
+            id = HTB_ROOT;
+    }
+    
+    if (ok)
+        return 1;
+    
+    /* Give back what the levels below the exhausted one already lent */
+    #pragma unroll
+    for (int depth = 0; depth <= HTB_MAX_DEPTH; depth++) {
+        struct htb_bucket *b;
+        
+        if (!(charged & (1U << depth)))
+            continue;
+        
+        b = bpf_map_lookup_elem(&htb_buckets, &ids[depth]);
+        if (b) {
+            bpf_spin_lock(&b->lock);
+            b->ceil += amount;
+            bpf_spin_unlock(&b->lock);
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Hierarchical link sharing. Traffic within min_bandwidth is always sent;
+ * above it a class borrows idle capacity, bounded by its own ceiling, each
+ * ancestor's ceiling and total_rate_limit. Credit is spent from a per-CPU
+ * cache and taken from the shared buckets a chunk at a time, so at most
+ * one chunk per CPU and class is outstanding.
+ */
+static __always_inline int htb_police(__u32 class_id, struct class_config *cfg,
+                                      struct global_config *gcfg,
+                                      __u32 pkt_len, __u64 now,
+                                      struct queue_stats *qstats)
+{
+    struct htb_credit *cr;
+    struct htb_bucket *b;
+    __u32 rate;
+    __s64 chunk;
+    int got = 0;
+    
+    cr = bpf_map_lookup_elem(&htb_credit, &class_id);
+    if (!cr)
+        return 1;
+    
+    /* Within the guarantee */
+    if (cr->assured >= pkt_len) {
+        cr->assured -= pkt_len;
+        return 1;
+    }
+    
+    if (cfg->min_bandwidth) {
+        chunk = htb_chunk(cfg->min_bandwidth, pkt_len);
+        b = bpf_map_lookup_elem(&htb_buckets, &class_id);
+        if (b) {
+            bpf_spin_lock(&b->lock);
+            htb_refill(b, now, cfg->min_bandwidth, htb_ceil_rate(cfg),
+                       htb_class_burst(cfg));
+            if (b->assured >= chunk) {
+                b->assured -= chunk;
+                got = 1;
+            }
+            bpf_spin_unlock(&b->lock);
+        }
+        
+        if (got) {
+            htb_charge(class_id, chunk, now, gcfg, 1);
+            cr->assured += chunk - pkt_len;
+            return 1;
+        }
+    }
+    
+    /* Above the guarantee: borrow up the tree */
+    if (cr->borrowed < pkt_len) {
+        rate = htb_ceil_rate(cfg);
+        chunk = htb_chunk(rate ? rate : gcfg->total_rate_limit, pkt_len);
+        if (!htb_charge(class_id, chunk, now, gcfg, 0))
+            return 0;
+        cr->borrowed += chunk;
+    }
+    cr->borrowed -= pkt_len;
+    
+    if (qstats)
+        __sync_fetch_and_add(&qstats->borrowed_bytes, pkt_len);
+    
+    return 1;
+}
+
+/*
+ * Flow export bookkeeping for one packet of a tracked flow: the flow's
+ * accounting entry, created on its first packet, and an active-timeout
+ * record once one is due. Records go out without a wakeup; the control
+ * plane drains the ring on its own schedule. Returns the entry, so a drop
+ * can be charged to it.
+ */
+static __always_inline struct flow_acct *flow_export_account(struct flow_tuple *flow,
+                                                             struct flow_state *st,
+                                                             __u64 now,
+                                                             struct cpu_stats *stats)
+{
+    struct flow_acct *acct;
+    struct flow_record *rec;
+    
+    acct = bpf_map_lookup_elem(&flow_acct, flow);
+    if (!acct) {
+        struct flow_acct new_acct = {
+            .first_seen = now,
+            .last_export = now,
+        };
+        
+        bpf_map_update_elem(&flow_acct, flow, &new_acct, BPF_NOEXIST);
+        return bpf_map_lookup_elem(&flow_acct, flow);
+    }
+    
+    if (!flow_active_timeout ||
+        now - acct->last_export < (__u64)flow_active_timeout * 1000000000ULL)
+        return acct;
+    
+    /* Claimed before the record is built, so other CPUs skip it */
+    acct->last_export = now;
+    
+    rec = bpf_ringbuf_reserve(&flow_records, sizeof(*rec), 0);
+    if (!rec) {
+        if (stats)
+            __sync_fetch_and_add(&stats->flow_records_lost, 1);
+        return acct;
+    }
+    
+    rec->flow = *flow;
+    rec->first_seen = acct->first_seen;
+    rec->last_seen = st->last_seen;
+    rec->packets = st->packet_count;
+    rec->bytes = st->byte_count;
+    rec->dropped = acct->dropped_packets;
+    rec->class_id = st->class_id;
+    rec->end_reason = FLOW_END_ACTIVE;
+    __builtin_memset(rec->pad, 0, sizeof(rec->pad));
+    bpf_ringbuf_submit(rec, BPF_RB_NO_WAKEUP);
+    
+    return acct;
+}
+
+/*
+ * Read the NIC's RX metadata. Returns the RX hash if it covers the L4
+ * ports and so tells flows apart (0 otherwise). The RX timestamp gives
+ * the time the packet waited in the ring before this program. Hardware
+ * clocks are compared with CLOCK_TAI, which PTP-synchronised PHCs follow;
+ * a delay outside [0, HW_TS_MAX_DELAY_NS) means they are not in sync, and
+ * the sample is skipped.
+ */
+static __always_inline __u32 rx_metadata(struct xdp_md *ctx,
+                                         struct cpu_stats *stats)
+{
+    enum xdp_rss_hash_type rss_type = 0;
+    __u32 hash = 0;
+    __u64 ts = 0, delay;
+    
+    if (stats && bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp) &&
+        bpf_xdp_metadata_rx_timestamp(ctx, &ts) == 0) {
+        delay = bpf_ktime_get_tai_ns() - ts;
+        if (delay < HW_TS_MAX_DELAY_NS) {
+            __sync_fetch_and_add(&stats->hw_ts_packets, 1);
+            __sync_fetch_and_add(&stats->hw_ts_delay_ns, delay);
+        }
+    }
+    
+    if (!bpf_ksym_exists(bpf_xdp_metadata_rx_hash) ||
+        bpf_xdp_metadata_rx_hash(ctx, &hash, &rss_type) != 0 ||
+        !(rss_type & XDP_RSS_L4))
+        return 0;
+    
+    return hash;
+}
+
+/*
+ * Classify and police one frame. Headers are parsed from the first buffer;
+ * pkt_len is the length of the whole frame, which for a multi-buffer frame
+ * includes its fragments.
+ */
+static __always_inline int classify_frame(struct xdp_md *ctx, __u32 pkt_len)
 {
     void *data_end = (void *)(long)ctx->data_end;
     void *data = (void *)(long)ctx->data;
     struct ethhdr *eth;
-    struct iphdr *iph;
+    struct iphdr *iph, *inner;
     struct flow_tuple flow = {};
     struct flow_state *flow_st;
+    struct flow_acct *acct = NULL;
     struct cpu_stats *stats;
+    struct rxq_stats *rxq;
     struct class_config *class_cfg;
     struct token_bucket *tb;
+    struct global_config *gcfg;
+    struct queue_stats *qstats;
+    struct prof_stats *prof = NULL;
     __u32 key = 0;
+    __u32 rxq_idx = ctx->rx_queue_index;
+    __u32 *pinned_cpu;
+    struct frag_entry *frag = NULL;
+    __u16 frag_off;
+    __u32 hw_hash = 0;
     __u32 class_id;
-    __u32 pkt_len;
-    __u64 now;
+    __u64 now, t_stage = 0;
     int eth_type, ip_proto;
+    int allowed = 1;
     
     /* Get current timestamp */
     now = bpf_ktime_get_ns();
@@ -322,6 +1541,29 @@ int xdp_packet_classifier(struct xdp_md *ctx)
         __sync_fetch_and_add(&stats->total_packets, 1);
     }
     
+    /* Per-RX-queue load, to spot imbalance and misplaced IRQs */
+    rxq = bpf_map_lookup_elem(&rxq_stats, &rxq_idx);
+    if (rxq) {
+        __sync_fetch_and_add(&rxq->packets, 1);
+        __sync_fetch_and_add(&rxq->bytes, pkt_len);
+        
+        pinned_cpu = bpf_map_lookup_elem(&rxq_cpu, &rxq_idx);
+        if (pinned_cpu && *pinned_cpu &&
+            *pinned_cpu != bpf_get_smp_processor_id() + 1)
+            __sync_fetch_and_add(&rxq->misplaced, 1);
+    }
+    
+    /* Sample 1 in N packets for per-stage profiling */
+    if (prof_sample_rate && stats &&
+        stats->total_packets % prof_sample_rate == 0) {
+        prof = bpf_map_lookup_elem(&prof_stats, &key);
+        t_stage = bpf_ktime_get_ns();
+    }
+    
+    /* NIC RX hash and timestamp, when loaded device-bound */
+    if (hw_metadata)
+        hw_hash = rx_metadata(ctx, stats);
+    
     /* Parse Ethernet header */
     eth_type = parse_ethhdr(data, data_end, &eth);
     if (eth_type < 0)
@@ -336,32 +1578,67 @@ int xdp_packet_classifier(struct xdp_md *ctx)
     if (ip_proto < 0)
         goto pass;
     
-    /* Parse transport layer */
-    void *l4_hdr = data + sizeof(*eth) + (iph->ihl * 4);
+    /* Overlay traffic is classified and tracked on its inner headers */
+    inner = iph;
+    if (tunnel_decap) {
+        inner = tunnel_decapsulate(iph, data_end, &flow);
+        if (inner != iph) {
+            ip_proto = parse_ipv4(inner, data_end, &inner, &flow);
+            if (ip_proto < 0)
+                goto pass;
+            if (stats)
+                __sync_fetch_and_add(&stats->tunnel_packets, 1);
+            
+            /* The NIC hashed the outer header, which all inner flows share */
+            hw_hash = 0;
+        }
+    }
     
-    if (ip_proto == IPPROTO_TCP) {
-        if (parse_tcp(l4_hdr, data_end, &flow) < 0)
+    /* Fragments after the first have no L4 header to parse */
+    frag_off = bpf_ntohs(inner->frag_off);
+    if (frag_off & IP_OFFSET) {
+        frag = frag_lookup(inner, &flow, stats);
+        if (!frag)
             goto pass;
-    } else if (ip_proto == IPPROTO_UDP) {
-        if (parse_udp(l4_hdr, data_end, &flow) < 0)
-            goto pass;
-    } else if (ip_proto == IPPROTO_ICMP) {
-        /* ICMP doesn't have ports */
-        flow.src_port = 0;
-        flow.dst_port = 0;
     } else {
-        /* Other protocols - classify based on IP only */
-        flow.src_port = 0;
-        flow.dst_port = 0;
+        /* Parse transport layer */
+        void *l4_hdr = (void *)inner + (inner->ihl * 4);
+        
+        if (ip_proto == IPPROTO_TCP) {
+            if (parse_tcp(l4_hdr, data_end, &flow) < 0)
+                goto pass;
+        } else if (ip_proto == IPPROTO_UDP) {
+            if (parse_udp(l4_hdr, data_end, &flow) < 0)
+                goto pass;
+        } else if (ip_proto == IPPROTO_ICMP) {
+            /* ICMP doesn't have ports */
+            flow.src_port = 0;
+            flow.dst_port = 0;
+        } else {
+            /* Other protocols - classify based on IP only */
+            flow.src_port = 0;
+            flow.dst_port = 0;
+        }
     }
+    PROF_MARK(PROF_STAGE_PARSE);
     
-    /* Classify packet */
-    class_id = classify_packet(&flow);
+    /* Classify packet (fragments inherit the class), then demote heavy hitters */
+    gcfg = bpf_map_lookup_elem(&global_config, &key);
+    if (frag) {
+        class_id = frag->class_id;
+    } else {
+        class_id = classify_packet(&flow, inner->tos, gcfg, stats);
+        if (frag_off & IP_MF)
+            frag_remember(inner, &flow, class_id);
+    }
+    class_id = hh_account(&flow, class_id, pkt_len, now, hw_hash, gcfg,
+                          stats);
+    PROF_MARK(PROF_STAGE_CLASSIFY);
     
     /* Update statistics */
     if (stats) {
         __sync_fetch_and_add(&stats->classified_packets, 1);
-        __sync_fetch_and_add(&stats->total_bytes, (data_end - data));
+        __sync_fetch_and_add(&stats->total_bytes, pkt_len);
     }
     
     /* Lookup or create flow state */
@@ -370,52 +1647,134 @@ int xdp_packet_classifier(struct xdp_md *ctx)
         /* New flow - create state */
         struct flow_state new_flow = {
             .packet_count = 1,
-            .byte_count = data_end - data,
+            .byte_count = pkt_len,
             .last_seen = now,
             .class_id = class_id,
-            .queue_id = 0,
-            .tokens = 0,
-            .last_token_update = now,
-            .priority = 0,
-            .weight = 1,
-            .deficit = 0,
         };
         
         bpf_map_update_elem(&flow_table, &flow, &new_flow, BPF_ANY);
+        
+        /* Unknown (web/default) flows are judged by their behavior */
+        if (gcfg && gcfg->behav_min_packets &&
+            (class_id == TC_WEB || class_id == TC_DEFAULT)) {
+            struct flow_behav new_behav = {
+                .size_ewma = pkt_len << 4,
+                .bursts = 1,
+            };
+            
+            bpf_map_update_elem(&flow_behav, &flow, &new_behav, BPF_ANY);
+        }
     } else {
+        /* Behavioral features for unknown (web/default) flows */
+        if (flow_st->behav_state == BEHAV_LEARNING &&
+            (class_id == TC_WEB || class_id == TC_DEFAULT) &&
+            gcfg && gcfg->behav_min_packets) {
+            struct flow_behav *fb = bpf_map_lookup_elem(&flow_behav, &flow);
+            
+            if (!fb) {
+                /* Evicted before its verdict: stays where the rules put it */
+                flow_st->behav_state = BEHAV_DECIDED;
+            } else {
+                behav_update(fb, flow_st, pkt_len, now);
+                if (flow_st->packet_count + 1 >= gcfg->behav_min_packets) {
+                    behav_decide(fb, flow_st, &flow);
+                    bpf_map_delete_elem(&flow_behav, &flow);
+                }
+            }
+        }
+        
+        /* A behavioral promotion overrides the web/default rule match */
+        if (flow_st->behav_class &&
+            (class_id == TC_WEB || class_id == TC_DEFAULT))
+            class_id = flow_st->behav_class;
+        
         /* Update existing flow */
         __sync_fetch_and_add(&flow_st->packet_count, 1);
-        __sync_fetch_and_add(&flow_st->byte_count, (data_end - data));
+        __sync_fetch_and_add(&flow_st->byte_count, pkt_len);
         flow_st->last_seen = now;
         flow_st->class_id = class_id;
     }
     
+    /* Flow export: start time, drops and active-timeout records */
+    if (flow_export) {
+        if (!flow_st)
+            flow_st = bpf_map_lookup_elem(&flow_table, &flow);
+        if (flow_st)
+            acct = flow_export_account(&flow, flow_st, now, stats);
+    }
+    PROF_MARK(PROF_STAGE_FLOW);
+    
     /* Get class configuration */
     class_cfg = bpf_map_lookup_elem(&class_config, &class_id);
     if (!class_cfg)
         goto pass;
     
-    /* Token bucket rate limiting */
-    tb = bpf_map_lookup_elem(&token_buckets, &class_id);
-    if (tb && tb->rate > 0) {
-        pkt_len = data_end - data;
-        if (!update_token_bucket(tb, pkt_len, now)) {
-            /* Rate limit exceeded - drop packet */
-            if (stats)
-                __sync_fetch_and_add(&stats->dropped_packets, 1);
-            
-            if (stats)
-                __sync_fetch_and_add(&stats->xdp_drop, 1);
-            
-            return XDP_DROP;
+    qstats = bpf_map_lookup_elem(&queue_stats, &class_id);
+    
+    /*
+     * Subscriber first, so a subscriber over its contract cannot use up
+     * class credit that other subscribers in the same class need.
+     */
+    if (gcfg && (gcfg->flags & GLOBAL_FLAG_SUBSCRIBERS)) {
+        /* Outer source: inner addresses of different tenants can overlap */
+        allowed = subscriber_police(iph->saddr, pkt_len, now);
+        if (!allowed && stats)
+            __sync_fetch_and_add(&stats->sub_dropped, 1);
+    }
+    
+    /* Three-color meter; a yellow packet may move to a lower class */
+    if (allowed && class_cfg->meter != METER_NONE) {
+        __u32 metered_class = class_id;
+        
+        allowed = meter_packet(iph, class_cfg, &class_id, pkt_len, now, qstats);
+        if (class_id != metered_class) {
+            class_cfg = bpf_map_lookup_elem(&class_config, &class_id);
+            if (!class_cfg)
+                goto pass;
+            qstats = bpf_map_lookup_elem(&queue_stats, &class_id);
         }
     }
     
+    /*
+     * Class limits then apply within the subscriber: link sharing when it
+     * is configured, else per-class token buckets, which a metered class
+     * does without.
+     */
+    if (allowed && gcfg && (gcfg->flags & GLOBAL_FLAG_LINK_SHARING) &&
+        gcfg->total_rate_limit) {
+        allowed = htb_police(class_id, class_cfg, gcfg, pkt_len, now, qstats);
+    } else if (allowed && class_cfg->meter == METER_NONE) {
+        tb = bpf_map_lookup_elem(&token_buckets, &class_id);
+        if (tb && tb->rate > 0)
+            allowed = update_token_bucket(tb, pkt_len, now);
+    }
+    PROF_MARK(PROF_STAGE_POLICE);
+    
+    if (!allowed) {
+        /* Rate limit exceeded - drop packet */
+        if (stats) {
+            __sync_fetch_and_add(&stats->dropped_packets, 1);
+            __sync_fetch_and_add(&stats->xdp_drop, 1);
+        }
+        
+        if (rxq)
+            __sync_fetch_and_add(&rxq->dropped, 1);
+        
+        if (acct)
+            __sync_fetch_and_add(&acct->dropped_packets, 1);
+        
+        if (qstats) {
+            __sync_fetch_and_add(&qstats->dropped_packets, 1);
+            __sync_fetch_and_add(&qstats->dropped_bytes, pkt_len);
+        }
+        
+        return XDP_DROP;
+    }
+    
     /* Update queue statistics */
-    struct queue_stats *qstats = bpf_map_lookup_elem(&queue_stats, &class_id);
     if (qstats) {
         __sync_fetch_and_add(&qstats->enqueued_packets, 1);
-        __sync_fetch_and_add(&qstats->enqueued_bytes, (data_end - data));
+        __sync_fetch_and_add(&qstats->enqueued_bytes, pkt_len);
     }
     
     if (stats)
@@ -430,4 +1789,18 @@ pass:
     return XDP_PASS;
 }
 
+/* Main XDP program */
+SEC("xdp")
+int xdp_packet_classifier(struct xdp_md *ctx)
+{
+    return classify_frame(ctx, ctx->data_end - ctx->data);
+}
+
+/* Multi-buffer variant for jumbo frames, loaded when the MTU needs it */
+SEC("xdp.frags")
+int xdp_packet_classifier_frags(struct xdp_md *ctx)
+{
+    return classify_frame(ctx, bpf_xdp_get_buff_len(ctx));
+}
+
 char _license[] SEC("license") = "GPL";